@@ -3,6 +3,27 @@
 
 #include <stddef.h>
 
+#define LOG_BUFFER_SIZE    16384 // size of the buffer gathering the messages of a thread
+#define LOG_QUEUE_SIZE     (64 * LOG_BUFFER_SIZE) // size of the queue of the writer thread (MSM_LOG_ASYNC)
+#define LOG_LEVEL_UNREAD   (-1) // level before the environment is read
+#define LOG_LEVEL_NONE     0 // no message is logged
+#define LOG_LEVEL_ERROR    1 // failures and misuses of the allocator
+#define LOG_LEVEL_WARN     2 // failures the allocator recovers from
+#define LOG_LEVEL_INFO     3 // tunables and memory taken from or given back to the OS
+#define LOG_LEVEL_TRACE    4 // calls and returns of the functions
+
+// Most verbose level compiled in, the calls above it compile to nothing (make LOG_LEVEL=n)
+#ifndef LOG_LEVEL
+#define LOG_LEVEL          LOG_LEVEL_TRACE
+#endif
+
+// Log a message of a level, its arguments are evaluated only when the level is logged
+#define MY_LOG(level, ...)    do { if ((level) <= LOG_LEVEL && (level) <= (my_log_level != LOG_LEVEL_UNREAD ? my_log_level : my_log_init())) my_log_message(__VA_ARGS__); } while (0)
+#define LOG_ERROR(...)        MY_LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)         MY_LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)         MY_LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_TRACE(...)        MY_LOG(LOG_LEVEL_TRACE, __VA_ARGS__)
+
 /**
  * @file log.h
  * @brief Header file for logging functions.
@@ -11,6 +32,15 @@
  * throughout the project.
  */
 
+extern int    my_log_level; ///< Most verbose level logged (MSM_LOG_LEVEL), LOG_LEVEL_NONE when MSM_OUTPUT is not set
+
+/**
+ * @brief Function to read the log file and level from the environment.
+ *
+ * @return int The most verbose level logged.
+ */
+int    my_log_init();
+
 /**
  * @brief Function to log a formatted message to a log file.
  *
@@ -22,4 +52,21 @@
  */
 int    my_log_message(const char *format, ...);
 
+/**
+ * @brief Function to write the messages gathered by the calling thread.
+ *
+ * The messages are otherwise written when the buffer of the thread is full,
+ * when an error is logged, when the thread exits, before a fork and at exit.
+ *
+ * @return int Return 0 on success, or -1 on failure.
+ */
+int    my_log_flush();
+
+/**
+ * @brief Function to get the number of messages dropped because the queue of the writer thread was full.
+ *
+ * @return size_t The number of messages dropped.
+ */
+size_t    my_log_dropped();
+
 #endif // LOG_H
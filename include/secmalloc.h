@@ -12,6 +12,47 @@
  * functions used throughout the project.
  */
 
+#ifndef M_MXFAST
+#define M_MXFAST                   1 // mallopt parameter: maximal size of the blocks taken back from the quick-reuse cache
+#endif
+#ifndef M_TOP_PAD
+#define M_TOP_PAD                  -2 // mallopt parameter: minimal growth step of the heaps
+#endif
+#ifndef M_MMAP_THRESHOLD
+#define M_MMAP_THRESHOLD           -3 // mallopt parameter: minimal size of the blocks served by the buddy zone
+#endif
+#define M_SECMALLOC_CANARY         -100 // mallopt parameter: whether the canaries are verified
+#define M_SECMALLOC_SCRUB          -101 // mallopt parameter: whether the freed blocks are cleaned
+#define M_SECMALLOC_DEFER          -102 // mallopt parameter: number of frees whose merge is deferred
+#define M_SECMALLOC_QUARANTINE     -103 // mallopt parameter: percentage of the committed data held in quarantine
+#define M_SECMALLOC_PURGE_DECAY    -104 // mallopt parameter: time in milliseconds before free pages are purged
+#define M_SECMALLOC_PURGE_THREAD   -105 // mallopt parameter: whether a background thread purges the default heap
+
+/**
+ * @brief Struct to define the statistics of a heap.
+ */
+struct secmalloc_stats
+{
+    size_t    data_size;          ///< Size of the heap data
+    size_t    metadata_size;      ///< Size of the heap metadata
+    size_t    committed;          ///< Memory committed for the heap data and metadata
+    size_t    growth_syscalls;    ///< Number of syscalls made to grow the heap
+    size_t    purged_bytes;       ///< Bytes given back to the OS
+    size_t    refaults;           ///< Pages given back to the OS then allocated again
+    size_t    hugepage_bytes;     ///< Memory of the heap backed by huge pages
+    size_t    quarantine_bytes;   ///< Bytes of the freed blocks held in quarantine
+    size_t    use_after_free;     ///< Number of freed blocks found written while in quarantine
+};
+
+/**
+ * @brief Struct to define a size class prepared by secmalloc_prewarm_classes().
+ */
+struct secmalloc_prewarm_class
+{
+    size_t    size;     ///< Size of the blocks
+    size_t    count;    ///< Number of blocks of this size the critical phase allocates
+};
+
 /**
  * @brief Allocates memory securely.
  *
@@ -53,6 +94,242 @@ void    *my_calloc(size_t nmemb, size_t size);
  */
 void    *my_realloc(void* ptr, size_t size);
 
+/**
+ * @brief Creates a private heap.
+ *
+ * This function creates a heap with its own data and metadata regions, so that
+ * all its allocations can be released at once with secmalloc_heap_destroy().
+ *
+ * @return struct secmalloc_heap* A pointer to the new heap, or NULL if the creation fails.
+ */
+struct secmalloc_heap    *secmalloc_heap_create();
+
+/**
+ * @brief Allocates memory securely in a private heap.
+ *
+ * @param heap The heap to allocate from.
+ * @param size The size of the memory block to allocate.
+ * @return void* A pointer to the allocated memory, or NULL if the allocation fails.
+ */
+void    *secmalloc_heap_alloc(struct secmalloc_heap *heap, size_t size);
+
+/**
+ * @brief Frees memory allocated in a private heap.
+ *
+ * @param heap The heap owning the memory block.
+ * @param ptr A pointer to the memory block to free.
+ */
+void    secmalloc_heap_free(struct secmalloc_heap *heap, void *ptr);
+
+/**
+ * @brief Destroys a private heap.
+ *
+ * This function releases every memory block of the heap at once.
+ *
+ * @param heap The heap to destroy.
+ */
+void    secmalloc_heap_destroy(struct secmalloc_heap *heap);
+
+/**
+ * @brief Gets the statistics of a heap.
+ *
+ * @param heap The heap to inspect, or NULL for the default heap.
+ * @param stats The structure filled with the statistics.
+ */
+void    secmalloc_heap_stats(struct secmalloc_heap *heap, struct secmalloc_stats *stats);
+
+/**
+ * @brief Gives back to the OS the pages of the free blocks of a heap.
+ *
+ * This function purges every free page, regardless of the decay time.
+ *
+ * @param heap The heap to purge, or NULL for the default heap.
+ * @return size_t The number of bytes purged.
+ */
+size_t    secmalloc_purge(struct secmalloc_heap *heap);
+
+/**
+ * @brief Gives back to the OS the free memory of the default heap.
+ *
+ * This function shrinks the free end of the heap data down to the specified
+ * pad, purges the pages of the other free blocks and decommits the unused
+ * metadata.
+ *
+ * @param pad The free space to keep at the end of the heap data.
+ * @return size_t The number of bytes released.
+ */
+size_t    secmalloc_trim(size_t pad);
+
+/**
+ * @brief Prepares the default heap for a latency-critical phase.
+ *
+ * This function grows the heap so that its free end holds at least the
+ * specified size and faults in its pages.
+ *
+ * @param size The size to prepare.
+ * @return int 0 on success, -1 on failure.
+ */
+int    secmalloc_prewarm(size_t size);
+
+/**
+ * @brief Prepares the default heap for the size classes of a latency-critical phase.
+ *
+ * This function grows the heap and faults in its pages for every block of
+ * the classes, and splits the first blocks of the small classes ahead into
+ * the quick-reuse cache, so that their allocations take them without a
+ * lookup nor a split.
+ *
+ * @param classes The size classes and their numbers of blocks.
+ * @param count The number of classes.
+ * @return int 0 on success, -1 on failure.
+ */
+int    secmalloc_prewarm_classes(const struct secmalloc_prewarm_class *classes, size_t count);
+
+/**
+ * @brief Changes a tunable of the library.
+ *
+ * This function follows mallopt: M_TOP_PAD sets the minimal growth step of
+ * the heaps, M_MMAP_THRESHOLD the minimal size of the blocks served by the
+ * buddy zone, M_MXFAST the maximal size of the blocks taken back from the
+ * quick-reuse cache, and the M_SECMALLOC_* parameters the other tunables.
+ *
+ * @param param The parameter.
+ * @param value The new value.
+ * @return int 1 on success, 0 if the parameter or the value is invalid.
+ */
+int    secmalloc_mallopt(int param, int value);
+
+/**
+ * @brief Gets the number of NUMA nodes the heaps are spread on.
+ *
+ * @return int The number of nodes, 1 when the heaps of the nodes are not used.
+ */
+int    secmalloc_numa_nodes();
+
+/**
+ * @brief Gets the NUMA node the calling thread runs on.
+ *
+ * @return int The node, 0 if it is unknown.
+ */
+int    secmalloc_numa_node();
+
+/**
+ * @brief Allocates memory on the NUMA node of the calling thread.
+ *
+ * my_malloc() routes the allocations the same way. On single-node systems the
+ * memory comes from the default heap.
+ *
+ * @param size The size of the memory block to allocate.
+ * @return void* A pointer to the allocated memory, or NULL if the allocation fails.
+ */
+void    *secmalloc_numa_alloc(size_t size);
+
+/**
+ * @brief Frees memory allocated by secmalloc_numa_alloc().
+ *
+ * @param ptr A pointer to the memory block to free.
+ */
+void    secmalloc_numa_free(void *ptr);
+
+/**
+ * @brief Gets the statistics of the heap of a NUMA node.
+ *
+ * @param node The node.
+ * @param stats The structure filled with the statistics.
+ * @return int 0 on success, -1 if the node does not exist.
+ */
+int    secmalloc_numa_stats(int node, struct secmalloc_stats *stats);
+
+/**
+ * @brief Creates a bump-pointer arena.
+ *
+ * This function creates an arena that hands out memory by bumping a pointer
+ * inside chunks allocated with my_malloc(), for short-lived allocations that
+ * are all released together with secmalloc_arena_reset().
+ *
+ * @param chunk_size The size of the chunks of the arena, or 0 for the default size.
+ * @return struct secmalloc_arena* A pointer to the new arena, or NULL if the creation fails.
+ */
+struct secmalloc_arena    *secmalloc_arena_create(size_t chunk_size);
+
+/**
+ * @brief Allocates memory in an arena.
+ *
+ * @param arena The arena to allocate from.
+ * @param size The size of the memory block to allocate.
+ * @return void* A pointer to the allocated memory, or NULL if the allocation fails.
+ */
+void    *secmalloc_arena_alloc(struct secmalloc_arena *arena, size_t size);
+
+/**
+ * @brief Releases every allocation of an arena.
+ *
+ * This function verifies the canary of every object of the arena, then scrubs
+ * the arena so that its chunks can be reused.
+ *
+ * @param arena The arena to reset.
+ * @return int 0 if every canary is valid, -1 otherwise.
+ */
+int    secmalloc_arena_reset(struct secmalloc_arena *arena);
+
+/**
+ * @brief Destroys an arena.
+ *
+ * This function resets the arena and gives its chunks back to the heap.
+ *
+ * @param arena The arena to destroy.
+ */
+void    secmalloc_arena_destroy(struct secmalloc_arena *arena);
+
+/**
+ * @brief Creates a fixed-size object pool.
+ *
+ * This function creates a pool handing out objects of a single size from
+ * dedicated slabs, in constant time and without touching the heap.
+ *
+ * @param obj_size The size of the objects.
+ * @param align The alignment of the objects, a power of two, or 0 for sizeof(long).
+ * @return struct secmalloc_pool* A pointer to the new pool, or NULL if the creation fails.
+ */
+struct secmalloc_pool    *secmalloc_pool_create(size_t obj_size, size_t align);
+
+/**
+ * @brief Allocates an object from a pool.
+ *
+ * @param pool The pool to allocate from.
+ * @return void* A pointer to the allocated object, or NULL if the allocation fails.
+ */
+void    *secmalloc_pool_alloc(struct secmalloc_pool *pool);
+
+/**
+ * @brief Frees an object of a pool.
+ *
+ * @param pool The pool owning the object.
+ * @param ptr A pointer to the object to free.
+ */
+void    secmalloc_pool_free(struct secmalloc_pool *pool, void *ptr);
+
+/**
+ * @brief Prepares a pool for a latency-critical phase.
+ *
+ * This function maps and faults in slabs until the pool holds at least the
+ * specified number of free objects.
+ *
+ * @param pool The pool to prepare.
+ * @param count The number of free objects needed.
+ * @return int 0 on success, -1 on failure.
+ */
+int    secmalloc_pool_prewarm(struct secmalloc_pool *pool, size_t count);
+
+/**
+ * @brief Destroys a pool.
+ *
+ * This function releases every object of the pool at once.
+ *
+ * @param pool The pool to destroy.
+ */
+void    secmalloc_pool_destroy(struct secmalloc_pool *pool);
+
 /**
  * @brief Allocates memory.
  *
@@ -94,4 +371,13 @@ void    *calloc(size_t nmemb, size_t size);
  */
 void    *realloc(void* ptr, size_t size);
 
+/**
+ * @brief Changes a tunable of the allocator.
+ *
+ * @param param The parameter.
+ * @param value The new value.
+ * @return int 1 on success, 0 on error.
+ */
+int    mallopt(int param, int value);
+
 #endif // SECMALLOC_H
@@ -2,10 +2,50 @@
 #define SECMALLOC_PRIVATE_H
 
 #include <stddef.h>
+#include <pthread.h>
 
 #define PAGE_HEAP_SIZE       4096 // used as constant
-#define MAX_METADATA_SIZE    (100000 * sizeof(struct chunkmetadata))
-#define BASE_ADDRESS         ((void*)(4096 * 1000))
+#define MAX_METADATA_SIZE    (16384 * PAGE_HEAP_SIZE) // size of the range reserved for the heap metadata
+#define SLOTS_SIZE(entry)    ((MAX_METADATA_SIZE / sizeof(struct chunkmetadata) * (entry) + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE) // size of a range parallel to the metadata slots
+#define FIT_SIZES_SIZE       SLOTS_SIZE(sizeof(size_t)) // size of the range reserved for the free sizes of the slots
+#define FIT_NODES_SIZE       SLOTS_SIZE(sizeof(struct fit_node)) // size of the range reserved for the fit index nodes
+#define COLD_SIZE            SLOTS_SIZE(sizeof(struct chunkcold)) // size of the range reserved for the cold metadata of the slots
+#define BEST_FIT_MIN         512 // default minimal size of the allocations served best-fit
+#define TLSF_SL_LOG2         4 // log2 of the number of second-level classes of the TLSF engine
+#define TLSF_SL_COUNT        (1 << TLSF_SL_LOG2) // number of second-level classes of the TLSF engine
+#define TLSF_FL_COUNT        (64 - TLSF_SL_LOG2 + 1) // number of first-level classes of the TLSF engine
+#define BUDDY_MAX_ORDER      9 // order of the largest buddy blocks, in pages
+#define BUDDY_BLOCK_SIZE     (PAGE_HEAP_SIZE << BUDDY_MAX_ORDER) // size of the largest buddy blocks
+#define BUDDY_BLOCKS         256 // number of largest blocks in the buddy zone of a heap
+#define BUDDY_PAGES          (BUDDY_BLOCKS << BUDDY_MAX_ORDER) // number of pages in the buddy zone of a heap
+#define DEFER_BINS           64 // number of size classes of the quick-reuse cache
+#define DEFER_BIN_SIZE       16 // range of sizes of a class of the quick-reuse cache
+#define DEFER_BIN_DEPTH      8 // number of blocks a class of the quick-reuse cache holds
+#define QUARANTINE_SLOTS     256 // maximal number of freed blocks held in the quarantine of a heap
+#define SHADOW_GRANULE       8 // granule of the shadow of the data, a chunk and its canary span more so at most one chunk starts in it
+#define SHADOW_LINE_SIZE     (64 * SHADOW_GRANULE) // size of the data described by a line of the shadow
+#define SHADOW_SIZE(size)    ((size) / SHADOW_LINE_SIZE * sizeof(struct shadow_line)) // size of the shadow of a data segment
+#define HEAP_SEGMENT_SIZE    (262144 * PAGE_HEAP_SIZE) // minimal size of the range reserved for a data segment
+#define HEAP_SEGMENT_MAX_SIZE    ((size_t)1 << 32) // maximal size of the range reserved for a data segment, the chunks hold 32-bit offsets
+#define HEAP_MAX_SEGMENTS    64 // maximal number of data segments of a heap
+#define HEAP_COMMIT_STEP     (16 * PAGE_HEAP_SIZE) // default minimal step of the memory committed in the reserved ranges
+#define GROWTH_MAX_STEP      (16384 * PAGE_HEAP_SIZE) // default maximal step of the memory committed
+#define GROWTH_FACTOR        100 // default step, in percent of the memory already committed
+#define ARENA_CHUNK_SIZE     (16 * PAGE_HEAP_SIZE) // default size of an arena chunk
+#define ARENA_ALIGNMENT      16 // alignment of the objects handed out by an arena
+#define ARENA_HEADER_SIZE    16 // size of the header written before each arena object
+#define POOL_SLAB_SIZE       (16 * PAGE_HEAP_SIZE) // minimal size of a pool slab
+#define POOL_MIN_OBJECTS     8 // minimal number of objects in a pool slab
+#define POOL_RESERVED_SIZE   ((size_t)1 << 30) // size of the range reserved for the slabs of a pool
+#define HUGE_PAGE_SIZE       (512 * PAGE_HEAP_SIZE) // size of a huge page
+#define NUMA_MAX_NODES       64 // maximal number of NUMA nodes with a heap
+#define NUMA_AUTO            ((size_t)-1) // heaps of the nodes used only on multi-node systems
+#define PURGE_DECAY          10000 // default time in milliseconds before free pages are given back to the OS
+#define CHUNK_COLD(heap, item)    (&(heap)->cold[(item) - (heap)->metadata]) // cold metadata of a chunk
+#define CHUNK_ADDR(heap, item)    ((void*)((char*)(heap)->segments[(item)->segment].base + (item)->offset)) // address of a chunk
+#define CHUNK_NEXT(heap, item)    ((item)->next == 0 ? NULL : (heap)->metadata + (item)->next - 1) // next chunk of the list, NULL for the last one
+#define CHUNK_LINK(heap, item)    ((item) == NULL ? 0 : (unsigned int)((item) - (heap)->metadata + 1)) // link to a chunk, its slot plus one
+#define CHUNK_MAX_SIZE       (HEAP_SEGMENT_MAX_SIZE - PAGE_HEAP_SIZE) // maximal size of a chunk, it lies in a single segment
 
 /**
  * @file secmalloc_private.h
@@ -15,10 +55,197 @@
  * functions used throughout the project.
  */
 
-extern void                    *heapdata; ///< Pointer to the heap data
-extern struct chunkmetadata    *heapmetadata; ///< Pointer to the heap metadata
-extern size_t                  heapdata_size; ///< Size of the heap data
-extern size_t                  heapmetadata_size; ///< Size of the heap metadata
+/**
+ * @brief Struct to define a line of the shadow of a data segment.
+ *
+ * A line describes SHADOW_LINE_SIZE bytes of data with one bit per granule,
+ * set when a chunk starts in the granule, and the slot of the first of these
+ * chunks, the next ones being reached through the list.
+ */
+struct shadow_line
+{
+    unsigned long    starts;    ///< Granules where a chunk starts
+    unsigned long    busy;      ///< Granules where a busy chunk starts
+    unsigned int     first;     ///< Slot plus one of the first chunk starting in the line
+};
+
+/**
+ * @brief Struct to define a data segment of a heap.
+ *
+ * A segment is an address range reserved anywhere in the address space, its
+ * memory is committed with mprotect as it grows so it never moves.
+ */
+struct heap_segment
+{
+    void                  *base;         ///< Start of the range reserved for the segment
+    size_t                size;          ///< Size of the segment handed out to blocks
+    size_t                committed;     ///< Size of the segment readable and writable
+    size_t                reserved;      ///< Size of the range reserved for the segment
+    struct shadow_line    *shadow;       ///< Shadow of the chunks starting in the segment, committed along the data
+};
+
+/**
+ * @brief Struct to define a node of the fit index of a heap.
+ *
+ * The nodes live in an array parallel to the metadata slots. Built with TLSF,
+ * the index chains the free chunks of each size class in a list, otherwise it
+ * is a best-fit tree ordering the free chunks by size then by slot, kept
+ * balanced as an AVL tree. Links are slot numbers plus one, 0 meaning none.
+ */
+struct fit_node
+{
+    size_t          size;         ///< Size of the free chunk of the slot, 0 when the slot is not indexed
+    unsigned int    prev;         ///< Previous chunk of the list
+#if TLSF
+    unsigned int    free_prev;    ///< Previous free chunk of the size class
+    unsigned int    free_next;    ///< Next free chunk of the size class
+#else
+    unsigned int    left;         ///< Left child
+    unsigned int    right;        ///< Right child
+    unsigned int    height;       ///< Height of the subtree
+#endif
+};
+
+/**
+ * @brief Struct to define a heap, i.e. a pair of data and metadata regions.
+ *
+ * The metadata lives in a single reserved range and the data in a table of
+ * segments, memory is committed with mprotect as they grow so they never move.
+ *
+ * The implicit global heap used by my_malloc() is secmalloc_default_heap, private
+ * heaps are created with secmalloc_heap_create().
+ */
+struct secmalloc_heap
+{
+    void                    *data;                  ///< Pointer to the heap data, i.e. its first segment
+    struct chunkmetadata    *metadata;              ///< Pointer to the heap metadata
+    size_t                  data_size;              ///< Size of the heap data, all segments included
+    size_t                  metadata_size;          ///< Size of the heap metadata
+    size_t                  data_committed;         ///< Size of the heap data readable and writable
+    size_t                  metadata_committed;     ///< Size of the heap metadata readable and writable
+    size_t                  growth_syscalls;        ///< Number of syscalls made to grow the heap
+    struct heap_segment     segments[HEAP_MAX_SEGMENTS];    ///< Table of the data segments
+    size_t                  nsegments;              ///< Number of data segments
+    size_t                  purged_bytes;           ///< Bytes given back to the OS
+    size_t                  refaults;               ///< Pages given back to the OS then allocated again
+    long                    last_purge;             ///< Time of the last purge pass, in milliseconds
+    pthread_mutex_t         lock;                   ///< Recursive lock of the heap, the my_heap_* functions expect it held
+    int                     node;                   ///< NUMA node the memory is bound to, -1 for none
+    size_t                  *fit_sizes;             ///< Size of the chunk of each metadata slot when it is free, 0 otherwise
+    size_t                  fit_count;              ///< Number of slots the fit searches scan, i.e. the highest slot handed out plus one
+    unsigned int            slot_free;              ///< First slot left by a merged chunk, slot plus one, the next ones are chained through their next link
+    unsigned int            last_chunk;             ///< Last chunk of the list, slot plus one
+    size_t                  data_covered;           ///< Bytes of the data covered by the chunks of the list, canaries included
+    size_t                  fit_committed;          ///< Number of slots whose free size and tree node are readable and writable
+    size_t                  fit_unordered;          ///< Number of chunks whose next chunk has a lower slot, the slots follow the list when 0
+    struct fit_node         *fit_nodes;             ///< Fit index of the free chunks, one node per metadata slot
+    struct chunkcold        *cold;                  ///< Cold metadata of the chunks, one entry per metadata slot
+    void                    *alloc_site;            ///< Caller of the allocation in progress, recorded in the cold metadata
+    unsigned long           canary_state;           ///< State of the generator of the canaries, 0 until seeded from /dev/urandom
+#if TLSF
+    size_t                  fit_fl;                 ///< Bitmap of the first-level classes holding free chunks
+    size_t                  fit_sl[TLSF_FL_COUNT];  ///< Bitmaps of the second-level classes holding free chunks
+    unsigned int            fit_heads[TLSF_FL_COUNT][TLSF_SL_COUNT]; ///< First free chunk of each class
+#else
+    unsigned int            fit_root;               ///< Root of the best-fit tree
+#endif
+    struct buddy_zone       *buddy;                 ///< Buddy zone of the page-sized blocks, NULL until used
+    size_t                  defer_pending;          ///< Number of frees whose merge is deferred
+    unsigned int            defer_bins[DEFER_BINS][DEFER_BIN_DEPTH]; ///< Blocks freed recently by size class, slot plus one
+    unsigned int            defer_counts[DEFER_BINS]; ///< Number of blocks in each class of the quick-reuse cache
+    unsigned int            quarantine[QUARANTINE_SLOTS]; ///< Blocks freed and not reusable yet, oldest first from the head, slot plus one
+    size_t                  quarantine_head;        ///< Position of the oldest block of the quarantine
+    size_t                  quarantine_count;       ///< Number of blocks in the quarantine
+    size_t                  quarantine_bytes;       ///< Bytes held in the quarantine
+    size_t                  use_after_free;         ///< Number of blocks found written while in quarantine
+};
+
+/**
+ * @brief Struct to define the growth policy of the heaps.
+ *
+ * Each time a region of a heap needs more memory, factor percent of what is
+ * already committed is committed again, bounded by min_step and max_step.
+ */
+struct growth_policy
+{
+    int       initialized;    ///< Whether the policy was read from the environment
+    size_t    min_step;       ///< Minimal growth step (MSM_GROWTH_MIN_STEP)
+    size_t    max_step;       ///< Maximal growth step (MSM_GROWTH_MAX_STEP)
+    size_t    factor;         ///< Growth step in percent of the committed size (MSM_GROWTH_FACTOR)
+    size_t    cap;            ///< Maximal memory committed by a heap, 0 for no cap (MSM_GROWTH_CAP)
+    size_t    hugepage;       ///< Kind of pages backing the heaps, see enum hugepage_mode (MSM_HUGEPAGE)
+    size_t    populate;       ///< Whether the committed memory is faulted in right away (MSM_POPULATE)
+};
+
+/**
+ * @brief Enum to define the kinds of pages backing the heaps.
+ */
+enum hugepage_mode
+{
+    HUGEPAGE_NONE = 0,      ///< Regular pages
+    HUGEPAGE_THP = 1,       ///< Ranges aligned on huge pages and advised with MADV_HUGEPAGE
+    HUGEPAGE_HUGETLB = 2    ///< Ranges mapped with MAP_HUGETLB
+};
+
+extern struct growth_policy    growth_policy; ///< The growth policy of the heaps
+
+/**
+ * @brief Struct to define the purge policy of the heaps.
+ *
+ * Free pages that stayed free for decay milliseconds are given back to the OS
+ * with madvise, either on the next free or by a background thread.
+ */
+struct purge_policy
+{
+    int       initialized;    ///< Whether the policy was read from the environment
+    size_t    decay;          ///< Time in milliseconds before free pages are purged (MSM_PURGE_DECAY)
+    int       lazy;           ///< Whether MADV_FREE is used instead of MADV_DONTNEED (MSM_PURGE_LAZY)
+    int       thread;         ///< Whether a background thread purges the default heap (MSM_PURGE_THREAD)
+};
+
+extern struct purge_policy    purge_policy; ///< The purge policy of the heaps
+
+/**
+ * @brief Struct to define the tunables of the library.
+ *
+ * The tunables are read once from the environment at the first allocation,
+ * then changed only by secmalloc_mallopt(). The growth and purge tunables
+ * live in their policies.
+ */
+struct secmalloc_config
+{
+    int           initialized;    ///< Whether the tunables were read from the environment
+    size_t        canary;         ///< Whether the canaries are verified on free and realloc (MSM_CANARY)
+    size_t        scrub;          ///< Whether the freed blocks are cleaned (MSM_SCRUB)
+    size_t        defer;          ///< Number of frees whose merge is deferred before a batch merge, 0 for none (MSM_DEFER)
+    size_t        defer_max;      ///< Maximal size of the blocks taken back from the quick-reuse cache (M_MXFAST)
+    size_t        quarantine;     ///< Percentage of the committed data held in quarantine, 0 for none (MSM_QUARANTINE)
+    size_t        best_fit;       ///< Minimal size of the allocations served best-fit, 0 for none (MSM_BEST_FIT)
+    const char    *fit_scan;      ///< Scan kernel forced, NULL for the best one of the CPU (MSM_FIT_SCAN)
+    size_t        buddy;          ///< Minimal size of the blocks served by the buddy zone, 0 for none (MSM_BUDDY, M_MMAP_THRESHOLD)
+    size_t        numa;           ///< Whether the heaps of the nodes are used, NUMA_AUTO to decide from the nodes (MSM_NUMA)
+    const char    *trace;         ///< Path of the binary trace of the allocations, NULL for none (MSM_TRACE)
+};
+
+extern struct secmalloc_config    secmalloc_config; ///< The tunables of the library
+
+extern struct secmalloc_heap    secmalloc_default_heap; ///< The implicit global heap
+
+#define heapdata             (secmalloc_default_heap.data) ///< Pointer to the heap data
+#define heapmetadata         (secmalloc_default_heap.metadata) ///< Pointer to the heap metadata
+#define heapdata_size        (secmalloc_default_heap.data_size) ///< Size of the heap data
+#define heapmetadata_size    (secmalloc_default_heap.metadata_size) ///< Size of the heap metadata
+
+/**
+ * @brief Enum to define the kinds of pointers handed to the heap functions.
+ */
+enum shadow_state
+{
+    SHADOW_FOREIGN = 0,     ///< Pointer outside of the data of the heap
+    SHADOW_INTERIOR = 1,    ///< Pointer inside the data but not at the start of a chunk
+    SHADOW_FREE = 2,        ///< Start of a free chunk
+    SHADOW_BUSY = 3         ///< Start of a busy chunk
+};
 
 /**
  * @brief Enum to define the chunk types.
@@ -29,18 +256,488 @@ enum chunk_type
     BUSY = 1  ///< Chunk is busy
 };
 
+/**
+ * @brief Enum to define the states of a chunk, beside its type.
+ *
+ * The state lives in its own bits of the metadata, so that no canary nor
+ * free time is ever taken for a state.
+ */
+enum chunk_state
+{
+    CHUNK_USED = 0,         ///< Busy chunk in use, or free chunk holding pages written before its free time
+    CHUNK_FRESH = 1,        ///< Free chunk never used, or prewarmed
+    CHUNK_PURGED = 2,       ///< Free chunk whose pages were given back to the OS
+    CHUNK_QUARANTINED = 3   ///< Busy chunk held in quarantine, i.e. already freed
+};
+
 /**
  * @brief Struct to define metadata for a memory chunk.
+ *
+ * The entry only holds what the lookups, the merges and the walks of the list
+ * read, so that an entry is 16 bytes and four of them share a cache line. The
+ * address is the segment of the chunk and its offset in it, read with
+ * CHUNK_ADDR(), and the next chunk is linked by its slot plus one, read with
+ * CHUNK_NEXT(). The rest lives in struct chunkcold.
  */
 struct chunkmetadata
 {
-    size_t                  size;                   ///< Size of the chunk
-    enum                    chunk_type flags;         ///< Flag indicating if the chunk is free or busy
-    void                    *addr;                    ///< Address of the chunk
-    long                    canary;                   ///< Canary value for detecting buffer overflows
-    struct chunkmetadata    *next;    ///< Pointer to the next chunk in the linked list
+    size_t                  size : 55;                ///< Size of the chunk
+    size_t                  segment : 6;              ///< Data segment holding the chunk
+    enum chunk_type         flags : 1;                ///< Flag indicating if the chunk is free or busy
+    enum chunk_state        state : 2;                ///< State of the chunk, see enum chunk_state
+    unsigned int            offset;                   ///< Offset of the chunk in its segment
+    unsigned int            next;                     ///< Slot plus one of the next chunk in the linked list, 0 for the last one
+};
+
+_Static_assert(sizeof(struct chunkmetadata) == 16, "four metadata entries must share a cache line");
+_Static_assert(HEAP_MAX_SEGMENTS <= 64, "the segment of a chunk is held in 6 bits");
+
+/**
+ * @brief Struct to define the cold metadata of a memory chunk.
+ *
+ * The entries live in an array parallel to the metadata slots, they are only
+ * read to place and verify canaries, to purge, and to report errors. A free
+ * chunk keeps the time it was freed in place of its canary.
+ */
+struct chunkcold
+{
+    union
+    {
+        long                canary;                   ///< Canary value for detecting buffer overflows, while the chunk is busy
+        long                freed_at;                 ///< Time the chunk was freed in milliseconds, while the chunk is free in the CHUNK_USED state
+    };
+    void                    *site;                    ///< Caller of the allocation of the chunk, NULL if unknown
+};
+
+/**
+ * @brief Struct to define a chunk of a bump-pointer arena.
+ *
+ * Objects are laid out after this header as a size header, the object itself
+ * and a canary, each record being aligned on ARENA_ALIGNMENT.
+ */
+struct arena_chunk
+{
+    struct arena_chunk    *next;      ///< Pointer to the next chunk of the arena
+    char                  *cursor;    ///< Address of the next record to hand out
+    char                  *end;       ///< End of the chunk
+};
+
+/**
+ * @brief Struct to define a bump-pointer arena.
+ */
+struct secmalloc_arena
+{
+    struct arena_chunk    *head;          ///< First chunk of the arena
+    struct arena_chunk    *current;       ///< Chunk allocations are bumped from
+    size_t                chunk_size;     ///< Size of the chunks requested to the heap
+    long                  canary;         ///< Canary value, mixed with the address of each object
 };
 
+/**
+ * @brief Struct to define a slab of a fixed-size object pool.
+ *
+ * A slab is committed in the range reserved for its pool and aligned on its
+ * own size, so that the slab of an object is found by masking its address.
+ * The bitmap has one bit per object, set while the object is allocated.
+ */
+struct pool_slab
+{
+    struct pool_slab         *next;      ///< Pointer to the next slab of the pool
+    struct secmalloc_pool    *pool;      ///< Pool owning the slab
+    size_t                   used;       ///< Number of allocated objects in the slab
+    unsigned long            bitmap[];   ///< Allocation bitmap of the objects
+};
+
+/**
+ * @brief Struct to define a fixed-size object pool.
+ */
+struct secmalloc_pool
+{
+    struct pool_slab    *slabs;               ///< List of the slabs of the pool, the last committed first
+    char                *base;                ///< Start of the range reserved for the slabs, aligned on the slab size
+    size_t              nslabs;               ///< Number of slabs committed from the start of the range
+    size_t              max_slabs;            ///< Number of slabs the range holds
+    void                *free_list;           ///< Intrusive list of the free objects, links are xored with the canary
+    size_t              obj_size;             ///< Size of the objects
+    size_t              stride;               ///< Distance between two objects, canary included
+    size_t              slab_size;            ///< Size of a slab, a power of two
+    size_t              objects_offset;       ///< Offset of the first object in a slab
+    size_t              objects_per_slab;     ///< Number of objects in a slab
+    long                canary;               ///< Canary value, mixed with the address of each object
+};
+
+/**
+ * @brief Struct to define the state of a page of a buddy zone.
+ *
+ * Only the first page of a block holds its state.
+ */
+struct buddy_page
+{
+    size_t          size;     ///< Size handed out when the block is allocated, 0 otherwise
+    long            canary;   ///< Canary placed after the data of the allocated block
+    unsigned int    next;     ///< Next free block of the same order, page plus one, 0 for none
+    unsigned int    prev;     ///< Previous free block of the same order, page plus one, 0 for none
+    unsigned int    order;    ///< Order of the block
+};
+
+/**
+ * @brief Struct to define the buddy zone of a heap.
+ *
+ * The zone is a range reserved on the size of its largest blocks and
+ * committed one largest block at a time. Blocks of order k are 2^k pages, a
+ * free block of each order is found with the bitmap of the orders and the
+ * free lists, and the buddy of a freed block is tested in its order bitmap.
+ */
+struct buddy_zone
+{
+    char                 *base;                                 ///< Start of the zone, aligned on BUDDY_BLOCK_SIZE
+    size_t               blocks;                                ///< Number of largest blocks committed
+    size_t               orders;                                ///< Bitmap of the orders holding a free block
+    unsigned int         heads[BUDDY_MAX_ORDER + 1];            ///< First free block of each order, page plus one
+    unsigned long        bitmap[2 * BUDDY_PAGES / (8 * sizeof(unsigned long))]; ///< Free bit of each block of each order
+    struct buddy_page    pages[BUDDY_PAGES];                    ///< State of the blocks, by first page
+};
+
+/**
+ * @brief Function to get the growth policy of the heaps.
+ *
+ * @return struct growth_policy* A pointer to the growth policy.
+ */
+struct growth_policy    *my_growth_policy();
+
+/**
+ * @brief Function to get the granule the heaps are committed and purged by.
+ *
+ * @return size_t HUGE_PAGE_SIZE when huge pages are enabled, PAGE_HEAP_SIZE otherwise.
+ */
+size_t    my_page_granule();
+
+/**
+ * @brief Function to bind a range to a NUMA node.
+ *
+ * @param addr The start of the range.
+ * @param size The size of the range.
+ * @param node The node.
+ * @return int 0 on success, -1 on failure.
+ */
+int    my_numa_bind(void *addr, size_t size, int node);
+
+/**
+ * @brief Function to get the heap of the NUMA node the calling thread runs on.
+ *
+ * @return struct secmalloc_heap* A pointer to the heap, or NULL when the heaps of the nodes are not used.
+ */
+struct secmalloc_heap    *my_numa_local_heap();
+
+/**
+ * @brief Function to get the heap of a NUMA node owning a block.
+ *
+ * @param ptr A pointer to the block.
+ * @return struct secmalloc_heap* A pointer to the heap, or NULL if the block is not in the heap of a node.
+ */
+struct secmalloc_heap    *my_numa_owner(void *ptr);
+
+/**
+ * @brief Function to reallocate a block of the heap of a NUMA node.
+ *
+ * @param heap The heap owning the block.
+ * @param ptr A pointer to the memory block to reallocate.
+ * @param size The new size of the memory block.
+ * @return void* A pointer to the reallocated memory, or NULL if the reallocation fails.
+ */
+void    *my_numa_realloc(struct secmalloc_heap *heap, void *ptr, size_t size);
+
+/**
+ * @brief Function to release the blocks held in the quarantines of the heaps of the NUMA nodes.
+ */
+void    my_numa_quarantine_flush();
+
+/**
+ * @brief Function to fault in the pages of a committed range.
+ *
+ * @param addr The start of the range.
+ * @param size The size of the range.
+ * @return int 0 on success, -1 on failure.
+ */
+int    my_populate(void *addr, size_t size);
+
+/**
+ * @brief Function to compute the size to commit for a growing region.
+ *
+ * @param committed The size of the region already committed.
+ * @param needed The size of the region needed.
+ * @return size_t The new size to commit.
+ */
+size_t    my_growth_target(size_t committed, size_t needed);
+
+/**
+ * @brief Function to read a size from an environment variable.
+ *
+ * @param name The name of the variable.
+ * @param value The default value.
+ * @return size_t The value of the variable, or the default value if it is not set or invalid.
+ */
+size_t    my_getenv_size(const char *name, size_t value);
+
+/**
+ * @brief Function to get the tunables of the library.
+ *
+ * @return struct secmalloc_config* A pointer to the tunables, read from the environment on first use.
+ */
+struct secmalloc_config    *my_config();
+
+/**
+ * @brief Function to get the purge policy of the heaps.
+ *
+ * @return struct purge_policy* A pointer to the purge policy.
+ */
+struct purge_policy    *my_purge_policy();
+
+/**
+ * @brief Function to get a monotonic time in milliseconds.
+ *
+ * @return long The time in milliseconds, always greater than 0.
+ */
+long    my_now_ms();
+
+/**
+ * @brief Function to give back to the OS the pages of the free chunks of a heap.
+ *
+ * @param heap The heap.
+ * @param age The minimal time in milliseconds the chunks must have been free.
+ * @return size_t The number of bytes purged.
+ */
+size_t    my_heap_purge(struct secmalloc_heap *heap, size_t age);
+
+/**
+ * @brief Function to count the purged pages an allocation will fault again.
+ *
+ * @param heap The heap owning the chunk.
+ * @param bloc The purged chunk the allocation is taken from.
+ * @param size The size of the allocation.
+ * @return size_t The number of pages.
+ */
+size_t    my_purged_pages(struct secmalloc_heap *heap, struct chunkmetadata *bloc, size_t size);
+
+/**
+ * @brief Function to purge a heap if the decay time elapsed since the last purge.
+ *
+ * @param heap The heap.
+ */
+void    my_heap_purge_maybe(struct secmalloc_heap *heap);
+
+/**
+ * @brief Function to start the background purge thread of the default heap.
+ *
+ * @return int 0 on success, -1 if the thread can not be started.
+ */
+int    my_purge_start();
+
+/**
+ * @brief Function to give back to the OS the free memory of a heap.
+ *
+ * @param heap The heap to trim.
+ * @param pad The free space to keep at the end of the heap data.
+ * @return size_t The number of bytes released.
+ */
+size_t    my_heap_trim(struct secmalloc_heap *heap, size_t pad);
+
+/**
+ * @brief Function to allocate a page-sized block from the buddy zone of a heap.
+ *
+ * @param heap The heap.
+ * @param size The size of the block.
+ * @return void* A pointer to the block, or NULL if the size is not served by the zone or the zone is full.
+ */
+void    *my_buddy_alloc(struct secmalloc_heap *heap, size_t size);
+
+/**
+ * @brief Function to check whether a pointer lies in the buddy zone of a heap.
+ *
+ * @param heap The heap.
+ * @param ptr The pointer.
+ * @return int 1 if the pointer lies in the zone, 0 otherwise.
+ */
+int    my_buddy_owns(struct secmalloc_heap *heap, void *ptr);
+
+/**
+ * @brief Function to get the size of an allocated block of the buddy zone of a heap.
+ *
+ * @param heap The heap.
+ * @param ptr A pointer to the block.
+ * @return size_t The size of the block, 0 if the pointer is not an allocated block.
+ */
+size_t    my_buddy_size(struct secmalloc_heap *heap, void *ptr);
+
+/**
+ * @brief Function to free a block of the buddy zone of a heap.
+ *
+ * @param heap The heap.
+ * @param ptr A pointer to the block.
+ */
+void    my_buddy_free(struct secmalloc_heap *heap, void *ptr);
+
+/**
+ * @brief Function to release the buddy zone of a heap.
+ *
+ * @param heap The heap.
+ */
+void    my_buddy_destroy(struct secmalloc_heap *heap);
+
+/**
+ * @brief Function to get the number of frees whose merge is deferred before a batch merge.
+ *
+ * @return size_t The number of frees, 0 when the merge is not deferred.
+ */
+size_t    my_defer_threshold();
+
+/**
+ * @brief Function to put a freed chunk in the quick-reuse cache and defer its merge.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The freed chunk.
+ */
+void    my_heap_defer_free(struct secmalloc_heap *heap, struct chunkmetadata *item);
+
+/**
+ * @brief Function to take a chunk freed recently for an allocation of the same size.
+ *
+ * @param heap The heap.
+ * @param size The size of the allocation.
+ * @return struct chunkmetadata* A pointer to the chunk, or NULL if there is none.
+ */
+struct chunkmetadata    *my_heap_defer_reuse(struct secmalloc_heap *heap, size_t size);
+
+/**
+ * @brief Function to get the number of chunks of a size the quick-reuse cache can still hold.
+ *
+ * @param heap The heap.
+ * @param size The size of the chunks.
+ * @return size_t The number of chunks, 0 if the size is not cached.
+ */
+size_t    my_heap_defer_room(struct secmalloc_heap *heap, size_t size);
+
+/**
+ * @brief Function to put a free chunk in the quick-reuse cache without deferring a merge.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The free chunk.
+ */
+void    my_heap_defer_seed(struct secmalloc_heap *heap, struct chunkmetadata *item);
+
+/**
+ * @brief Function to run the deferred merges of a heap.
+ *
+ * @param heap The heap.
+ * @return int 1 if merges were pending, 0 otherwise.
+ */
+int    my_heap_defer_flush(struct secmalloc_heap *heap);
+
+/**
+ * @brief Function to get the budget of the quarantine of the heaps.
+ *
+ * @return size_t The percentage of the committed data the quarantine may hold, 0 when there is none.
+ */
+size_t    my_quarantine_percent();
+
+/**
+ * @brief Function to put a freed and cleaned chunk in the quarantine of a heap.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The chunk.
+ */
+void    my_heap_quarantine(struct secmalloc_heap *heap, struct chunkmetadata *item);
+
+/**
+ * @brief Function to release every chunk of the quarantine of a heap.
+ *
+ * @param heap The heap.
+ */
+void    my_heap_quarantine_flush(struct secmalloc_heap *heap);
+
+/**
+ * @brief Function to make a freed chunk of a heap reusable.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The chunk, cleaned.
+ */
+void    my_heap_release(struct secmalloc_heap *heap, struct chunkmetadata *item);
+
+/**
+ * @brief Function to update the free size of the slot of a chunk.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The chunk.
+ */
+void    my_fit_update(struct secmalloc_heap *heap, struct chunkmetadata *item);
+
+/**
+ * @brief Function to clear the free size of the slot of a chunk no longer in the list.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The chunk.
+ */
+void    my_fit_clear(struct secmalloc_heap *heap, struct chunkmetadata *item);
+
+/**
+ * @brief Function to look up a free chunk holding a size.
+ *
+ * @param heap The heap to search.
+ * @param size The size needed, canary included.
+ * @return struct chunkmetadata* A pointer to the chunk, or NULL if there is none.
+ */
+struct chunkmetadata    *my_fit_lookup(struct secmalloc_heap *heap, size_t size);
+
+/**
+ * @brief Function to reset the fit index of a heap.
+ *
+ * @param heap The heap.
+ */
+void    my_fit_init(struct secmalloc_heap *heap);
+
+/**
+ * @brief Function to get the previous chunk of the list.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The chunk.
+ * @return struct chunkmetadata* A pointer to the previous chunk, or NULL for the first one.
+ */
+struct chunkmetadata    *my_fit_prev(struct secmalloc_heap *heap, struct chunkmetadata *item);
+
+/**
+ * @brief Function to get the size of a free chunk a lookup is sure to find for a size.
+ *
+ * @param size The size needed, canary included.
+ * @return size_t The size of the free chunk.
+ */
+size_t    my_fit_round(size_t size);
+
+/**
+ * @brief Function to record the start and the state of a chunk in the shadow of a heap.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The chunk.
+ */
+void    my_shadow_update(struct secmalloc_heap *heap, struct chunkmetadata *item);
+
+/**
+ * @brief Function to remove from the shadow of a heap a chunk no longer in the list.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The chunk.
+ */
+void    my_shadow_clear(struct secmalloc_heap *heap, struct chunkmetadata *item);
+
+/**
+ * @brief Function to classify a pointer handed to the heap functions.
+ *
+ * @param heap The heap.
+ * @param ptr The pointer.
+ * @param item Filled with the chunk starting at the pointer, NULL if there is none.
+ * @return enum shadow_state The kind of the pointer.
+ */
+enum shadow_state    my_shadow_classify(struct secmalloc_heap *heap, void *ptr, struct chunkmetadata **item);
+
 /**
  * @brief Function to initialize the heap data.
  *
@@ -62,6 +759,14 @@ struct chunkmetadata    *my_init_heapmetadata();
  */
 long    my_generate_canary();
 
+/**
+ * @brief Function to draw a canary value for a block of a heap.
+ *
+ * @param heap The heap.
+ * @return long The canary value, or -1 if the generator can not be seeded.
+ */
+long    my_heap_canary(struct secmalloc_heap *heap);
+
 /**
  * @brief Function to get the total allocated size of the heap metadata.
  *
@@ -103,6 +808,15 @@ struct chunkmetadata    *my_lookup(size_t size);
  */
 void    my_split(struct chunkmetadata *bloc, size_t size, long canary);
 
+/**
+ * @brief Function to place a canary at the end of a block of a heap.
+ *
+ * @param heap The heap owning the block.
+ * @param bloc The block to place the canary in.
+ * @param canary The canary value to place.
+ */
+void    my_heap_place_canary(struct secmalloc_heap *heap, struct chunkmetadata *bloc, long canary);
+
 /**
  * @brief Function to place a canary at the end of a block.
  *
@@ -111,6 +825,15 @@ void    my_split(struct chunkmetadata *bloc, size_t size, long canary);
  */
 void    my_place_canary(struct chunkmetadata *bloc, long canary);
 
+/**
+ * @brief Function to verify the canary value of a block of a heap.
+ *
+ * @param heap The heap owning the block.
+ * @param item The block to verify.
+ * @return int 1 if the canary value is valid, -1 otherwise.
+ */
+int    my_heap_verify_canary(struct secmalloc_heap *heap, struct chunkmetadata *item);
+
 /**
  * @brief Function to verify the canary value of a block.
  *
@@ -119,6 +842,14 @@ void    my_place_canary(struct chunkmetadata *bloc, long canary);
  */
 int    my_verify_canary(struct chunkmetadata *item);
 
+/**
+ * @brief Function to clean the memory of a block of a heap.
+ *
+ * @param heap The heap owning the block.
+ * @param item The block to clean.
+ */
+void    my_heap_clean_memory(struct secmalloc_heap *heap, struct chunkmetadata *item);
+
 /**
  * @brief Function to clean the memory of a block.
  *
@@ -131,4 +862,111 @@ void    my_clean_memory(struct chunkmetadata *item);
  */
 void    my_merge_chunks(void);
 
+/**
+ * @brief Function to find the data segment of a heap holding an address.
+ *
+ * @param heap The heap to search.
+ * @param ptr The address.
+ * @return struct heap_segment* A pointer to the segment, or NULL if the address is not in the heap.
+ */
+struct heap_segment    *my_heap_segment(struct secmalloc_heap *heap, void *ptr);
+
+/**
+ * @brief Function to initialize the data region of a heap.
+ *
+ * @param heap The heap to initialize.
+ * @return void* A pointer to the initialized heap data.
+ */
+void    *my_heap_init_data(struct secmalloc_heap *heap);
+
+/**
+ * @brief Function to initialize the metadata region of a heap.
+ *
+ * @param heap The heap to initialize.
+ * @return struct chunkmetadata* A pointer to the initialized heap metadata.
+ */
+struct chunkmetadata    *my_heap_init_metadata(struct secmalloc_heap *heap);
+
+/**
+ * @brief Function to get the total allocated size of the metadata of a heap.
+ *
+ * @param heap The heap to inspect.
+ * @return size_t The total allocated size of the heap metadata.
+ */
+size_t    my_heap_allocated_metadata_size(struct secmalloc_heap *heap);
+
+/**
+ * @brief Function to get the total allocated size of the data of a heap.
+ *
+ * @param heap The heap to inspect.
+ * @return size_t The total allocated size of the heap data.
+ */
+size_t    my_heap_allocated_data_size(struct secmalloc_heap *heap);
+
+/**
+ * @brief Function to get the last metadata block of a heap.
+ *
+ * @param heap The heap to inspect.
+ * @return struct chunkmetadata* A pointer to the last metadata block.
+ */
+struct chunkmetadata    *my_heap_lastmetadata(struct secmalloc_heap *heap);
+
+/**
+ * @brief Function to resize the metadata of a heap.
+ *
+ * @param heap The heap to resize.
+ */
+void    my_heap_resize_metadata(struct secmalloc_heap *heap);
+
+/**
+ * @brief Function to resize the data of a heap.
+ *
+ * @param heap The heap to resize.
+ * @param new_size The new size of the heap data.
+ */
+void    my_heap_resize_data(struct secmalloc_heap *heap, size_t new_size);
+
+/**
+ * @brief Function to look up a free block with enough size in a heap.
+ *
+ * @param heap The heap to search.
+ * @param size The size required for the block.
+ * @return struct chunkmetadata* A pointer to the found free block, or NULL if no block is found.
+ */
+struct chunkmetadata    *my_heap_lookup(struct secmalloc_heap *heap, size_t size);
+
+/**
+ * @brief Function to split a block of a heap into two blocks.
+ *
+ * @param heap The heap owning the block.
+ * @param bloc The block to split.
+ * @param size The size of the first block after the split.
+ * @param canary The canary value to place in the block.
+ */
+void    my_heap_split(struct secmalloc_heap *heap, struct chunkmetadata *bloc, size_t size, long canary);
+
+/**
+ * @brief Function to merge consecutive free chunks of a heap.
+ *
+ * @param heap The heap to merge.
+ */
+void    my_heap_merge_chunks(struct secmalloc_heap *heap);
+
+/**
+ * @brief Function to allocate a block in a heap.
+ *
+ * @param heap The heap to allocate from.
+ * @param size The size of the memory block to allocate.
+ * @return void* A pointer to the allocated memory, or NULL if the allocation fails.
+ */
+void    *my_heap_malloc(struct secmalloc_heap *heap, size_t size);
+
+/**
+ * @brief Function to free a block of a heap.
+ *
+ * @param heap The heap owning the block.
+ * @param ptr A pointer to the memory block to free.
+ */
+void    my_heap_free(struct secmalloc_heap *heap, void *ptr);
+
 #endif // SECMALLOC_PRIVATE_H
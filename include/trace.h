@@ -0,0 +1,102 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC          0x4543415254534d4dULL // "MSMTRACE", first bytes of a trace file
+#define TRACE_VERSION        1 // version of the layout of a trace file
+#define TRACE_RINGS          64 // number of rings of a trace file, one per thread
+#define TRACE_RING_EVENTS    16384 // number of events of a ring, the oldest ones are overwritten
+
+/**
+ * @file trace.h
+ * @brief Header file for the binary trace of the allocations.
+ *
+ * This file contains the layout of the trace files written when MSM_TRACE is
+ * set, shared by the tracer and the decoder tool.
+ */
+
+/**
+ * @brief Enum to define the operations recorded in a trace.
+ */
+enum trace_op
+{
+    TRACE_CALL_MALLOC = 1,    ///< my_malloc called, size
+    TRACE_RETURN_MALLOC,      ///< my_malloc returns, addr
+    TRACE_CALL_FREE,          ///< my_free called, addr
+    TRACE_RETURN_FREE,        ///< my_free returns
+    TRACE_CALL_CALLOC,        ///< my_calloc called, number of elements in addr and size
+    TRACE_RETURN_CALLOC,      ///< my_calloc returns, addr
+    TRACE_CALL_REALLOC,       ///< my_realloc called, addr and size
+    TRACE_RETURN_REALLOC      ///< my_realloc returns, addr
+};
+
+/**
+ * @brief Struct to define an event of a trace.
+ */
+struct trace_event
+{
+    uint64_t    tsc;     ///< Time stamp counter when the event was recorded
+    uint64_t    addr;    ///< Address argument or result of the operation
+    uint64_t    size;    ///< Size argument of the operation
+    uint32_t    tid;     ///< Thread recording the event
+    uint32_t    op;      ///< Operation, see enum trace_op
+};
+
+/**
+ * @brief Struct to define a ring of events of a trace.
+ *
+ * A ring is written by a single thread at a time, and taken by a new thread
+ * once its thread exits. The head counts the events ever written and is
+ * stored after each event, so a reader takes the last TRACE_RING_EVENTS
+ * events before it.
+ */
+struct trace_ring
+{
+    uint64_t              head;                          ///< Number of events written
+    uint32_t              tid;                           ///< Thread owning the ring, the last one when the ring was released and claimed again
+    uint32_t              pid;                           ///< Process owning the ring
+    uint64_t              padding[6];                    ///< Keeps the heads of the rings on separate cache lines
+    struct trace_event    events[TRACE_RING_EVENTS];     ///< Events, the event n being at n % TRACE_RING_EVENTS
+};
+
+/**
+ * @brief Struct to define the header of a trace file.
+ *
+ * The time stamp counter and the monotonic clock are sampled when the trace
+ * starts and at exit, so that the decoder converts the counter to time.
+ */
+struct trace_header
+{
+    uint64_t    magic;       ///< TRACE_MAGIC
+    uint32_t    version;     ///< TRACE_VERSION
+    uint32_t    rings;       ///< Number of rings claimed by the threads
+    uint64_t    dropped;     ///< Number of threads left out once every ring was claimed
+    uint64_t    start_tsc;   ///< Time stamp counter when the trace started
+    uint64_t    start_ns;    ///< Monotonic time in nanoseconds when the trace started
+    uint64_t    end_tsc;     ///< Time stamp counter at exit, 0 if the process did not exit
+    uint64_t    end_ns;      ///< Monotonic time in nanoseconds at exit
+    uint64_t    padding;     ///< Keeps the rings on separate cache lines
+};
+
+#define TRACE_FILE_SIZE      (sizeof(struct trace_header) + TRACE_RINGS * sizeof(struct trace_ring)) // size of a trace file
+
+extern int    my_trace_on; ///< Whether the operations are traced (MSM_TRACE), -1 until read
+
+// Record an event of the calling thread, when MSM_TRACE is set
+#define MY_TRACE(op, addr, size)    do { if (my_trace_on != 0) my_trace_event((op), (uint64_t)(addr), (size)); } while (0)
+
+/**
+ * @brief Function to record an event in the ring of the calling thread.
+ *
+ * The trace file is created the first time this function is called, if
+ * MSM_TRACE is set.
+ *
+ * @param op The operation, see enum trace_op.
+ * @param addr The address argument or result of the operation.
+ * @param size The size argument of the operation.
+ */
+void    my_trace_event(uint32_t op, uint64_t addr, uint64_t size);
+
+#endif // TRACE_H
@@ -0,0 +1,251 @@
+/**
+ * @file arena.c
+ * @brief Implementation of bump-pointer arenas.
+ *
+ * This file contains the implementation of arenas for short-lived allocations.
+ * An arena allocates by bumping a pointer inside large chunks obtained from
+ * my_malloc(), each object being followed by a canary. All the objects are
+ * released at once by secmalloc_arena_reset(), which verifies their canaries
+ * and scrubs the arena.
+ */
+
+#include "secmalloc.h"
+#include <string.h>
+#include "log.h"
+
+/**
+ * @brief Align an address on ARENA_ALIGNMENT.
+ *
+ * @param addr The address to align.
+ * @return char* The first aligned address greater than or equal to addr.
+ */
+static char* my_arena_align(char *addr)
+{
+    return (char*)(((size_t)addr + ARENA_ALIGNMENT - 1) & ~((size_t)ARENA_ALIGNMENT - 1));
+}
+
+/**
+ * @brief Get the address of the first record of an arena chunk.
+ *
+ * @param chunk The chunk.
+ * @return char* The address of the first record of the chunk.
+ */
+static char* my_arena_chunk_start(struct arena_chunk *chunk)
+{
+    return my_arena_align((char*)chunk + sizeof(struct arena_chunk));
+}
+
+/**
+ * @brief Allocate a new chunk for an arena.
+ *
+ * This function allocates a chunk able to hold at least one object of the
+ * specified size and inserts it right after the current chunk.
+ *
+ * @param arena The arena.
+ * @param size The size of the object that must fit in the chunk.
+ * @return struct arena_chunk* A pointer to the new chunk, or NULL if the allocation fails.
+ */
+static struct arena_chunk* my_arena_new_chunk(struct secmalloc_arena *arena, size_t size)
+{
+    LOG_TRACE("call arena_new_chunk for size %zu\n", size);
+
+    // Room for the chunk header, the alignment, the object header, the object and its canary
+    size_t    needed = sizeof(struct arena_chunk) + ARENA_ALIGNMENT + ARENA_HEADER_SIZE + size + sizeof(long);
+    size_t    chunk_size = arena->chunk_size;
+    if (needed < size || needed > chunk_size)
+    {
+        chunk_size = needed;
+    }
+    if (chunk_size < size)
+    {
+        LOG_ERROR("Error: Arena object too large : %zu bytes\n", size);
+        return NULL;
+    }
+
+    struct arena_chunk    *chunk = my_malloc(chunk_size);
+    if (chunk == NULL)
+    {
+        LOG_ERROR("Error: Failed to allocate arena chunk of %zu bytes\n", chunk_size);
+        return NULL;
+    }
+
+    chunk->cursor = my_arena_chunk_start(chunk);
+    chunk->end = (char*)chunk + chunk_size;
+    if (arena->current == NULL)
+    {
+        chunk->next = NULL;
+        arena->head = chunk;
+    }
+    else
+    {
+        chunk->next = arena->current->next;
+        arena->current->next = chunk;
+    }
+
+    LOG_TRACE("return arena chunk %p of size %zu\n", chunk, chunk_size);
+    return chunk;
+}
+
+/**
+ * @brief Create a bump-pointer arena.
+ *
+ * @param chunk_size The size of the chunks of the arena, or 0 for ARENA_CHUNK_SIZE.
+ * @return struct secmalloc_arena* A pointer to the new arena, or NULL if the creation fails.
+ */
+struct secmalloc_arena* secmalloc_arena_create(size_t chunk_size)
+{
+    LOG_TRACE("\n\nCALL ARENA CREATE chunk_size %zu\n", chunk_size);
+
+    struct secmalloc_arena    *arena = my_malloc(sizeof(struct secmalloc_arena));
+    if (arena == NULL)
+    {
+        return NULL;
+    }
+
+    arena->head = NULL;
+    arena->current = NULL;
+    arena->chunk_size = chunk_size == 0 ? ARENA_CHUNK_SIZE : chunk_size;
+    arena->canary = my_generate_canary();
+
+    // Allocate the first chunk right away so that the first allocations are cheap
+    arena->current = my_arena_new_chunk(arena, 0);
+    if (arena->canary == -1 || arena->current == NULL)
+    {
+        secmalloc_arena_destroy(arena);
+        return NULL;
+    }
+
+    LOG_TRACE("RETURN ARENA CREATE : %p\n", arena);
+    return arena;
+}
+
+/**
+ * @brief Allocate memory in an arena.
+ *
+ * The fast path only bumps the cursor of the current chunk, a new chunk is
+ * taken when the current one is full.
+ *
+ * @param arena The arena to allocate from.
+ * @param size The size of the memory block to allocate.
+ * @return void* A pointer to the allocated memory, or NULL if the allocation fails.
+ */
+void* secmalloc_arena_alloc(struct secmalloc_arena *arena, size_t size)
+{
+    if (arena == NULL || size == 0)
+    {
+        return NULL;
+    }
+
+    struct arena_chunk    *chunk = arena->current;
+    char                  *record = chunk->cursor;
+
+    if (size > (size_t)(chunk->end - record) || (size_t)(chunk->end - record) - size < ARENA_HEADER_SIZE + sizeof(long))
+    {
+        // Current chunk is full, use the next empty one or allocate a new one
+        chunk = chunk->next;
+        if (chunk == NULL || size > (size_t)(chunk->end - chunk->cursor) - ARENA_HEADER_SIZE - sizeof(long))
+        {
+            chunk = my_arena_new_chunk(arena, size);
+            if (chunk == NULL)
+            {
+                return NULL;
+            }
+        }
+        arena->current = chunk;
+        record = chunk->cursor;
+    }
+
+    // Write the object header and the canary, then bump the cursor
+    char    *ptr = record + ARENA_HEADER_SIZE;
+    *(size_t*)record = size;
+    *(long*)(ptr + size) = arena->canary ^ (long)ptr;
+    chunk->cursor = my_arena_align(ptr + size + sizeof(long));
+    if (chunk->cursor > chunk->end)
+    {
+        chunk->cursor = chunk->end;
+    }
+
+    return ptr;
+}
+
+/**
+ * @brief Release every allocation of an arena.
+ *
+ * This function walks every object of every chunk to verify its canary, and
+ * scrubs each chunk with a single memset.
+ *
+ * @param arena The arena to reset.
+ * @return int 0 if every canary is valid, -1 otherwise.
+ */
+int secmalloc_arena_reset(struct secmalloc_arena *arena)
+{
+    LOG_TRACE("\n\nCALL ARENA RESET %p\n", arena);
+
+    if (arena == NULL)
+    {
+        LOG_ERROR("Error: Invalid arena to reset: NULL\n");
+        return -1;
+    }
+
+    int    ret = 0;
+    for (struct arena_chunk *chunk = arena->head; chunk != NULL; chunk = chunk->next)
+    {
+        char    *start = my_arena_chunk_start(chunk);
+
+        // Verify the canary of every object of the chunk
+        for (char *record = start; record < chunk->cursor;)
+        {
+            size_t    size = *(size_t*)record;
+            char      *ptr = record + ARENA_HEADER_SIZE;
+            if (size > (size_t)(chunk->cursor - ptr))
+            {
+                LOG_ERROR("Error: Arena object header at %p corrupted\n", record);
+                ret = -1;
+                break;
+            }
+            if (*(long*)(ptr + size) != (arena->canary ^ (long)ptr))
+            {
+                LOG_ERROR("Error: Canary verification failed : Buffer overflow detected in arena object %p\n", ptr);
+                ret = -1;
+            }
+            record = my_arena_align(ptr + size + sizeof(long));
+        }
+
+        // Scrub the used part of the chunk
+        memset(start, 0, chunk->cursor - start);
+        chunk->cursor = start;
+    }
+    arena->current = arena->head;
+
+    LOG_TRACE("RETURN ARENA RESET : %d\n", ret);
+    return ret;
+}
+
+/**
+ * @brief Destroy an arena.
+ *
+ * @param arena The arena to destroy.
+ */
+void secmalloc_arena_destroy(struct secmalloc_arena *arena)
+{
+    LOG_TRACE("\n\nCALL ARENA DESTROY %p\n", arena);
+
+    if (arena == NULL)
+    {
+        LOG_ERROR("Error: Invalid arena to destroy: NULL\n");
+        return;
+    }
+
+    secmalloc_arena_reset(arena);
+
+    struct arena_chunk    *chunk = arena->head;
+    while (chunk != NULL)
+    {
+        struct arena_chunk    *next = chunk->next;
+        my_free(chunk);
+        chunk = next;
+    }
+    my_free(arena);
+
+    LOG_TRACE("RETURN ARENA DESTROY\n");
+}
@@ -0,0 +1,397 @@
+/**
+ * @file buddy.c
+ * @brief Implementation of the buddy zone of the page-sized blocks.
+ *
+ * This file contains the implementation of a binary buddy system serving the
+ * page-sized and multi-page allocations of a heap, when MSM_BUDDY is set. The
+ * blocks are carved from a range reserved for the heap rather than split from
+ * the end of the heap data, and a freed block merges with its buddy in
+ * O(log n). The state of the blocks lives out of band in the zone, each block
+ * is followed by a canary.
+ */
+
+#include "secmalloc.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "log.h"
+
+#define BITS_PER_LONG    (8 * sizeof(unsigned long))
+
+/**
+ * @brief Get the order of the block holding a size.
+ *
+ * The zone serves the blocks taking at least a page, or the mmap threshold
+ * set with mallopt, and at most a largest block along with their canary,
+ * when MSM_BUDDY is set.
+ *
+ * @param size The size of the block.
+ * @return int The order, -1 if the size is not served by the zone.
+ */
+static int my_buddy_order(size_t size)
+{
+    size_t    min = my_config()->buddy;
+    if (min == 0 || size < min || size > BUDDY_BLOCK_SIZE - sizeof(long))
+    {
+        return -1;
+    }
+
+    int    order = 0;
+    while ((size_t)PAGE_HEAP_SIZE << order < size + sizeof(long))
+    {
+        order++;
+    }
+    return order;
+}
+
+/**
+ * @brief Get the index of the bit of a block in the bitmap of the zone.
+ *
+ * @param order The order of the block.
+ * @param page The first page of the block.
+ * @return size_t The index of the bit.
+ */
+static size_t my_buddy_bit(int order, size_t page)
+{
+    size_t    offset = 0;
+    for (int i = 0; i < order; i++)
+    {
+        offset += BUDDY_PAGES >> i;
+    }
+    return offset + (page >> order);
+}
+
+/**
+ * @brief Check whether a block is free.
+ *
+ * @param zone The zone.
+ * @param order The order of the block.
+ * @param page The first page of the block.
+ * @return int 1 if the block is free, 0 otherwise.
+ */
+static int my_buddy_is_free(struct buddy_zone *zone, int order, size_t page)
+{
+    size_t    bit = my_buddy_bit(order, page);
+    return (zone->bitmap[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1;
+}
+
+/**
+ * @brief Push a free block on the free list of its order.
+ *
+ * @param zone The zone.
+ * @param order The order of the block.
+ * @param page The first page of the block.
+ */
+static void my_buddy_push(struct buddy_zone *zone, int order, size_t page)
+{
+    struct buddy_page    *state = &zone->pages[page];
+    size_t               bit = my_buddy_bit(order, page);
+
+    state->order = order;
+    state->size = 0;
+    state->prev = 0;
+    state->next = zone->heads[order];
+    if (state->next != 0)
+    {
+        zone->pages[state->next - 1].prev = page + 1;
+    }
+    zone->heads[order] = page + 1;
+    zone->orders |= 1UL << order;
+    zone->bitmap[bit / BITS_PER_LONG] |= 1UL << (bit % BITS_PER_LONG);
+}
+
+/**
+ * @brief Take a free block out of the free list of its order.
+ *
+ * @param zone The zone.
+ * @param order The order of the block.
+ * @param page The first page of the block.
+ */
+static void my_buddy_unlink(struct buddy_zone *zone, int order, size_t page)
+{
+    struct buddy_page    *state = &zone->pages[page];
+    size_t               bit = my_buddy_bit(order, page);
+
+    if (state->prev != 0)
+    {
+        zone->pages[state->prev - 1].next = state->next;
+    }
+    else
+    {
+        zone->heads[order] = state->next;
+    }
+    if (state->next != 0)
+    {
+        zone->pages[state->next - 1].prev = state->prev;
+    }
+    if (zone->heads[order] == 0)
+    {
+        zone->orders &= ~(1UL << order);
+    }
+    zone->bitmap[bit / BITS_PER_LONG] &= ~(1UL << (bit % BITS_PER_LONG));
+}
+
+/**
+ * @brief Create the buddy zone of a heap.
+ *
+ * The range of the zone is reserved without access and aligned on the size
+ * of the largest blocks, its state is mapped and faulted in as it is used.
+ *
+ * @param heap The heap.
+ * @return struct buddy_zone* A pointer to the zone, or NULL if the mapping fails.
+ */
+static struct buddy_zone* my_buddy_create(struct secmalloc_heap *heap)
+{
+    LOG_TRACE("call buddy_create\n");
+
+    struct buddy_zone    *zone = mmap(NULL, sizeof(struct buddy_zone), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (zone == MAP_FAILED)
+    {
+        perror("mmap");
+        LOG_ERROR("Error: Failed to mmap memory for buddy zone.\n");
+        return NULL;
+    }
+
+    // Reserve one more largest block and trim the range to get an aligned zone
+    size_t    size = (size_t)BUDDY_BLOCKS * BUDDY_BLOCK_SIZE;
+    char      *map = mmap(NULL, size + BUDDY_BLOCK_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        LOG_ERROR("Error: Failed to mmap memory for buddy zone.\n");
+        munmap(zone, sizeof(struct buddy_zone));
+        return NULL;
+    }
+    zone->base = (char*)(((size_t)map + BUDDY_BLOCK_SIZE - 1) & ~((size_t)BUDDY_BLOCK_SIZE - 1));
+    if (zone->base > map)
+    {
+        munmap(map, zone->base - map);
+    }
+    munmap(zone->base + size, map + BUDDY_BLOCK_SIZE - zone->base);
+
+    // Largest blocks can be backed by transparent huge pages
+    if (my_growth_policy()->hugepage != HUGEPAGE_NONE)
+    {
+        madvise(zone->base, size, MADV_HUGEPAGE);
+    }
+    if (heap->node >= 0)
+    {
+        my_numa_bind(zone->base, size, heap->node);
+    }
+
+    LOG_TRACE("return buddy zone %p at %p\n", zone, zone->base);
+    return zone;
+}
+
+/**
+ * @brief Commit one more largest block of a buddy zone.
+ *
+ * @param heap The heap owning the zone.
+ * @param zone The zone.
+ * @return int 0 on success, -1 if the zone is full or the commit fails.
+ */
+static int my_buddy_grow(struct secmalloc_heap *heap, struct buddy_zone *zone)
+{
+    if (zone->blocks == BUDDY_BLOCKS)
+    {
+        LOG_ERROR("Error: Buddy zone full\n");
+        return -1;
+    }
+
+    char    *block = zone->base + zone->blocks * BUDDY_BLOCK_SIZE;
+    if (mprotect(block, BUDDY_BLOCK_SIZE, PROT_READ | PROT_WRITE) == -1)
+    {
+        perror("mprotect");
+        LOG_ERROR("Error: Failed to commit buddy block.\n");
+        return -1;
+    }
+    heap->growth_syscalls++;
+    if (my_growth_policy()->populate)
+    {
+        my_populate(block, BUDDY_BLOCK_SIZE);
+    }
+
+    my_buddy_push(zone, BUDDY_MAX_ORDER, zone->blocks << BUDDY_MAX_ORDER);
+    zone->blocks++;
+    return 0;
+}
+
+/**
+ * @brief Allocate a page-sized block from the buddy zone of a heap.
+ *
+ * The smallest free block large enough is split in halves down to the order
+ * of the size, the second halves going back to the free lists.
+ *
+ * @param heap The heap.
+ * @param size The size of the block.
+ * @return void* A pointer to the block, or NULL if the size is not served by the zone or the zone is full.
+ */
+void* my_buddy_alloc(struct secmalloc_heap *heap, size_t size)
+{
+    int    order = my_buddy_order(size);
+    if (order == -1)
+    {
+        return NULL;
+    }
+
+    LOG_TRACE("call buddy_alloc for size %zu, order %d\n", size, order);
+
+    if (heap->buddy == NULL)
+    {
+        __atomic_store_n(&heap->buddy, my_buddy_create(heap), __ATOMIC_RELEASE); // my_numa_owner() reads the zone without the lock
+        if (heap->buddy == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    // Find the smallest order holding a free block large enough
+    struct buddy_zone    *zone = heap->buddy;
+    size_t               orders = zone->orders & (~0UL << order);
+    if (orders == 0)
+    {
+        if (my_buddy_grow(heap, zone) == -1)
+        {
+            return NULL;
+        }
+        orders = zone->orders & (~0UL << order);
+    }
+    int       current = __builtin_ctzl(orders);
+    size_t    page = zone->heads[current] - 1;
+    my_buddy_unlink(zone, current, page);
+
+    // Split it down to the order of the size
+    while (current > order)
+    {
+        current--;
+        my_buddy_push(zone, current, page + (1UL << current));
+    }
+
+    long    canary = my_heap_canary(heap);
+    if (canary == -1)
+    {
+        my_buddy_push(zone, order, page);
+        return NULL;
+    }
+
+    char    *ptr = zone->base + page * PAGE_HEAP_SIZE;
+    zone->pages[page].order = order;
+    zone->pages[page].size = size;
+    zone->pages[page].canary = canary;
+    *(long*)(ptr + size) = canary;
+
+    LOG_TRACE("return buddy block %p of order %d\n", ptr, order);
+    return ptr;
+}
+
+/**
+ * @brief Check whether a pointer lies in the buddy zone of a heap.
+ *
+ * @param heap The heap.
+ * @param ptr The pointer.
+ * @return int 1 if the pointer lies in the zone, 0 otherwise.
+ */
+int my_buddy_owns(struct secmalloc_heap *heap, void *ptr)
+{
+    struct buddy_zone    *zone = heap->buddy;
+    return zone != NULL && (char*)ptr >= zone->base && (char*)ptr < zone->base + (size_t)BUDDY_BLOCKS * BUDDY_BLOCK_SIZE;
+}
+
+/**
+ * @brief Get the size of an allocated block of the buddy zone of a heap.
+ *
+ * @param heap The heap.
+ * @param ptr A pointer to the block.
+ * @return size_t The size of the block, 0 if the pointer is not an allocated block.
+ */
+size_t my_buddy_size(struct secmalloc_heap *heap, void *ptr)
+{
+    struct buddy_zone    *zone = heap->buddy;
+    size_t               offset = (char*)ptr - zone->base;
+    if (offset % PAGE_HEAP_SIZE != 0 || offset / PAGE_HEAP_SIZE >= zone->blocks << BUDDY_MAX_ORDER)
+    {
+        return 0;
+    }
+    return zone->pages[offset / PAGE_HEAP_SIZE].size;
+}
+
+/**
+ * @brief Free a block of the buddy zone of a heap.
+ *
+ * This function checks that the pointer is the start of an allocated block,
+ * verifies its canary and cleans it unless MSM_CANARY or MSM_SCRUB is 0,
+ * then merges it with its buddy as long as the buddy is free.
+ *
+ * @param heap The heap.
+ * @param ptr A pointer to the block.
+ */
+void my_buddy_free(struct secmalloc_heap *heap, void *ptr)
+{
+    struct buddy_zone    *zone = heap->buddy;
+    size_t               size = my_buddy_size(heap, ptr);
+    size_t               page = ((char*)ptr - zone->base) / PAGE_HEAP_SIZE;
+
+    if (size == 0)
+    {
+        // A page inside a free block was handed out then freed, anything else never was
+        for (int order = 0; order <= BUDDY_MAX_ORDER && ((char*)ptr - zone->base) % PAGE_HEAP_SIZE == 0 && page < zone->blocks << BUDDY_MAX_ORDER; order++)
+        {
+            if (my_buddy_is_free(zone, order, page & ~((1UL << order) - 1)))
+            {
+                LOG_ERROR("Error: Double free\n");
+                return;
+            }
+        }
+        LOG_ERROR("Error: Invalid pointer to free: not in the heap\n");
+        return;
+    }
+
+    LOG_TRACE("call buddy_free %p of order %u\n", ptr, zone->pages[page].order);
+
+    if (my_config()->canary && *(long*)((char*)ptr + size) != zone->pages[page].canary)
+    {
+        LOG_ERROR("Error: Canary verification failed : Buffer overflow detected\n");
+    }
+    if (my_config()->scrub)
+    {
+        memset(ptr, 0, size + sizeof(long));
+    }
+    zone->pages[page].size = 0;
+
+    // Merge with the buddy as long as it is free
+    int    order = zone->pages[page].order;
+    while (order < BUDDY_MAX_ORDER)
+    {
+        size_t    buddy = page ^ (1UL << order);
+        if (!my_buddy_is_free(zone, order, buddy))
+        {
+            break;
+        }
+        my_buddy_unlink(zone, order, buddy);
+        page = page < buddy ? page : buddy;
+        order++;
+    }
+    my_buddy_push(zone, order, page);
+
+    LOG_TRACE("return buddy_free : block at page %zu of order %d\n", page, order);
+}
+
+/**
+ * @brief Release the buddy zone of a heap.
+ *
+ * @param heap The heap.
+ */
+void my_buddy_destroy(struct secmalloc_heap *heap)
+{
+    if (heap->buddy == NULL)
+    {
+        return;
+    }
+
+    if (munmap(heap->buddy->base, (size_t)BUDDY_BLOCKS * BUDDY_BLOCK_SIZE) == -1 || munmap(heap->buddy, sizeof(struct buddy_zone)) == -1)
+    {
+        perror("munmap");
+        LOG_ERROR("Error: Failed to munmap buddy zone.\n");
+    }
+    heap->buddy = NULL;
+}
@@ -0,0 +1,222 @@
+/**
+ * @file config.c
+ * @brief Implementation of the tunables of the library.
+ *
+ * This file contains the implementation of the tunables read once from the
+ * MSM_* environment variables, at the first allocation, and of
+ * secmalloc_mallopt() changing them afterwards. The hot paths only read the
+ * cached fields.
+ */
+
+#include "secmalloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+
+struct secmalloc_config    secmalloc_config = {
+    .initialized = 0, // Read from the environment on first use
+    .canary = 1, // Canaries are verified by default
+    .scrub = 1, // Freed blocks are cleaned by default
+    .defer = 0, // Merges are not deferred by default
+    .defer_max = DEFER_BINS * DEFER_BIN_SIZE, // Every cached class is taken back
+    .quarantine = 0, // No quarantine by default
+    .best_fit = BEST_FIT_MIN, // Large allocations are served best-fit
+    .fit_scan = NULL, // Best scan kernel of the CPU
+    .buddy = 0, // No buddy zone by default
+    .numa = NUMA_AUTO, // Heaps of the nodes on multi-node systems
+    .trace = NULL, // No binary trace by default
+};
+
+static pthread_mutex_t    config_lock = PTHREAD_MUTEX_INITIALIZER; // Lock of the first read and of the changes by mallopt
+
+/**
+ * @brief Read a size from an environment variable.
+ *
+ * @param name The name of the environment variable.
+ * @param value The default value.
+ * @return size_t The value of the variable, or the default value if it is not set or invalid.
+ */
+size_t my_getenv_size(const char *name, size_t value)
+{
+    char    *str = getenv(name);
+    if (str == NULL || *str == '\0')
+    {
+        return value;
+    }
+
+    // strtoul negates the values starting with a minus sign rather than rejecting them
+    char             *end = NULL;
+    unsigned long    parsed = strtoul(str, &end, 0);
+    if (*end != '\0' || str[strspn(str, " \t\n\v\f\r")] == '-')
+    {
+        LOG_ERROR("Error: Invalid value %s for %s\n", str, name);
+        return value;
+    }
+    return parsed;
+}
+
+/**
+ * @brief Read the tunables from the environment.
+ *
+ * The growth and purge tunables are stored raw in their policies, which
+ * normalize them when they are first used.
+ */
+static void my_config_read()
+{
+    growth_policy.min_step = my_getenv_size("MSM_GROWTH_MIN_STEP", growth_policy.min_step);
+    growth_policy.max_step = my_getenv_size("MSM_GROWTH_MAX_STEP", growth_policy.max_step);
+    growth_policy.factor = my_getenv_size("MSM_GROWTH_FACTOR", growth_policy.factor);
+    growth_policy.cap = my_getenv_size("MSM_GROWTH_CAP", growth_policy.cap);
+    growth_policy.hugepage = my_getenv_size("MSM_HUGEPAGE", growth_policy.hugepage);
+    growth_policy.populate = my_getenv_size("MSM_POPULATE", growth_policy.populate) != 0;
+    purge_policy.decay = my_getenv_size("MSM_PURGE_DECAY", purge_policy.decay);
+    purge_policy.lazy = my_getenv_size("MSM_PURGE_LAZY", purge_policy.lazy) != 0;
+    purge_policy.thread = my_getenv_size("MSM_PURGE_THREAD", purge_policy.thread) != 0;
+
+    struct secmalloc_config    *config = &secmalloc_config;
+    config->canary = my_getenv_size("MSM_CANARY", config->canary) != 0;
+    config->scrub = my_getenv_size("MSM_SCRUB", config->scrub) != 0;
+    config->defer = my_getenv_size("MSM_DEFER", config->defer);
+    config->quarantine = my_getenv_size("MSM_QUARANTINE", config->quarantine);
+    if (config->quarantine > 100)
+    {
+        config->quarantine = 100;
+    }
+    config->best_fit = my_getenv_size("MSM_BEST_FIT", config->best_fit);
+    config->fit_scan = getenv("MSM_FIT_SCAN");
+    config->buddy = my_getenv_size("MSM_BUDDY", 0) != 0 ? PAGE_HEAP_SIZE - sizeof(long) : 0;
+    config->numa = my_getenv_size("MSM_NUMA", config->numa);
+    config->trace = getenv("MSM_TRACE");
+
+    LOG_INFO("config : canary %zu, scrub %zu, defer %zu, quarantine %zu%%, best fit from %zu, buddy from %zu\n", config->canary, config->scrub, config->defer, config->quarantine, config->best_fit, config->buddy);
+}
+
+/**
+ * @brief Get the tunables of the library.
+ *
+ * The environment is read the first time this function is called, later
+ * calls only check a flag.
+ *
+ * @return struct secmalloc_config* A pointer to the tunables.
+ */
+struct secmalloc_config* my_config()
+{
+    if (__atomic_load_n(&secmalloc_config.initialized, __ATOMIC_ACQUIRE) == 0)
+    {
+        pthread_mutex_lock(&config_lock);
+        if (secmalloc_config.initialized == 0)
+        {
+            my_config_read();
+            __atomic_store_n(&secmalloc_config.initialized, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&config_lock);
+    }
+    return &secmalloc_config;
+}
+
+/**
+ * @brief Change a tunable of the library.
+ *
+ * The parameters follow mallopt: M_TOP_PAD sets the minimal growth step of
+ * the heaps, M_MMAP_THRESHOLD the minimal size of the blocks served by the
+ * buddy zone, and M_MXFAST the maximal size of the blocks taken back from the
+ * quick-reuse cache. The M_SECMALLOC_* parameters set the other tunables.
+ *
+ * The changes are made under the lock of the configuration and published
+ * with atomic stores, the allocations reading the tunables without a lock.
+ * Disabling the quarantine releases the blocks held in the quarantines of the
+ * default heap and of the heaps of the NUMA nodes.
+ *
+ * @param param The parameter.
+ * @param value The new value.
+ * @return int 1 on success, 0 if the parameter or the value is invalid.
+ */
+int secmalloc_mallopt(int param, int value)
+{
+    struct secmalloc_config    *config = my_config();
+    struct growth_policy       *growth = my_growth_policy();
+    struct purge_policy        *purge = my_purge_policy();
+    if (value < 0)
+    {
+        LOG_ERROR("Error: Invalid value %d for mallopt parameter %d\n", value, param);
+        return 0;
+    }
+
+    // The first allocation takes the lock of the configuration under the lock of a heap, so no heap
+    // is locked under it here, and the purge thread, whose creation may allocate, is started before
+    if (param == M_SECMALLOC_PURGE_THREAD && value != 0 && my_purge_start() == -1)
+    {
+        return 0;
+    }
+
+    size_t    granule = my_page_granule();
+    size_t    step = value == 0 ? granule : ((value + granule - 1) / granule) * granule;
+    int       ret = 1;
+    pthread_mutex_lock(&config_lock);
+    switch (param)
+    {
+        case M_TOP_PAD:
+            __atomic_store_n(&growth->min_step, step, __ATOMIC_RELEASE);
+            if (growth->max_step < step)
+            {
+                __atomic_store_n(&growth->max_step, step, __ATOMIC_RELEASE);
+            }
+            break;
+        case M_MMAP_THRESHOLD:
+            if ((size_t)value > BUDDY_BLOCK_SIZE - sizeof(long))
+            {
+                LOG_ERROR("Error: Invalid mmap threshold %d, the largest buddy block is %zu bytes\n", value, (size_t)BUDDY_BLOCK_SIZE);
+                ret = 0;
+                break;
+            }
+            __atomic_store_n(&config->buddy, (size_t)value < PAGE_HEAP_SIZE - sizeof(long) ? PAGE_HEAP_SIZE - sizeof(long) : (size_t)value, __ATOMIC_RELEASE);
+            break;
+        case M_MXFAST:
+            if (value > DEFER_BINS * DEFER_BIN_SIZE)
+            {
+                LOG_ERROR("Error: Invalid fast size %d, the quick-reuse cache holds up to %d bytes\n", value, DEFER_BINS * DEFER_BIN_SIZE);
+                ret = 0;
+                break;
+            }
+            __atomic_store_n(&config->defer_max, (size_t)value, __ATOMIC_RELEASE);
+            break;
+        case M_SECMALLOC_CANARY:
+            __atomic_store_n(&config->canary, (size_t)(value != 0), __ATOMIC_RELEASE);
+            break;
+        case M_SECMALLOC_SCRUB:
+            __atomic_store_n(&config->scrub, (size_t)(value != 0), __ATOMIC_RELEASE);
+            break;
+        case M_SECMALLOC_DEFER:
+            __atomic_store_n(&config->defer, (size_t)value, __ATOMIC_RELEASE);
+            break;
+        case M_SECMALLOC_QUARANTINE:
+            __atomic_store_n(&config->quarantine, (size_t)(value > 100 ? 100 : value), __ATOMIC_RELEASE);
+            break;
+        case M_SECMALLOC_PURGE_DECAY:
+            __atomic_store_n(&purge->decay, (size_t)value, __ATOMIC_RELEASE);
+            break;
+        case M_SECMALLOC_PURGE_THREAD:
+            __atomic_store_n(&purge->thread, value != 0, __ATOMIC_RELEASE);
+            break;
+        default:
+            LOG_ERROR("Error: Unknown mallopt parameter %d\n", param);
+            ret = 0;
+            break;
+    }
+    pthread_mutex_unlock(&config_lock);
+    if (ret == 0)
+    {
+        return 0;
+    }
+
+    // The blocks held in quarantine are released once the configuration is unlocked
+    if (param == M_SECMALLOC_QUARANTINE && value == 0)
+    {
+        pthread_mutex_lock(&secmalloc_default_heap.lock);
+        my_heap_quarantine_flush(&secmalloc_default_heap);
+        pthread_mutex_unlock(&secmalloc_default_heap.lock);
+        my_numa_quarantine_flush();
+    }
+    LOG_INFO("mallopt : parameter %d set to %d\n", param, value);
+    return 1;
+}
@@ -0,0 +1,156 @@
+/**
+ * @file defer.c
+ * @brief Implementation of the deferred coalescing of the free chunks.
+ *
+ * This file contains the implementation of an option deferring the merge of
+ * the freed chunks. When MSM_DEFER is set, a freed chunk is left as it is and
+ * put in a quick-reuse cache by size class, so that an allocation of the same
+ * size takes it back without a lookup nor a split. The merges run in a batch
+ * once MSM_DEFER frees are pending, or when a lookup misses.
+ *
+ * secmalloc_prewarm_classes() also fills the cache with chunks split ahead,
+ * they are taken back the same way until a merge of the heap folds them.
+ */
+
+#include "secmalloc.h"
+#include "log.h"
+
+/**
+ * @brief Get the number of frees whose merge is deferred before a batch merge.
+ *
+ * The number is read from MSM_DEFER along with the other tunables.
+ *
+ * @return size_t The number of frees, 0 when the merge is not deferred.
+ */
+size_t my_defer_threshold()
+{
+    return my_config()->defer;
+}
+
+/**
+ * @brief Get the class of the quick-reuse cache of a size.
+ *
+ * @param size The size.
+ * @return size_t The class, DEFER_BINS if the size is too large to be cached.
+ */
+static size_t my_defer_bin(size_t size)
+{
+    size_t    bin = (size - 1) / DEFER_BIN_SIZE;
+    return bin < DEFER_BINS && size <= my_config()->defer_max ? bin : DEFER_BINS;
+}
+
+/**
+ * @brief Put a freed chunk in the quick-reuse cache and defer its merge.
+ *
+ * The chunk stays free in the fit index, so lookups can take it too. A full
+ * class of the cache simply leaves the chunk out.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The freed chunk.
+ */
+void my_heap_defer_free(struct secmalloc_heap *heap, struct chunkmetadata *item)
+{
+    size_t    bin = my_defer_bin(item->size);
+    if (bin < DEFER_BINS && heap->defer_counts[bin] < DEFER_BIN_DEPTH)
+    {
+        heap->defer_bins[bin][heap->defer_counts[bin]++] = item - heap->metadata + 1;
+    }
+    my_fit_update(heap, item);
+
+    heap->defer_pending++;
+    if (heap->defer_pending >= my_defer_threshold())
+    {
+        my_heap_defer_flush(heap);
+    }
+}
+
+/**
+ * @brief Get the number of chunks of a size the quick-reuse cache can still hold.
+ *
+ * @param heap The heap.
+ * @param size The size of the chunks.
+ * @return size_t The number of chunks, 0 if the size is not cached.
+ */
+size_t my_heap_defer_room(struct secmalloc_heap *heap, size_t size)
+{
+    size_t    bin = my_defer_bin(size);
+    return bin < DEFER_BINS ? DEFER_BIN_DEPTH - heap->defer_counts[bin] : 0;
+}
+
+/**
+ * @brief Put a free chunk in the quick-reuse cache without deferring a merge.
+ *
+ * The chunk is split ahead rather than freed, so it is not counted in the
+ * pending frees and never brings the batch merge closer.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The free chunk.
+ */
+void my_heap_defer_seed(struct secmalloc_heap *heap, struct chunkmetadata *item)
+{
+    size_t    bin = my_defer_bin(item->size);
+    if (bin < DEFER_BINS && heap->defer_counts[bin] < DEFER_BIN_DEPTH)
+    {
+        heap->defer_bins[bin][heap->defer_counts[bin]++] = item - heap->metadata + 1;
+    }
+    my_fit_update(heap, item);
+}
+
+/**
+ * @brief Take a chunk freed recently for an allocation of the same size.
+ *
+ * The cache is not updated when chunks are taken by a lookup, so the chunks
+ * popped are checked to be still free and indexed with their size.
+ *
+ * @param heap The heap.
+ * @param size The size of the allocation.
+ * @return struct chunkmetadata* A pointer to the chunk, or NULL if there is none.
+ */
+struct chunkmetadata* my_heap_defer_reuse(struct secmalloc_heap *heap, size_t size)
+{
+    size_t    bin = my_defer_bin(size);
+    if (bin == DEFER_BINS)
+    {
+        return NULL;
+    }
+
+    while (heap->defer_counts[bin] > 0)
+    {
+        struct chunkmetadata    *item = heap->metadata + heap->defer_bins[bin][--heap->defer_counts[bin]] - 1;
+        if (item->flags == FREE && heap->fit_sizes[item - heap->metadata] == item->size && my_defer_bin(item->size) == bin)
+        {
+            if (item->size >= size)
+            {
+                LOG_TRACE("reuse deferred block %p pointing to %p of size %zu bytes\n", item, CHUNK_ADDR(heap, item), item->size);
+                return item;
+            }
+            // Too small for this size, keep it for the next ones
+            heap->defer_counts[bin]++;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Run the deferred merges of a heap.
+ *
+ * @param heap The heap.
+ * @return int 1 if merges were pending, 0 otherwise.
+ */
+int my_heap_defer_flush(struct secmalloc_heap *heap)
+{
+    if (heap->defer_pending == 0)
+    {
+        return 0;
+    }
+
+    LOG_TRACE("call defer_flush for %zu frees\n", heap->defer_pending);
+    my_heap_merge_chunks(heap);
+    for (size_t bin = 0; bin < DEFER_BINS; bin++)
+    {
+        heap->defer_counts[bin] = 0;
+    }
+    heap->defer_pending = 0;
+    return 1;
+}
@@ -0,0 +1,684 @@
+/**
+ * @file fit.c
+ * @brief Implementation of the dense index of the free chunk sizes.
+ *
+ * This file contains the implementation of an array parallel to the heap
+ * metadata, holding for each metadata slot the size of its chunk when it is
+ * free and 0 otherwise. Fit searches scan this dense array instead of walking
+ * the linked list, several slots per instruction with AVX2 or SSE4.2 when the
+ * CPU supports them.
+ *
+ * The free chunks large enough to serve medium allocations are also kept in a
+ * size-ordered balanced tree, so that these allocations take the smallest
+ * chunk that fits in O(log n) rather than splitting the first one. The chunk
+ * at the end of the data is left out of the tree and only split when no other
+ * chunk fits, so that it keeps room for the large allocations.
+ *
+ * Built with TLSF=1, the tree and the scans are replaced by a two-level
+ * segregated fit: the free chunks are chained in lists by size class and two
+ * levels of bitmaps tell which lists are not empty, so that a lookup takes a
+ * bounded time whatever the number of chunks.
+ */
+
+#include "secmalloc.h"
+#include <immintrin.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+
+#define NODE(heap, n)    (&(heap)->fit_nodes[(n) - 1])
+
+#if TLSF
+
+/**
+ * @brief Get the size class of a size.
+ *
+ * Sizes below TLSF_SL_COUNT each have their class in the first first-level
+ * class, the larger ones are split by their highest bit then by the
+ * TLSF_SL_LOG2 bits below it.
+ *
+ * @param size The size.
+ * @param fl Filled with the first-level class.
+ * @param sl Filled with the second-level class.
+ */
+static void my_fit_class(size_t size, size_t *fl, size_t *sl)
+{
+    if (size < TLSF_SL_COUNT)
+    {
+        *fl = 0;
+        *sl = size;
+        return;
+    }
+
+    size_t    log = 63 - __builtin_clzl(size);
+    *fl = log - TLSF_SL_LOG2 + 1;
+    *sl = (size >> (log - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+}
+
+/**
+ * @brief Get the size of a free chunk a lookup is sure to find for a size.
+ *
+ * The size is rounded up to the next class, so that every chunk of the class
+ * looked up is large enough.
+ *
+ * @param size The size needed, canary included.
+ * @return size_t The size of the free chunk.
+ */
+size_t my_fit_round(size_t size)
+{
+    if (size >= TLSF_SL_COUNT)
+    {
+        size += ((size_t)1 << (63 - __builtin_clzl(size) - TLSF_SL_LOG2)) - 1;
+    }
+    return size;
+}
+
+/**
+ * @brief Set the size a slot is indexed under.
+ *
+ * @param heap The heap.
+ * @param index The slot.
+ * @param size The size of its free chunk, 0 to take it out of the index.
+ */
+static void my_fit_index(struct secmalloc_heap *heap, size_t index, size_t size)
+{
+    unsigned int       n = index + 1;
+    struct fit_node    *node = NODE(heap, n);
+    size_t             fl;
+    size_t             sl;
+    if (node->size == size)
+    {
+        return;
+    }
+
+    // Unlink the slot from the list of its former class
+    if (node->size != 0)
+    {
+        my_fit_class(node->size, &fl, &sl);
+        if (node->free_prev != 0)
+        {
+            NODE(heap, node->free_prev)->free_next = node->free_next;
+        }
+        else
+        {
+            heap->fit_heads[fl][sl] = node->free_next;
+        }
+        if (node->free_next != 0)
+        {
+            NODE(heap, node->free_next)->free_prev = node->free_prev;
+        }
+        if (heap->fit_heads[fl][sl] == 0)
+        {
+            heap->fit_sl[fl] &= ~((size_t)1 << sl);
+            if (heap->fit_sl[fl] == 0)
+            {
+                heap->fit_fl &= ~((size_t)1 << fl);
+            }
+        }
+    }
+
+    // Push it on the list of its new class
+    node->size = size;
+    if (size != 0)
+    {
+        my_fit_class(size, &fl, &sl);
+        node->free_prev = 0;
+        node->free_next = heap->fit_heads[fl][sl];
+        if (node->free_next != 0)
+        {
+            NODE(heap, node->free_next)->free_prev = n;
+        }
+        heap->fit_heads[fl][sl] = n;
+        heap->fit_sl[fl] |= (size_t)1 << sl;
+        heap->fit_fl |= (size_t)1 << fl;
+    }
+}
+
+/**
+ * @brief Look up a free chunk holding a size.
+ *
+ * The class of the rounded size is looked up first, then the next non-empty
+ * class found with the bitmaps, in constant time.
+ *
+ * @param heap The heap to search.
+ * @param size The size needed, canary included.
+ * @return struct chunkmetadata* A pointer to the chunk, or NULL if there is none.
+ */
+struct chunkmetadata* my_fit_lookup(struct secmalloc_heap *heap, size_t size)
+{
+    size_t    fl;
+    size_t    sl;
+    my_fit_class(my_fit_round(size), &fl, &sl);
+    if (fl >= TLSF_FL_COUNT)
+    {
+        return NULL;
+    }
+
+    size_t    sl_map = heap->fit_sl[fl] & (~(size_t)0 << sl);
+    if (sl_map == 0)
+    {
+        size_t    fl_map = fl + 1 < TLSF_FL_COUNT ? heap->fit_fl & (~(size_t)0 << (fl + 1)) : 0;
+        if (fl_map == 0)
+        {
+            return NULL;
+        }
+        fl = __builtin_ctzl(fl_map);
+        sl_map = heap->fit_sl[fl];
+    }
+    sl = __builtin_ctzl(sl_map);
+    return heap->metadata + heap->fit_heads[fl][sl] - 1;
+}
+
+/**
+ * @brief Reset the fit index of a heap.
+ *
+ * @param heap The heap.
+ */
+void my_fit_init(struct secmalloc_heap *heap)
+{
+    heap->fit_fl = 0;
+    memset(heap->fit_sl, 0, sizeof(heap->fit_sl));
+    memset(heap->fit_heads, 0, sizeof(heap->fit_heads));
+}
+
+#else
+
+static size_t    (*fit_scan)(const size_t*, size_t, size_t, size_t) = NULL; // Scan kernel matching the CPU
+
+/**
+ * @brief Find the first slot holding a free chunk large enough, one slot at a time.
+ *
+ * @param sizes The free sizes of the slots.
+ * @param start The first slot to test.
+ * @param count The number of slots.
+ * @param needed The size needed.
+ * @return size_t The index of the slot, or count if there is none.
+ */
+static size_t my_fit_scan_scalar(const size_t *sizes, size_t start, size_t count, size_t needed)
+{
+    for (size_t i = start; i < count; i++)
+    {
+        if (sizes[i] >= needed)
+        {
+            return i;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Find the first slot holding a free chunk large enough, two slots at a time.
+ *
+ * Sizes fit in 63 bits so they can be compared as signed integers.
+ *
+ * @param sizes The free sizes of the slots.
+ * @param start The first slot to test.
+ * @param count The number of slots.
+ * @param needed The size needed, greater than 0.
+ * @return size_t The index of the slot, or count if there is none.
+ */
+__attribute__((target("sse4.2")))
+static size_t my_fit_scan_sse42(const size_t *sizes, size_t start, size_t count, size_t needed)
+{
+    __m128i    threshold = _mm_set1_epi64x((long long)needed - 1);
+    size_t     i = start;
+
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128i    v = _mm_loadu_si128((const __m128i*)(sizes + i));
+        int        mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(v, threshold)));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return my_fit_scan_scalar(sizes, i, count, needed);
+}
+
+/**
+ * @brief Find the first slot holding a free chunk large enough, eight slots at a time.
+ *
+ * Sizes fit in 63 bits so they can be compared as signed integers.
+ *
+ * @param sizes The free sizes of the slots.
+ * @param start The first slot to test.
+ * @param count The number of slots.
+ * @param needed The size needed, greater than 0.
+ * @return size_t The index of the slot, or count if there is none.
+ */
+__attribute__((target("avx2")))
+static size_t my_fit_scan_avx2(const size_t *sizes, size_t start, size_t count, size_t needed)
+{
+    __m256i    threshold = _mm256_set1_epi64x((long long)needed - 1);
+    size_t     i = start;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i    a = _mm256_loadu_si256((const __m256i*)(sizes + i));
+        __m256i    b = _mm256_loadu_si256((const __m256i*)(sizes + i + 4));
+        int        mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(a, threshold)))
+                        | _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(b, threshold))) << 4;
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return my_fit_scan_scalar(sizes, i, count, needed);
+}
+
+/**
+ * @brief Choose the scan kernel matching the CPU.
+ *
+ * The kernel is chosen once, MSM_FIT_SCAN set to scalar, sse4.2 or avx2
+ * forces one of them, within what the CPU supports.
+ */
+static void my_fit_dispatch()
+{
+    __builtin_cpu_init();
+    const char    *forced = my_config()->fit_scan;
+    int           avx2 = __builtin_cpu_supports("avx2") && (forced == NULL || strcmp(forced, "avx2") == 0);
+    int           sse42 = __builtin_cpu_supports("sse4.2") && (forced == NULL || strcmp(forced, "scalar") != 0);
+
+    fit_scan = avx2 ? my_fit_scan_avx2 : sse42 ? my_fit_scan_sse42 : my_fit_scan_scalar;
+    LOG_INFO("fit scan : %s\n", avx2 ? "avx2" : sse42 ? "sse4.2" : "scalar");
+}
+
+/**
+ * @brief Get the minimal size of the allocations served best-fit.
+ *
+ * The size is read from MSM_BEST_FIT along with the other tunables, 0 serves
+ * every allocation first-fit.
+ *
+ * @return size_t The minimal size, 0 when best-fit is disabled.
+ */
+static size_t my_best_fit_min()
+{
+    return my_config()->best_fit;
+}
+
+/**
+ * @brief Get the height of a subtree of the best-fit tree.
+ *
+ * @param heap The heap.
+ * @param n The root of the subtree.
+ * @return unsigned int The height, 0 for an empty subtree.
+ */
+static unsigned int my_fit_height(struct secmalloc_heap *heap, unsigned int n)
+{
+    return n == 0 ? 0 : NODE(heap, n)->height;
+}
+
+/**
+ * @brief Compare two nodes of the best-fit tree, by size then by slot.
+ *
+ * @param heap The heap.
+ * @param a The first node.
+ * @param b The second node.
+ * @return int 1 if a comes before b, 0 otherwise.
+ */
+static int my_fit_less(struct secmalloc_heap *heap, unsigned int a, unsigned int b)
+{
+    return NODE(heap, a)->size < NODE(heap, b)->size || (NODE(heap, a)->size == NODE(heap, b)->size && a < b);
+}
+
+/**
+ * @brief Rotate a subtree of the best-fit tree.
+ *
+ * @param heap The heap.
+ * @param n The root of the subtree.
+ * @param right 1 to rotate to the right, 0 to the left.
+ * @return unsigned int The new root of the subtree.
+ */
+static unsigned int my_fit_rotate(struct secmalloc_heap *heap, unsigned int n, int right)
+{
+    struct fit_node    *node = NODE(heap, n);
+    unsigned int       child = right ? node->left : node->right;
+    struct fit_node    *pivot = NODE(heap, child);
+
+    if (right)
+    {
+        node->left = pivot->right;
+        pivot->right = n;
+    }
+    else
+    {
+        node->right = pivot->left;
+        pivot->left = n;
+    }
+    node->height = 1 + (my_fit_height(heap, node->left) > my_fit_height(heap, node->right) ? my_fit_height(heap, node->left) : my_fit_height(heap, node->right));
+    pivot->height = 1 + (my_fit_height(heap, pivot->left) > my_fit_height(heap, pivot->right) ? my_fit_height(heap, pivot->left) : my_fit_height(heap, pivot->right));
+    return child;
+}
+
+/**
+ * @brief Restore the balance of a subtree of the best-fit tree.
+ *
+ * @param heap The heap.
+ * @param n The root of the subtree, whose children are balanced.
+ * @return unsigned int The new root of the subtree.
+ */
+static unsigned int my_fit_balance(struct secmalloc_heap *heap, unsigned int n)
+{
+    struct fit_node    *node = NODE(heap, n);
+    unsigned int       left = my_fit_height(heap, node->left);
+    unsigned int       right = my_fit_height(heap, node->right);
+
+    node->height = 1 + (left > right ? left : right);
+    if (left > right + 1)
+    {
+        struct fit_node    *child = NODE(heap, node->left);
+        if (my_fit_height(heap, child->left) < my_fit_height(heap, child->right))
+        {
+            node->left = my_fit_rotate(heap, node->left, 0);
+        }
+        return my_fit_rotate(heap, n, 1);
+    }
+    if (right > left + 1)
+    {
+        struct fit_node    *child = NODE(heap, node->right);
+        if (my_fit_height(heap, child->right) < my_fit_height(heap, child->left))
+        {
+            node->right = my_fit_rotate(heap, node->right, 1);
+        }
+        return my_fit_rotate(heap, n, 0);
+    }
+    return n;
+}
+
+/**
+ * @brief Insert a node in a subtree of the best-fit tree.
+ *
+ * @param heap The heap.
+ * @param root The root of the subtree.
+ * @param n The node, whose size is set.
+ * @return unsigned int The new root of the subtree.
+ */
+static unsigned int my_fit_insert(struct secmalloc_heap *heap, unsigned int root, unsigned int n)
+{
+    if (root == 0)
+    {
+        return n;
+    }
+
+    if (my_fit_less(heap, n, root))
+    {
+        NODE(heap, root)->left = my_fit_insert(heap, NODE(heap, root)->left, n);
+    }
+    else
+    {
+        NODE(heap, root)->right = my_fit_insert(heap, NODE(heap, root)->right, n);
+    }
+    return my_fit_balance(heap, root);
+}
+
+/**
+ * @brief Remove the first node of a subtree of the best-fit tree.
+ *
+ * @param heap The heap.
+ * @param root The root of the subtree.
+ * @param first Filled with the node removed.
+ * @return unsigned int The new root of the subtree.
+ */
+static unsigned int my_fit_remove_first(struct secmalloc_heap *heap, unsigned int root, unsigned int *first)
+{
+    if (NODE(heap, root)->left == 0)
+    {
+        *first = root;
+        return NODE(heap, root)->right;
+    }
+
+    NODE(heap, root)->left = my_fit_remove_first(heap, NODE(heap, root)->left, first);
+    return my_fit_balance(heap, root);
+}
+
+/**
+ * @brief Remove a node from a subtree of the best-fit tree.
+ *
+ * @param heap The heap.
+ * @param root The root of the subtree, holding the node.
+ * @param n The node.
+ * @return unsigned int The new root of the subtree.
+ */
+static unsigned int my_fit_remove(struct secmalloc_heap *heap, unsigned int root, unsigned int n)
+{
+    struct fit_node    *node = NODE(heap, root);
+
+    if (root == n)
+    {
+        if (node->right == 0)
+        {
+            return node->left;
+        }
+
+        // The next node takes the place of the removed one
+        unsigned int       next;
+        unsigned int       right = my_fit_remove_first(heap, node->right, &next);
+        NODE(heap, next)->left = node->left;
+        NODE(heap, next)->right = right;
+        return my_fit_balance(heap, next);
+    }
+
+    if (my_fit_less(heap, n, root))
+    {
+        node->left = my_fit_remove(heap, node->left, n);
+    }
+    else
+    {
+        node->right = my_fit_remove(heap, node->right, n);
+    }
+    return my_fit_balance(heap, root);
+}
+
+/**
+ * @brief Set the size a slot is indexed under.
+ *
+ * Only the chunks large enough for a best-fit allocation are in the tree.
+ *
+ * @param heap The heap.
+ * @param index The slot.
+ * @param size The size of its free chunk, 0 to take it out of the index.
+ */
+static void my_fit_index(struct secmalloc_heap *heap, size_t index, size_t size)
+{
+    size_t    min = my_best_fit_min();
+    if (min == 0 || size < min || heap->metadata[index].next == 0)
+    {
+        size = 0;
+    }
+
+    unsigned int       n = index + 1;
+    struct fit_node    *node = NODE(heap, n);
+    if (node->size == size)
+    {
+        return;
+    }
+
+    if (node->size != 0)
+    {
+        heap->fit_root = my_fit_remove(heap, heap->fit_root, n);
+    }
+    node->size = size;
+    if (size != 0)
+    {
+        node->left = 0;
+        node->right = 0;
+        node->height = 1;
+        heap->fit_root = my_fit_insert(heap, heap->fit_root, n);
+    }
+}
+
+/**
+ * @brief Look up the smallest free chunk holding a size in the best-fit tree.
+ *
+ * @param heap The heap to search.
+ * @param size The size needed, canary included.
+ * @return struct chunkmetadata* A pointer to the chunk, or NULL if there is none.
+ */
+static struct chunkmetadata* my_fit_lookup_best(struct secmalloc_heap *heap, size_t size)
+{
+    unsigned int    best = 0;
+    unsigned int    n = heap->fit_root;
+
+    while (n != 0)
+    {
+        if (NODE(heap, n)->size >= size)
+        {
+            best = n;
+            n = NODE(heap, n)->left;
+        }
+        else
+        {
+            n = NODE(heap, n)->right;
+        }
+    }
+    return best == 0 ? NULL : heap->metadata + best - 1;
+}
+
+/**
+ * @brief Get the size of a free chunk a lookup is sure to find for a size.
+ *
+ * @param size The size needed, canary included.
+ * @return size_t The size of the free chunk.
+ */
+size_t my_fit_round(size_t size)
+{
+    return size;
+}
+
+/**
+ * @brief Look up a free chunk holding a size.
+ *
+ * Medium allocations take the smallest chunk that fits from the best-fit tree,
+ * or the chunk at the end of the data when none does. Smaller ones scan the
+ * dense sizes and keep the first chunk of the list, i.e. the one of the oldest
+ * segment with the lowest address, so that the result is the same as a
+ * first-fit walk of the list. The scan stops at the first match while the
+ * slots follow the list, and compares every match once they do not.
+ *
+ * @param heap The heap to search.
+ * @param size The size needed, canary included.
+ * @return struct chunkmetadata* A pointer to the chunk, or NULL if there is none.
+ */
+struct chunkmetadata* my_fit_lookup(struct secmalloc_heap *heap, size_t size)
+{
+    size_t    min = my_best_fit_min();
+    if (min > 0 && size >= min + sizeof(long))
+    {
+        struct chunkmetadata    *item = my_fit_lookup_best(heap, size);
+        if (item != NULL)
+        {
+            return item;
+        }
+    }
+
+    if (fit_scan == NULL)
+    {
+        my_fit_dispatch();
+    }
+
+    struct chunkmetadata    *best = NULL;
+    size_t                  count = heap->fit_count;
+
+    // The first slot found is the first chunk of the list while the slots follow it, the
+    // slots taken again after merges break that order and every match must be compared then
+    if (heap->fit_unordered == 0)
+    {
+        size_t    i = fit_scan(heap->fit_sizes, 0, count, size);
+        return i < count ? heap->metadata + i : NULL;
+    }
+    for (size_t i = fit_scan(heap->fit_sizes, 0, count, size); i < count; i = fit_scan(heap->fit_sizes, i + 1, count, size))
+    {
+        struct chunkmetadata    *item = heap->metadata + i;
+        if (best == NULL || item->segment < best->segment || (item->segment == best->segment && item->offset < best->offset))
+        {
+            best = item;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Reset the fit index of a heap.
+ *
+ * @param heap The heap.
+ */
+void my_fit_init(struct secmalloc_heap *heap)
+{
+    heap->fit_root = 0;
+}
+
+#endif
+
+/**
+ * @brief Set the previous chunk of the list of a slot.
+ *
+ * The links going back to a lower slot are counted, the first-fit lookup
+ * stops at the first match when there is none.
+ *
+ * @param heap The heap.
+ * @param index The slot.
+ * @param prev The previous chunk, slot plus one, 0 for none.
+ */
+static void my_fit_link(struct secmalloc_heap *heap, size_t index, unsigned int prev)
+{
+    struct fit_node    *node = &heap->fit_nodes[index];
+    heap->fit_unordered -= node->prev > index + 1;
+    node->prev = prev;
+    heap->fit_unordered += node->prev > index + 1;
+}
+
+/**
+ * @brief Update the free size of the slot of a chunk.
+ *
+ * The shadow of the data and the last chunk of the list are kept in sync
+ * from here, every change of a chunk going through this function.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The chunk.
+ */
+void my_fit_update(struct secmalloc_heap *heap, struct chunkmetadata *item)
+{
+    size_t    index = item - heap->metadata;
+    heap->fit_sizes[index] = item->flags == FREE ? item->size : 0;
+    my_fit_index(heap, index, heap->fit_sizes[index]);
+    if (item->next != 0)
+    {
+        my_fit_link(heap, item->next - 1, index + 1);
+    }
+    else
+    {
+        heap->last_chunk = index + 1;
+    }
+    if (index >= heap->fit_count)
+    {
+        heap->fit_count = index + 1;
+    }
+    my_shadow_update(heap, item);
+}
+
+/**
+ * @brief Clear the free size of the slot of a chunk no longer in the list.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The chunk.
+ */
+void my_fit_clear(struct secmalloc_heap *heap, struct chunkmetadata *item)
+{
+    heap->fit_sizes[item - heap->metadata] = 0;
+    my_fit_index(heap, item - heap->metadata, 0);
+    my_fit_link(heap, item - heap->metadata, 0);
+    my_shadow_clear(heap, item);
+}
+
+/**
+ * @brief Get the previous chunk of the list.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The chunk.
+ * @return struct chunkmetadata* A pointer to the previous chunk, or NULL for the first one.
+ */
+struct chunkmetadata* my_fit_prev(struct secmalloc_heap *heap, struct chunkmetadata *item)
+{
+    unsigned int    prev = heap->fit_nodes[item - heap->metadata].prev;
+    return item == heap->metadata || prev == 0 ? NULL : heap->metadata + prev - 1;
+}
@@ -4,6 +4,29 @@
  *
  * This file contains the implementation of the function to log messages to a file
  * specified by the environment variable MSM_OUTPUT.
+ *
+ * The file is opened once and the messages of each thread are gathered in a
+ * buffer of the thread, written in one go when it is full, when an error is
+ * logged, when the thread exits, before a fork and at exit. Each write holds
+ * whole messages, so no message is cut by another one, but the output differs
+ * from writing each message on its own in two ways: the messages of several
+ * threads come in batches of each thread rather than in the order of the
+ * calls, and the messages still in a buffer are lost if the process crashes,
+ * only the errors being written right away.
+ *
+ * A thread holds the lock of its buffer while it logs, so that the buffers of
+ * the threads still running are flushed at exit without racing with them.
+ *
+ * With MSM_LOG_ASYNC set, the buffers are appended to a bounded queue instead
+ * of being written, and a writer thread drains the queue to the file, so the
+ * allocating threads never wait for the disk. The messages that do not fit in
+ * the queue are dropped and counted. The writer is started with the log file,
+ * when the library is loaded if MSM_OUTPUT is already set, and never calls the
+ * allocator.
+ *
+ * The calls go through the LOG_* macros of log.h, which skip the messages above
+ * the level compiled in or above MSM_LOG_LEVEL without evaluating their
+ * arguments.
  */
 
 #include "log.h"
@@ -14,12 +37,429 @@
 #include <stdlib.h>
 #include <alloca.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+/**
+ * @brief Struct to define the log buffer of a thread.
+ */
+struct log_buffer
+{
+    char                 data[LOG_BUFFER_SIZE];    ///< Messages not written yet
+    size_t               used;                     ///< Size of the messages not written yet
+    size_t               messages;                 ///< Number of the messages not written yet
+    int                  registered;               ///< Whether the buffer is in the list of the buffers
+    int                  locked;                   ///< Whether the buffer is being filled or flushed
+    struct log_buffer    *prev;                    ///< Previous buffer of the list
+    struct log_buffer    *next;                    ///< Next buffer of the list
+};
+
+int                                my_log_level = LOG_LEVEL_UNREAD; // Read along with MSM_OUTPUT
+static int                         log_state = 0; // 0 until MSM_OUTPUT is read, 1 while the file is opened, 2 once ready
+static const char                  *log_output = NULL; // Path of the log file, read once from MSM_OUTPUT
+static int                         log_fd = -1; // Descriptor of the log file, -1 if it could not be opened
+static pthread_key_t               log_key; // Key flushing the buffer of a thread when it exits
+static pthread_mutex_t             log_lock = PTHREAD_MUTEX_INITIALIZER; // Lock of the list of the buffers
+static struct log_buffer           *log_buffers = NULL; // Buffers of the threads, flushed at exit
+static __thread struct log_buffer  log_buffer; // Buffer of the calling thread
+static __thread int                log_opening = 0; // Whether the calling thread opens the log file
+static __thread int                log_logging = 0; // Whether the calling thread logs a message
+static int                         log_async = 0; // Whether a writer thread writes the messages (MSM_LOG_ASYNC)
+static char                        log_queue[LOG_QUEUE_SIZE]; // Messages waiting for the writer thread
+static size_t                      log_queue_head = 0; // Bytes ever appended to the queue
+static size_t                      log_queue_tail = 0; // Bytes ever written from the queue
+static size_t                      log_dropped = 0; // Messages dropped because the queue was full
+static pthread_mutex_t             log_queue_lock = PTHREAD_MUTEX_INITIALIZER; // Lock of the queue
+static pthread_cond_t              log_queue_cond = PTHREAD_COND_INITIALIZER; // Signaled when the queue gets messages or the writer must stop
+static pthread_t                   log_writer; // Thread writing the queue
+static int                         log_writer_started = 0; // Whether the writer thread was started
+static int                         log_writer_stop = 0; // Whether the writer thread must stop once the queue is empty
+
+/**
+ * @brief Write messages to the log file.
+ *
+ * @param data The messages.
+ * @param size The size of the messages.
+ * @return int 0 on success, -1 on failure.
+ */
+static int my_log_write_file(const char *data, size_t size)
+{
+    size_t    done = 0;
+    while (done < size)
+    {
+        ssize_t    written = write(log_fd, data + done, size - done);
+        if (written <= 0)
+        {
+            return -1;
+        }
+        done += written;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write the messages of the queue, the lock of the queue being held.
+ *
+ * The lock is released while the messages are written, the producers only
+ * append after the head.
+ */
+static void my_log_drain()
+{
+    static size_t    reported = 0; // Dropped messages already reported in the file
+    size_t           tail = log_queue_tail;
+    size_t           head = log_queue_head;
+    size_t           dropped = log_dropped;
+    pthread_mutex_unlock(&log_queue_lock);
+
+    while (tail < head)
+    {
+        size_t    at = tail % LOG_QUEUE_SIZE;
+        size_t    size = head - tail < LOG_QUEUE_SIZE - at ? head - tail : LOG_QUEUE_SIZE - at;
+        my_log_write_file(log_queue + at, size);
+        tail += size;
+    }
+    if (dropped != reported)
+    {
+        char    msg[96];
+        int     size = snprintf(msg, sizeof(msg), "Error: %zu log messages dropped, the queue was full\n", dropped - reported);
+        my_log_write_file(msg, size);
+        reported = dropped;
+    }
+
+    pthread_mutex_lock(&log_queue_lock);
+    log_queue_tail = tail;
+}
+
+/**
+ * @brief Write the queue until it is asked to stop and the queue is empty.
+ *
+ * @param arg Unused.
+ * @return void* NULL.
+ */
+static void* my_log_writer(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&log_queue_lock);
+    while (log_queue_head != log_queue_tail || log_writer_stop == 0)
+    {
+        if (log_queue_head == log_queue_tail)
+        {
+            pthread_cond_wait(&log_queue_cond, &log_queue_lock);
+        }
+        my_log_drain();
+    }
+    pthread_mutex_unlock(&log_queue_lock);
+    return NULL;
+}
+
+/**
+ * @brief Append messages to the queue of the writer thread.
+ *
+ * The messages are dropped when they do not fit in the queue, rather than
+ * waiting for the writer.
+ *
+ * @param data The messages.
+ * @param size The size of the messages.
+ * @param messages The number of the messages.
+ * @return int 0 on success, -1 if the messages were dropped.
+ */
+static int my_log_enqueue(const char *data, size_t size, size_t messages)
+{
+    pthread_mutex_lock(&log_queue_lock);
+    if (log_queue_head - log_queue_tail + size > LOG_QUEUE_SIZE)
+    {
+        log_dropped += messages;
+        pthread_mutex_unlock(&log_queue_lock);
+        return -1;
+    }
+
+    size_t    at = log_queue_head % LOG_QUEUE_SIZE;
+    size_t    first = size < LOG_QUEUE_SIZE - at ? size : LOG_QUEUE_SIZE - at;
+    memcpy(log_queue + at, data, first);
+    memcpy(log_queue, data + first, size - first);
+    log_queue_head += size;
+    pthread_cond_signal(&log_queue_cond);
+    pthread_mutex_unlock(&log_queue_lock);
+    return 0;
+}
+
+/**
+ * @brief Take the lock of a buffer.
+ *
+ * The lock is only contended while the buffers are flushed at exit.
+ *
+ * @param buffer The buffer.
+ */
+static void my_log_lock(struct log_buffer *buffer)
+{
+    while (__atomic_exchange_n(&buffer->locked, 1, __ATOMIC_ACQUIRE) != 0)
+    {
+        sched_yield();
+    }
+}
+
+/**
+ * @brief Release the lock of a buffer.
+ *
+ * @param buffer The buffer.
+ */
+static void my_log_unlock(struct log_buffer *buffer)
+{
+    __atomic_store_n(&buffer->locked, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Write the messages gathered in a buffer, or hand them to the writer thread.
+ *
+ * The lock of the buffer is held by the caller.
+ *
+ * @param buffer The buffer.
+ * @return int 0 on success, -1 on failure.
+ */
+static int my_log_write(struct log_buffer *buffer)
+{
+    int    ret = 0;
+    if (buffer->used > 0)
+    {
+        ret = log_async ? my_log_enqueue(buffer->data, buffer->used, buffer->messages) : my_log_write_file(buffer->data, buffer->used);
+    }
+    buffer->used = 0;
+    buffer->messages = 0;
+    return ret;
+}
+
+/**
+ * @brief Flush the buffer of a thread when it exits and take it out of the list.
+ *
+ * @param arg The buffer.
+ */
+static void my_log_thread_exit(void *arg)
+{
+    struct log_buffer    *buffer = arg;
+    my_log_lock(buffer);
+    my_log_write(buffer);
+    my_log_unlock(buffer);
+
+    pthread_mutex_lock(&log_lock);
+    if (buffer->prev != NULL)
+    {
+        buffer->prev->next = buffer->next;
+    }
+    else
+    {
+        log_buffers = buffer->next;
+    }
+    if (buffer->next != NULL)
+    {
+        buffer->next->prev = buffer->prev;
+    }
+    buffer->registered = 0;
+    pthread_mutex_unlock(&log_lock);
+}
+
+/**
+ * @brief Flush the buffers of every thread at exit.
+ *
+ * The buffers of the threads still running are taken under their lock. The
+ * writer thread is stopped once it wrote the queue, the messages logged after
+ * that are written right away.
+ */
+static void my_log_exit()
+{
+    pthread_mutex_lock(&log_lock);
+    for (struct log_buffer *buffer = log_buffers; buffer != NULL; buffer = buffer->next)
+    {
+        my_log_lock(buffer);
+        my_log_write(buffer);
+        my_log_unlock(buffer);
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    if (log_async)
+    {
+        pthread_mutex_lock(&log_queue_lock);
+        log_writer_stop = 1;
+        pthread_cond_signal(&log_queue_cond);
+        pthread_mutex_unlock(&log_queue_lock);
+        if (log_writer_started)
+        {
+            pthread_join(log_writer, NULL);
+        }
+        log_async = 0;
+    }
+
+    // Write what the writer thread could not, if it failed to start
+    pthread_mutex_lock(&log_queue_lock);
+    my_log_drain();
+    pthread_mutex_unlock(&log_queue_lock);
+}
+
+/**
+ * @brief Flush the buffer of the calling thread before a fork.
+ *
+ * The child would otherwise write again the messages it inherits.
+ */
+static void my_log_fork()
+{
+    my_log_flush();
+}
+
+/**
+ * @brief Reset the log of a forked child.
+ *
+ * The messages of the queue and of the other threads are written by the
+ * parent, so the child drops them, whatever state another thread left the
+ * locks in. The child has no writer thread, it writes its messages itself.
+ */
+static void my_log_fork_child()
+{
+    pthread_mutex_init(&log_queue_lock, NULL);
+    pthread_cond_init(&log_queue_cond, NULL);
+    pthread_mutex_init(&log_lock, NULL);
+    log_queue_tail = log_queue_head;
+    log_writer_started = 0;
+    log_async = 0;
+    log_buffers = log_buffer.registered ? &log_buffer : NULL;
+    log_buffer.locked = 0;
+    log_buffer.prev = NULL;
+    log_buffer.next = NULL;
+}
+
+/**
+ * @brief Read the most verbose level logged.
+ *
+ * @param str The value of MSM_LOG_LEVEL: error, warn, info, trace or a level from 0 to 4.
+ * @return int The level, LOG_LEVEL_TRACE if the value is not set or invalid.
+ */
+static int my_log_parse_level(const char *str)
+{
+    const char    *names[] = {"none", "error", "warn", "info", "trace"};
+    if (str == NULL)
+    {
+        return LOG_LEVEL_TRACE;
+    }
+    for (int level = LOG_LEVEL_NONE; level <= LOG_LEVEL_TRACE; level++)
+    {
+        if (strcmp(str, names[level]) == 0 || (str[0] == '0' + level && str[1] == '\0'))
+        {
+            return level;
+        }
+    }
+    return LOG_LEVEL_TRACE;
+}
+
+/**
+ * @brief Open the log file the first time a message is logged.
+ *
+ * The handlers are registered and the writer thread is started once the file
+ * is ready, so that a message logged by an allocation they make goes through.
+ * The other threads wait until the file is opened.
+ */
+static void my_log_open()
+{
+    int    expected = 0;
+    if (__atomic_compare_exchange_n(&log_state, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        log_opening = 1;
+        log_output = getenv("MSM_OUTPUT");
+        if (log_output != NULL)
+        {
+            log_fd = open(log_output, O_CREAT | O_APPEND | O_WRONLY | O_CLOEXEC, 0600); // 600 - rw for owner
+        }
+        my_log_level = log_output == NULL ? LOG_LEVEL_NONE : my_log_parse_level(getenv("MSM_LOG_LEVEL"));
+        log_async = getenv("MSM_LOG_ASYNC") != NULL && strcmp(getenv("MSM_LOG_ASYNC"), "0") != 0;
+        __atomic_store_n(&log_state, 2, __ATOMIC_RELEASE);
+
+        if (log_fd != -1)
+        {
+            pthread_key_create(&log_key, my_log_thread_exit);
+            pthread_atfork(my_log_fork, NULL, my_log_fork_child);
+            atexit(my_log_exit);
+            if (log_async)
+            {
+                // Write the messages of the calling threads if the writer cannot start
+                log_writer_started = pthread_create(&log_writer, NULL, my_log_writer, NULL) == 0;
+                log_async = log_writer_started;
+            }
+        }
+        log_opening = 0;
+        return;
+    }
+
+    while (__atomic_load_n(&log_state, __ATOMIC_ACQUIRE) != 2 && log_opening == 0)
+    {
+        sched_yield();
+    }
+}
+
+/**
+ * @brief Open the log file when the library is loaded if MSM_OUTPUT is set.
+ *
+ * The writer thread is then started before any allocation, rather than by
+ * the first message, which may be logged in the middle of one. Otherwise
+ * MSM_OUTPUT is still read by the first message.
+ */
+__attribute__((constructor))
+static void my_log_load()
+{
+    if (getenv("MSM_OUTPUT") != NULL)
+    {
+        my_log_init();
+    }
+}
+
+/**
+ * @brief Read the log file and level from the environment.
+ *
+ * This function is called by the LOG_* macros until the level is read.
+ *
+ * @return int The most verbose level logged.
+ */
+int my_log_init()
+{
+    if (__atomic_load_n(&log_state, __ATOMIC_ACQUIRE) != 2)
+    {
+        my_log_open();
+    }
+    return my_log_level;
+}
+
+/**
+ * @brief Write the messages gathered by the calling thread.
+ *
+ * @return int 0 on success, or -1 on failure.
+ */
+int my_log_flush()
+{
+    if (log_buffer.used == 0 || log_fd == -1 || log_logging != 0)
+    {
+        return 0;
+    }
+    my_log_lock(&log_buffer);
+    int    ret = my_log_write(&log_buffer);
+    my_log_unlock(&log_buffer);
+    return ret;
+}
+
+/**
+ * @brief Get the number of messages dropped because the queue of the writer thread was full.
+ *
+ * @return size_t The number of messages dropped.
+ */
+size_t my_log_dropped()
+{
+    pthread_mutex_lock(&log_queue_lock);
+    size_t    dropped = log_dropped;
+    pthread_mutex_unlock(&log_queue_lock);
+    return dropped;
+}
 
 /**
  * @brief Logs a formatted message to a file.
  *
  * This function logs a formatted message to the file specified by the MSM_OUTPUT
- * environment variable. If the environment variable is not set, the function does nothing.
+ * environment variable, read the first time a message is logged. If the environment
+ * variable is not set, the function does nothing.
  *
  * @param format The format string (printf-like).
  * @param ... Additional arguments for the format string.
@@ -28,33 +468,75 @@
 int my_log_message(const char *format, ...)
 {
 	// Check if the environment variable MSM_OUTPUT is set
-	if (getenv("MSM_OUTPUT") == NULL)
+	if (__atomic_load_n(&log_state, __ATOMIC_ACQUIRE) != 2)
+		my_log_open();
+	if (log_output == NULL)
 		return 0;
+    if (log_fd == -1)
+        return -1;
+    // A message logged while the thread logs, by an allocation of vsnprintf, is dropped
+    if (log_logging != 0)
+        return 0;
+
+    // Register the buffer of the thread so that it is flushed when the thread exits
+    if (log_buffer.registered == 0)
+    {
+        log_buffer.registered = 1;
+        pthread_setspecific(log_key, &log_buffer);
+        pthread_mutex_lock(&log_lock);
+        log_buffer.prev = NULL;
+        log_buffer.next = log_buffers;
+        if (log_buffers != NULL)
+        {
+            log_buffers->prev = &log_buffer;
+        }
+        log_buffers = &log_buffer;
+        pthread_mutex_unlock(&log_lock);
+    }
 
+    log_logging = 1;
+    my_log_lock(&log_buffer);
     va_list args, args_copy;
     va_start(args, format);
 
-    // Determine the required buffer size for the formatted string
+    // Format the message at the end of the buffer
     va_copy(args_copy, args);
-    size_t    size = vsnprintf(NULL, 0, format, args_copy) + 1; // +1 for the null terminator
+    size_t    room = LOG_BUFFER_SIZE - log_buffer.used;
+    size_t    size = vsnprintf(log_buffer.data + log_buffer.used, room, format, args_copy);
     va_end(args_copy);
 
-    // Allocate buffer on the stack
-    char    *buffer = (char *)alloca(size);
-
-    // Write formatted data to the buffer
-    vsnprintf(buffer, size, format, args);
+    int    ret = 0;
+    if (size < room)
+    {
+        log_buffer.used += size;
+        log_buffer.messages++;
+    }
+    else
+    {
+        // The message does not fit, write what is gathered then format it again
+        ret = my_log_write(&log_buffer);
+        if (size < LOG_BUFFER_SIZE)
+        {
+            vsnprintf(log_buffer.data, LOG_BUFFER_SIZE, format, args);
+            log_buffer.used = size;
+            log_buffer.messages = 1;
+        }
+        else
+        {
+            // Allocate buffer on the stack
+            char    *buffer = (char *)alloca(size + 1);
+            vsnprintf(buffer, size + 1, format, args);
+            ret = (log_async ? my_log_enqueue(buffer, size, 1) : my_log_write_file(buffer, size)) == -1 ? -1 : ret;
+        }
+    }
     va_end(args);
 
-    // Open log file with appropriate flags and permissions
-	int    fd = open(getenv("MSM_OUTPUT"), O_CREAT | O_APPEND | O_WRONLY, 0600); // 600 - rw for owner
-    if (fd == -1) {
-        return -1;
+    // Errors are written right away, in case the program stops soon after
+    if (strncmp(format, "Error", 5) == 0 && my_log_write(&log_buffer) == -1)
+    {
+        ret = -1;
     }
-
-    // Write log message to log file
-    int    ret = write(fd, buffer, strlen(buffer));
-    close(fd);
-
-    return ret == -1 ? -1 : 0;
+    my_log_unlock(&log_buffer);
+    log_logging = 0;
+    return ret;
 }
@@ -0,0 +1,352 @@
+/**
+ * @file numa.c
+ * @brief Implementation of the NUMA-aware heaps.
+ *
+ * This file contains the implementation of one private heap per NUMA node,
+ * whose data segments and metadata are bound to the node with mbind. When the
+ * heaps of the nodes are used, my_malloc() allocates from the heap of the node
+ * the calling thread currently runs on, as read by getcpu, and my_free() gives
+ * the block back to the heap owning it. On single-node systems allocations
+ * simply go to the default heap.
+ */
+
+#define _GNU_SOURCE
+#include "secmalloc.h"
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "log.h"
+
+static struct secmalloc_heap    *numa_heaps[NUMA_MAX_NODES]; // Heap of each node, created on first use
+static pthread_mutex_t          numa_lock = PTHREAD_MUTEX_INITIALIZER; // Lock of the heap table
+static int                      numa_nodes = 0; // Number of nodes, 0 until read
+
+/**
+ * @brief Get the number of NUMA nodes.
+ *
+ * The nodes are read from /sys/devices/system/node/online the first time
+ * this function is called. Setting MSM_NUMA to 1 uses the heaps of the nodes
+ * even on single-node systems, setting it to 0 never uses them.
+ *
+ * @return int The number of nodes the heaps are spread on, 1 when they are not used.
+ */
+int secmalloc_numa_nodes()
+{
+    int    nodes = __atomic_load_n(&numa_nodes, __ATOMIC_ACQUIRE);
+    if (nodes != 0)
+    {
+        return nodes;
+    }
+
+    pthread_mutex_lock(&numa_lock);
+    if (numa_nodes == 0)
+    {
+        int       nodes = 1;
+        char      buf[128] = {0};
+        int       fd = open("/sys/devices/system/node/online", O_RDONLY);
+        if (fd != -1)
+        {
+            if (read(fd, buf, sizeof(buf) - 1) > 0)
+            {
+                // The last node of a list such as "0-1,3" is the highest one
+                char    *last = buf;
+                for (char *c = buf; *c != '\0'; c++)
+                {
+                    if (*c == '-' || *c == ',')
+                    {
+                        last = c + 1;
+                    }
+                }
+                nodes = atoi(last) + 1;
+            }
+            close(fd);
+        }
+        if (nodes > NUMA_MAX_NODES)
+        {
+            nodes = NUMA_MAX_NODES;
+        }
+
+        size_t    mode = my_config()->numa == NUMA_AUTO ? nodes > 1 : my_config()->numa;
+        __atomic_store_n(&numa_heaps[0], mode == 0 ? &secmalloc_default_heap : NULL, __ATOMIC_RELEASE);
+        __atomic_store_n(&numa_nodes, mode == 0 ? 1 : nodes, __ATOMIC_RELEASE);
+        LOG_INFO("numa : %d nodes, heaps of the nodes %s\n", nodes, mode == 0 ? "disabled" : "enabled");
+    }
+    pthread_mutex_unlock(&numa_lock);
+    return numa_nodes;
+}
+
+/**
+ * @brief Get the NUMA node the calling thread runs on.
+ *
+ * @return int The node, 0 if it is unknown.
+ */
+int secmalloc_numa_node()
+{
+    unsigned int    cpu;
+    unsigned int    node;
+    if (getcpu(&cpu, &node) == -1 || (int)node >= secmalloc_numa_nodes())
+    {
+        return 0;
+    }
+    return node;
+}
+
+/**
+ * @brief Bind a range to a NUMA node.
+ *
+ * The node is preferred rather than enforced, so that the allocations still
+ * succeed when the node is full. The pages already faulted in are moved.
+ *
+ * @param addr The start of the range.
+ * @param size The size of the range.
+ * @param node The node.
+ * @return int 0 on success, -1 on failure.
+ */
+int my_numa_bind(void *addr, size_t size, int node)
+{
+    unsigned long    mask = 1UL << node;
+    if (syscall(SYS_mbind, addr, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, MPOL_MF_MOVE) == -1)
+    {
+        perror("mbind");
+        LOG_WARN("Error: Failed to bind %p to node %d.\n", addr, node);
+        return -1;
+    }
+    LOG_INFO("bound %zu bytes at %p to node %d\n", size, addr, node);
+    return 0;
+}
+
+/**
+ * @brief Get the heap of a NUMA node.
+ *
+ * This function creates the heap of the node on first use, and binds its
+ * data, its metadata and the arrays along the metadata to the node. The next
+ * data segments are bound as they are added.
+ *
+ * @param node The node.
+ * @return struct secmalloc_heap* A pointer to the heap, or NULL if the creation fails.
+ */
+static struct secmalloc_heap* my_numa_heap(int node)
+{
+    struct secmalloc_heap    *heap = __atomic_load_n(&numa_heaps[node], __ATOMIC_ACQUIRE);
+    if (heap != NULL)
+    {
+        return heap;
+    }
+
+    pthread_mutex_lock(&numa_lock);
+    heap = numa_heaps[node];
+    if (heap == NULL)
+    {
+        heap = secmalloc_heap_create();
+        if (heap != NULL)
+        {
+            heap->node = node;
+            for (size_t i = 0; i < heap->nsegments; i++)
+            {
+                my_numa_bind(heap->segments[i].base, heap->segments[i].reserved, node);
+            }
+            my_numa_bind(heap->metadata, MAX_METADATA_SIZE, node);
+            my_numa_bind(heap->fit_sizes, FIT_SIZES_SIZE, node);
+            my_numa_bind(heap->fit_nodes, FIT_NODES_SIZE, node);
+            my_numa_bind(heap->cold, COLD_SIZE, node);
+            __atomic_store_n(&numa_heaps[node], heap, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&numa_lock);
+    return heap;
+}
+
+/**
+ * @brief Get the heap of the NUMA node the calling thread runs on.
+ *
+ * @return struct secmalloc_heap* A pointer to the heap, or NULL when the heaps of the nodes are not used or the creation fails.
+ */
+struct secmalloc_heap* my_numa_local_heap()
+{
+    if (secmalloc_numa_nodes() == 1 && __atomic_load_n(&numa_heaps[0], __ATOMIC_ACQUIRE) == &secmalloc_default_heap)
+    {
+        return NULL;
+    }
+    return my_numa_heap(secmalloc_numa_node());
+}
+
+/**
+ * @brief Check whether an address lies in the ranges reserved by a heap.
+ *
+ * The ranges of the segments and of the buddy zone never move once reserved
+ * and are published with release stores, so they are read without the lock.
+ *
+ * @param heap The heap.
+ * @param ptr The address.
+ * @return int 1 if the address is in a range of the heap, 0 otherwise.
+ */
+static int my_numa_reserved(struct secmalloc_heap *heap, void *ptr)
+{
+    size_t    nsegments = __atomic_load_n(&heap->nsegments, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < nsegments; i++)
+    {
+        struct heap_segment    *segment = &heap->segments[i];
+        if ((char*)ptr >= (char*)segment->base && (char*)ptr < (char*)segment->base + segment->reserved)
+        {
+            return 1;
+        }
+    }
+
+    struct buddy_zone    *zone = __atomic_load_n(&heap->buddy, __ATOMIC_ACQUIRE);
+    return zone != NULL && (char*)ptr >= zone->base && (char*)ptr < zone->base + (size_t)BUDDY_BLOCKS * BUDDY_BLOCK_SIZE;
+}
+
+/**
+ * @brief Get the heap of a NUMA node owning a block.
+ *
+ * The heaps are told apart by their reserved ranges, no lock is taken.
+ *
+ * @param ptr A pointer to the block.
+ * @return struct secmalloc_heap* A pointer to the heap, or NULL if the block is not in the heap of a node.
+ */
+struct secmalloc_heap* my_numa_owner(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return NULL;
+    }
+
+    int    nodes = secmalloc_numa_nodes();
+    for (int node = 0; node < nodes; node++)
+    {
+        struct secmalloc_heap    *heap = __atomic_load_n(&numa_heaps[node], __ATOMIC_ACQUIRE);
+        if (heap != NULL && heap != &secmalloc_default_heap && my_numa_reserved(heap, ptr))
+        {
+            return heap;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reallocate a block of the heap of a NUMA node.
+ *
+ * The block is moved to a new block allocated by my_malloc(), i.e. on the
+ * node the calling thread runs on.
+ *
+ * @param heap The heap owning the block.
+ * @param ptr A pointer to the memory block to reallocate.
+ * @param size The new size of the memory block.
+ * @return void* A pointer to the reallocated memory, or NULL if the reallocation fails.
+ */
+void* my_numa_realloc(struct secmalloc_heap *heap, void *ptr, size_t size)
+{
+    size_t                  old_size = 0;
+    struct chunkmetadata    *item;
+
+    pthread_mutex_lock(&heap->lock);
+    if (my_buddy_owns(heap, ptr))
+    {
+        old_size = my_buddy_size(heap, ptr);
+    }
+    else if (my_shadow_classify(heap, ptr, &item) == SHADOW_BUSY)
+    {
+        // The block is checked before its data is copied, as the realloc of the default heap does
+        if (my_config()->canary && my_heap_verify_canary(heap, item) == -1)
+        {
+            LOG_ERROR("Error: Canary verification failed : Buffer overflow detected\n");
+        }
+        old_size = item->size;
+    }
+    pthread_mutex_unlock(&heap->lock);
+    if (old_size == 0)
+    {
+        LOG_ERROR("Error : invalid pointer to realloc : not in the heap\n");
+        return NULL;
+    }
+
+    if (size == 0)
+    {
+        secmalloc_heap_free(heap, ptr);
+        return NULL;
+    }
+    void    *new_ptr = my_malloc(size);
+    if (new_ptr == NULL)
+    {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    secmalloc_heap_free(heap, ptr);
+    return new_ptr;
+}
+
+/**
+ * @brief Release the blocks held in the quarantines of the heaps of the NUMA nodes.
+ */
+void my_numa_quarantine_flush()
+{
+    int    nodes = secmalloc_numa_nodes();
+    for (int node = 0; node < nodes; node++)
+    {
+        struct secmalloc_heap    *heap = __atomic_load_n(&numa_heaps[node], __ATOMIC_ACQUIRE);
+        if (heap != NULL && heap != &secmalloc_default_heap)
+        {
+            pthread_mutex_lock(&heap->lock);
+            my_heap_quarantine_flush(heap);
+            pthread_mutex_unlock(&heap->lock);
+        }
+    }
+}
+
+/**
+ * @brief Allocate memory on the NUMA node of the calling thread.
+ *
+ * my_malloc() routes the allocations the same way, this function is kept
+ * for the callers that state the intent.
+ *
+ * @param size The size of the memory block to allocate.
+ * @return void* A pointer to the allocated memory, or NULL if the allocation fails.
+ */
+void* secmalloc_numa_alloc(size_t size)
+{
+    LOG_TRACE("\n\nCALL NUMA ALLOC size %zu\n", size);
+    return my_malloc(size);
+}
+
+/**
+ * @brief Free memory allocated by secmalloc_numa_alloc().
+ *
+ * The block may be freed from any node, my_free() gives it back to the heap
+ * owning it.
+ *
+ * @param ptr A pointer to the memory block to free.
+ */
+void secmalloc_numa_free(void *ptr)
+{
+    my_free(ptr);
+}
+
+/**
+ * @brief Get the statistics of the heap of a NUMA node.
+ *
+ * @param node The node.
+ * @param stats The structure filled with the statistics, zeroed if the node has no heap yet.
+ * @return int 0 on success, -1 if the node does not exist.
+ */
+int secmalloc_numa_stats(int node, struct secmalloc_stats *stats)
+{
+    if (node < 0 || node >= secmalloc_numa_nodes())
+    {
+        LOG_ERROR("Error: Invalid NUMA node %d\n", node);
+        return -1;
+    }
+
+    struct secmalloc_heap    *heap = __atomic_load_n(&numa_heaps[node], __ATOMIC_ACQUIRE);
+    if (heap == NULL)
+    {
+        *stats = (struct secmalloc_stats){0};
+        return 0;
+    }
+    secmalloc_heap_stats(heap, stats);
+    return 0;
+}
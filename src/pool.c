@@ -0,0 +1,318 @@
+/**
+ * @file pool.c
+ * @brief Implementation of fixed-size object pools.
+ *
+ * This file contains the implementation of pools handing out objects of a
+ * single size. Objects live in dedicated slabs committed one after the other
+ * in a range reserved for the pool, free objects are chained in an intrusive
+ * free list, each object is followed by a canary and a per-slab bitmap
+ * records which objects are allocated. A freed pointer is checked against the
+ * bounds of the committed slabs, so that invalid and double frees are detected
+ * in constant time.
+ */
+
+#include "secmalloc.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "log.h"
+
+#define BITS_PER_LONG    (8 * sizeof(unsigned long))
+
+/**
+ * @brief Reserve the range of the slabs of a pool.
+ *
+ * This function reserves twice the range and trims it so that the range, and
+ * therefore each slab, is aligned on the slab size.
+ *
+ * @param pool The pool, its slab size set.
+ * @return int 0 on success, -1 if the mapping fails.
+ */
+static int my_pool_reserve(struct secmalloc_pool *pool)
+{
+    size_t    size = POOL_RESERVED_SIZE / pool->slab_size * pool->slab_size;
+    char      *map = mmap(NULL, size + pool->slab_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        LOG_ERROR("Error: Failed to reserve memory for pool slabs.\n");
+        return -1;
+    }
+    char    *aligned = (char*)(((size_t)map + pool->slab_size - 1) & ~(pool->slab_size - 1));
+    if (aligned > map)
+    {
+        munmap(map, aligned - map);
+    }
+    munmap(aligned + size, map + pool->slab_size - aligned);
+
+    pool->base = aligned;
+    pool->nslabs = 0;
+    pool->max_slabs = size / pool->slab_size;
+    return 0;
+}
+
+/**
+ * @brief Commit a new slab for a pool.
+ *
+ * This function commits the slab following the last one in the range of the
+ * pool and pushes all its objects on the free list of the pool.
+ *
+ * @param pool The pool.
+ * @return struct pool_slab* A pointer to the new slab, or NULL if the range is full or the commit fails.
+ */
+static struct pool_slab* my_pool_new_slab(struct secmalloc_pool *pool)
+{
+    LOG_TRACE("call pool_new_slab\n");
+
+    if (pool->nslabs == pool->max_slabs)
+    {
+        LOG_ERROR("Error: Pool full, %zu slabs committed.\n", pool->nslabs);
+        return NULL;
+    }
+    char    *aligned = pool->base + pool->nslabs * pool->slab_size;
+    if (mprotect(aligned, pool->slab_size, PROT_READ | PROT_WRITE) == -1)
+    {
+        perror("mprotect");
+        LOG_ERROR("Error: Failed to commit memory for pool slab.\n");
+        return NULL;
+    }
+    pool->nslabs++;
+
+    // Latency-critical pools take the page faults now rather than on first touch
+    if (my_growth_policy()->populate)
+    {
+        my_populate(aligned, pool->slab_size);
+    }
+
+    struct pool_slab    *slab = (struct pool_slab*)aligned;
+    slab->pool = pool;
+    slab->used = 0;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    // Push the objects in reverse order so that they are handed out in address order
+    for (size_t i = pool->objects_per_slab; i > 0; i--)
+    {
+        char    *obj = aligned + pool->objects_offset + (i - 1) * pool->stride;
+        *(void**)obj = (void*)((long)pool->free_list ^ pool->canary);
+        pool->free_list = obj;
+    }
+
+    LOG_TRACE("return slab %p\n", slab);
+    return slab;
+}
+
+/**
+ * @brief Create a fixed-size object pool.
+ *
+ * @param obj_size The size of the objects.
+ * @param align The alignment of the objects, a power of two, or 0 for sizeof(long).
+ * @return struct secmalloc_pool* A pointer to the new pool, or NULL if the creation fails.
+ */
+struct secmalloc_pool* secmalloc_pool_create(size_t obj_size, size_t align)
+{
+    LOG_TRACE("\n\nCALL POOL CREATE obj_size %zu align %zu\n", obj_size, align);
+
+    if (align == 0)
+    {
+        align = sizeof(long);
+    }
+    if (obj_size == 0 || (align & (align - 1)) != 0 || align > PAGE_HEAP_SIZE || obj_size > POOL_SLAB_SIZE)
+    {
+        LOG_ERROR("Error: Invalid pool object size %zu or alignment %zu\n", obj_size, align);
+        return NULL;
+    }
+
+    struct secmalloc_pool    *pool = my_malloc(sizeof(struct secmalloc_pool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+
+    // A free object holds the link of the free list
+    size_t    slot = obj_size < sizeof(void*) ? sizeof(void*) : obj_size;
+    pool->stride = (slot + sizeof(long) + align - 1) & ~(align - 1);
+    pool->obj_size = obj_size;
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->canary = my_generate_canary();
+
+    // Find the smallest slab holding enough objects along with its header and bitmap
+    pool->slab_size = POOL_SLAB_SIZE;
+    while (1)
+    {
+        size_t    count = (pool->slab_size - sizeof(struct pool_slab)) / pool->stride;
+        size_t    header = sizeof(struct pool_slab) + (count + BITS_PER_LONG - 1) / BITS_PER_LONG * sizeof(unsigned long);
+        pool->objects_offset = (header + align - 1) & ~(align - 1);
+        pool->objects_per_slab = (pool->slab_size - pool->objects_offset) / pool->stride;
+        if (pool->objects_per_slab >= POOL_MIN_OBJECTS)
+        {
+            break;
+        }
+        pool->slab_size *= 2;
+    }
+
+    if (pool->canary == -1 || my_pool_reserve(pool) == -1)
+    {
+        my_free(pool);
+        return NULL;
+    }
+
+    LOG_TRACE("RETURN POOL CREATE : %p stride %zu, %zu objects per slab\n", pool, pool->stride, pool->objects_per_slab);
+    return pool;
+}
+
+/**
+ * @brief Allocate an object from a pool.
+ *
+ * @param pool The pool to allocate from.
+ * @return void* A pointer to the allocated object, or NULL if the allocation fails.
+ */
+void* secmalloc_pool_alloc(struct secmalloc_pool *pool)
+{
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+
+    if (pool->free_list == NULL && my_pool_new_slab(pool) == NULL)
+    {
+        return NULL;
+    }
+
+    // Pop the first free object
+    char                *obj = pool->free_list;
+    struct pool_slab    *slab = (struct pool_slab*)((size_t)obj & ~(pool->slab_size - 1));
+    size_t              index = (obj - (char*)slab - pool->objects_offset) / pool->stride;
+    pool->free_list = (void*)((long)*(void**)obj ^ pool->canary);
+    *(void**)obj = NULL;
+
+    slab->bitmap[index / BITS_PER_LONG] |= 1UL << (index % BITS_PER_LONG);
+    slab->used++;
+    *(long*)(obj + pool->obj_size) = pool->canary ^ (long)obj;
+
+    return obj;
+}
+
+/**
+ * @brief Free an object of a pool.
+ *
+ * This function checks that the pointer is the start of an allocated object
+ * of the pool, verifies its canary and cleans it before putting it back in the
+ * free list.
+ *
+ * @param pool The pool owning the object.
+ * @param ptr A pointer to the object to free.
+ */
+void secmalloc_pool_free(struct secmalloc_pool *pool, void *ptr)
+{
+    if (pool == NULL || ptr == NULL)
+    {
+        LOG_ERROR("Error: Invalid pointer to free from pool: NULL\n");
+        return;
+    }
+
+    // Verify if ptr is the start of an object of one of our slabs, they all lie in the committed part of the range
+    if ((char*)ptr < pool->base || (char*)ptr >= pool->base + pool->nslabs * pool->slab_size)
+    {
+        LOG_ERROR("Error: Invalid pointer to free: not in the pool\n");
+        return;
+    }
+    struct pool_slab    *slab = (struct pool_slab*)((size_t)ptr & ~(pool->slab_size - 1));
+    size_t              offset = (char*)ptr - (char*)slab;
+    if (offset < pool->objects_offset || (offset - pool->objects_offset) % pool->stride != 0)
+    {
+        LOG_ERROR("Error: Invalid pointer to free: not in the pool\n");
+        return;
+    }
+    size_t    index = (offset - pool->objects_offset) / pool->stride;
+    if (index >= pool->objects_per_slab)
+    {
+        LOG_ERROR("Error: Invalid pointer to free: not in the pool\n");
+        return;
+    }
+
+    // If the object is already free, log an error and return
+    unsigned long    bit = 1UL << (index % BITS_PER_LONG);
+    if ((slab->bitmap[index / BITS_PER_LONG] & bit) == 0)
+    {
+        LOG_ERROR("Error: Double free\n");
+        return;
+    }
+
+    if (*(long*)((char*)ptr + pool->obj_size) != (pool->canary ^ (long)ptr))
+    {
+        LOG_ERROR("Error: Canary verification failed : Buffer overflow detected\n");
+    }
+
+    // Clean the object and its canary, then push it on the free list
+    memset(ptr, 0, pool->obj_size + sizeof(long));
+    slab->bitmap[index / BITS_PER_LONG] &= ~bit;
+    slab->used--;
+    *(void**)ptr = (void*)((long)pool->free_list ^ pool->canary);
+    pool->free_list = ptr;
+}
+
+/**
+ * @brief Prepare a pool for a latency-critical phase.
+ *
+ * This function maps and faults in slabs until the pool holds at least the
+ * specified number of free objects, so that the next allocations neither map
+ * a slab nor take a page fault.
+ *
+ * @param pool The pool to prepare.
+ * @param count The number of free objects needed.
+ * @return int 0 on success, -1 on failure.
+ */
+int secmalloc_pool_prewarm(struct secmalloc_pool *pool, size_t count)
+{
+    LOG_TRACE("\n\nCALL POOL PREWARM %p count %zu\n", pool, count);
+
+    if (pool == NULL)
+    {
+        LOG_ERROR("Error: Invalid pool to prewarm: NULL\n");
+        return -1;
+    }
+
+    // Fault in the slabs already mapped, then map the missing ones
+    size_t    available = 0;
+    for (struct pool_slab *slab = pool->slabs; slab != NULL; slab = slab->next)
+    {
+        available += pool->objects_per_slab - slab->used;
+        my_populate(slab, pool->slab_size);
+    }
+    while (available < count)
+    {
+        struct pool_slab    *slab = my_pool_new_slab(pool);
+        if (slab == NULL)
+        {
+            return -1;
+        }
+        my_populate(slab, pool->slab_size);
+        available += pool->objects_per_slab;
+    }
+
+    LOG_TRACE("RETURN POOL PREWARM : %zu objects available\n", available);
+    return 0;
+}
+
+/**
+ * @brief Destroy a pool.
+ *
+ * @param pool The pool to destroy.
+ */
+void secmalloc_pool_destroy(struct secmalloc_pool *pool)
+{
+    LOG_TRACE("\n\nCALL POOL DESTROY %p\n", pool);
+
+    if (pool == NULL)
+    {
+        LOG_ERROR("Error: Invalid pool to destroy: NULL\n");
+        return;
+    }
+
+    munmap(pool->base, pool->max_slabs * pool->slab_size);
+    my_free(pool);
+
+    LOG_TRACE("RETURN POOL DESTROY\n");
+}
@@ -0,0 +1,271 @@
+/**
+ * @file purge.c
+ * @brief Implementation of the decay-based purge of the free pages.
+ *
+ * This file contains the implementation of the purge giving back to the OS the
+ * pages of the free chunks that stayed free for the decay time. The purge runs
+ * opportunistically on free, or in a background thread for the default heap.
+ * Built with TLSF=1, the free never purges, so that its time stays bounded,
+ * and the pages are purged by the thread or by secmalloc_purge().
+ * The thread is started when the library is loaded or by secmalloc_mallopt(),
+ * never by an allocation, so that it is not created under the heap lock.
+ */
+
+#define _GNU_SOURCE
+#include "secmalloc.h"
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+struct purge_policy    purge_policy = {
+    .initialized = 0, // Read from the environment on first use
+    .decay = PURGE_DECAY, // Time before free pages are purged
+    .lazy = 0, // Pages are dropped right away by default
+    .thread = 0, // Purge on free by default
+};
+
+static int                purge_thread_started = 0; // Whether the background purge thread is running
+static pthread_mutex_t    purge_lock = PTHREAD_MUTEX_INITIALIZER; // Lock of the start of the thread
+
+/**
+ * @brief Get the purge policy of the heaps.
+ *
+ * The policy is read from the MSM_PURGE_DECAY, MSM_PURGE_LAZY and
+ * MSM_PURGE_THREAD environment variables along with the other tunables.
+ *
+ * @return struct purge_policy* A pointer to the purge policy.
+ */
+struct purge_policy* my_purge_policy()
+{
+    if (purge_policy.initialized == 0)
+    {
+        my_config();
+        purge_policy.initialized = 1;
+        LOG_INFO("purge policy : decay %zu ms, lazy %d, thread %d\n", purge_policy.decay, purge_policy.lazy, purge_policy.thread);
+    }
+    return &purge_policy;
+}
+
+/**
+ * @brief Get a monotonic time in milliseconds.
+ *
+ * @return long The time in milliseconds, always greater than 0.
+ */
+long my_now_ms()
+{
+    struct timespec    ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1;
+}
+
+/**
+ * @brief Get the whole pages inside a chunk.
+ *
+ * With huge pages, only the whole huge pages are taken so that purging never
+ * splits a huge page.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The chunk.
+ * @param start Filled with the first page inside the chunk.
+ * @param end Filled with the end of the last page inside the chunk.
+ * @return size_t The size of the pages inside the chunk, 0 if there is none.
+ */
+static size_t my_chunk_pages(struct secmalloc_heap *heap, struct chunkmetadata *item, size_t *start, size_t *end)
+{
+    size_t    granule = my_page_granule();
+    *start = ((size_t)CHUNK_ADDR(heap, item) + granule - 1) & ~(granule - 1);
+    *end = ((size_t)CHUNK_ADDR(heap, item) + item->size) & ~(granule - 1);
+    return *end > *start ? *end - *start : 0;
+}
+
+/**
+ * @brief Give back to the OS the pages of the free chunks of a heap.
+ *
+ * Only the pages lying entirely inside a free chunk are purged, the pages
+ * shared with a busy neighbour are kept.
+ *
+ * @param heap The heap.
+ * @param age The minimal time in milliseconds the chunks must have been free.
+ * @return size_t The number of bytes purged.
+ */
+size_t my_heap_purge(struct secmalloc_heap *heap, size_t age)
+{
+    LOG_TRACE("call heap_purge for age %zu\n", age);
+
+    size_t    purged = 0;
+    long      now = my_now_ms();
+    int       advice = my_purge_policy()->lazy ? MADV_FREE : MADV_DONTNEED;
+
+    for (struct chunkmetadata *item = heap->metadata; item != NULL; item = CHUNK_NEXT(heap, item))
+    {
+        // Only the chunks dirtied by a free long enough ago are purged
+        if (item->flags != FREE || item->state != CHUNK_USED || (size_t)(now - CHUNK_COLD(heap, item)->freed_at) < age)
+        {
+            continue;
+        }
+
+        size_t    start;
+        size_t    end;
+        size_t    size = my_chunk_pages(heap, item, &start, &end);
+        if (size > 0)
+        {
+            if (madvise((void*)start, size, advice) == -1)
+            {
+                perror("madvise");
+                LOG_ERROR("Error: Failed to purge %zu bytes at %p\n", size, (void*)start);
+                continue;
+            }
+            purged += size;
+        }
+        item->state = CHUNK_PURGED;
+    }
+
+    heap->purged_bytes += purged;
+    heap->last_purge = now;
+    LOG_TRACE("return purged %zu bytes\n", purged);
+    return purged;
+}
+
+/**
+ * @brief Count the purged pages an allocation will fault again.
+ *
+ * @param heap The heap owning the chunk.
+ * @param bloc The purged chunk the allocation is taken from.
+ * @param size The size of the allocation.
+ * @return size_t The number of pages.
+ */
+size_t my_purged_pages(struct secmalloc_heap *heap, struct chunkmetadata *bloc, size_t size)
+{
+    size_t    start;
+    size_t    end;
+    if (my_chunk_pages(heap, bloc, &start, &end) == 0)
+    {
+        return 0;
+    }
+
+    // The allocation and its canary touch every page up to their end
+    size_t    granule = my_page_granule();
+    size_t    used = ((size_t)CHUNK_ADDR(heap, bloc) + size + sizeof(long) + granule - 1) & ~(granule - 1);
+    if (used < end)
+    {
+        end = used;
+    }
+    return end > start ? (end - start) / PAGE_HEAP_SIZE : 0;
+}
+
+/**
+ * @brief Body of the background purge thread of the default heap.
+ *
+ * @param arg Unused.
+ * @return void* Never returns.
+ */
+static void* my_purge_thread(void *arg)
+{
+    (void)arg;
+
+    while (1)
+    {
+        // The policy is read by the first allocation, the thread does not read the environment before it
+        size_t    decay = __atomic_load_n(&purge_policy.decay, __ATOMIC_RELAXED);
+        usleep((decay / 2 > 0 ? decay / 2 : 1) * 1000);
+        pthread_mutex_lock(&secmalloc_default_heap.lock);
+        if (secmalloc_default_heap.metadata != NULL && my_purge_policy()->thread)
+        {
+            my_heap_purge(&secmalloc_default_heap, my_purge_policy()->decay);
+        }
+        pthread_mutex_unlock(&secmalloc_default_heap.lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start the background purge thread of the default heap.
+ *
+ * The thread is started once, later calls do nothing.
+ *
+ * @return int 0 on success, -1 if the thread can not be started.
+ */
+int my_purge_start()
+{
+    int    ret = 0;
+
+    pthread_mutex_lock(&purge_lock);
+    if (purge_thread_started == 0)
+    {
+        pthread_t    thread;
+        if (pthread_create(&thread, NULL, my_purge_thread, NULL) == 0)
+        {
+            pthread_detach(thread);
+            __atomic_store_n(&purge_thread_started, 1, __ATOMIC_RELEASE);
+        }
+        else
+        {
+            LOG_WARN("Error: Failed to start the purge thread, purging on free\n");
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&purge_lock);
+    return ret;
+}
+
+/**
+ * @brief Start the background purge thread when the library is loaded.
+ *
+ * Only MSM_PURGE_THREAD is read here, the other tunables are still read by
+ * the first allocation.
+ */
+__attribute__((constructor))
+static void my_purge_init()
+{
+    if (my_getenv_size("MSM_PURGE_THREAD", 0) != 0)
+    {
+        my_purge_start();
+    }
+}
+
+/**
+ * @brief Purge a heap if the decay time elapsed since the last purge.
+ *
+ * When the background thread runs, the default heap is left to it.
+ *
+ * @param heap The heap.
+ */
+void my_heap_purge_maybe(struct secmalloc_heap *heap)
+{
+    struct purge_policy    *policy = my_purge_policy();
+
+    if (policy->thread && heap == &secmalloc_default_heap && __atomic_load_n(&purge_thread_started, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    if ((size_t)(my_now_ms() - heap->last_purge) >= policy->decay)
+    {
+        my_heap_purge(heap, policy->decay);
+    }
+}
+
+/**
+ * @brief Give back to the OS the pages of the free blocks of a heap.
+ *
+ * @param heap The heap to purge, or NULL for the default heap.
+ * @return size_t The number of bytes purged.
+ */
+size_t secmalloc_purge(struct secmalloc_heap *heap)
+{
+    LOG_TRACE("\n\nCALL PURGE %p\n", heap);
+
+    if (heap == NULL)
+    {
+        heap = &secmalloc_default_heap;
+    }
+
+    pthread_mutex_lock(&heap->lock);
+    size_t    purged = heap->metadata != NULL ? my_heap_purge(heap, 0) : 0;
+    pthread_mutex_unlock(&heap->lock);
+
+    LOG_TRACE("RETURN PURGE : %zu\n", purged);
+    return purged;
+}
@@ -0,0 +1,97 @@
+/**
+ * @file quarantine.c
+ * @brief Implementation of the quarantine of the freed chunks.
+ *
+ * This file contains the implementation of an option holding the freed chunks
+ * in a FIFO before they can be reused. When MSM_QUARANTINE is set, a freed
+ * chunk is cleaned and kept busy, and it is checked to be still clean when it
+ * leaves the quarantine, so that writes after free are detected. The
+ * quarantine of a heap holds at most MSM_QUARANTINE percent of its committed
+ * data, it lives under the lock free already holds.
+ */
+
+#include "secmalloc.h"
+#include <string.h>
+#include "log.h"
+
+/**
+ * @brief Get the budget of the quarantine of the heaps.
+ *
+ * The budget is read from MSM_QUARANTINE along with the other tunables.
+ *
+ * @return size_t The percentage of the committed data the quarantine may hold, 0 when there is none.
+ */
+size_t my_quarantine_percent()
+{
+    return my_config()->quarantine;
+}
+
+/**
+ * @brief Take the oldest chunk out of the quarantine of a heap and release it.
+ *
+ * The chunk was cleaned when it was freed, any byte set since then, its
+ * canary included, is a write after free.
+ *
+ * @param heap The heap.
+ */
+static void my_quarantine_evict(struct secmalloc_heap *heap)
+{
+    struct chunkmetadata    *item = heap->metadata + heap->quarantine[heap->quarantine_head] - 1;
+    heap->quarantine_head = (heap->quarantine_head + 1) % QUARANTINE_SLOTS;
+    heap->quarantine_count--;
+    heap->quarantine_bytes -= item->size + sizeof(long);
+
+    unsigned char    *byte = CHUNK_ADDR(heap, item);
+    if (byte[0] != 0 || memcmp(byte, byte + 1, item->size + sizeof(long) - 1) != 0)
+    {
+        LOG_ERROR("Error: Use after free detected : block %p written while in quarantine\n", (void*)byte);
+        heap->use_after_free++;
+        memset(byte, 0, item->size + sizeof(long));
+    }
+    my_heap_release(heap, item);
+}
+
+/**
+ * @brief Put a freed and cleaned chunk in the quarantine of a heap.
+ *
+ * The oldest chunks are released until the quarantine fits in its budget, a
+ * chunk larger than the budget is released right away.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The chunk.
+ */
+void my_heap_quarantine(struct secmalloc_heap *heap, struct chunkmetadata *item)
+{
+    size_t    budget = heap->data_committed / 100 * my_quarantine_percent();
+    size_t    size = item->size + sizeof(long);
+    if (size > budget)
+    {
+        my_heap_release(heap, item);
+        return;
+    }
+
+    while (heap->quarantine_count == QUARANTINE_SLOTS || heap->quarantine_bytes + size > budget)
+    {
+        my_quarantine_evict(heap);
+    }
+
+    // The chunk stays busy so that it is neither taken nor merged
+    item->state = CHUNK_QUARANTINED;
+    heap->quarantine[(heap->quarantine_head + heap->quarantine_count) % QUARANTINE_SLOTS] = item - heap->metadata + 1;
+    heap->quarantine_count++;
+    heap->quarantine_bytes += size;
+    LOG_TRACE("quarantine block %p, %zu bytes held\n", CHUNK_ADDR(heap, item), heap->quarantine_bytes);
+}
+
+/**
+ * @brief Release every chunk of the quarantine of a heap.
+ *
+ * @param heap The heap.
+ */
+void my_heap_quarantine_flush(struct secmalloc_heap *heap)
+{
+    while (heap->quarantine_count > 0)
+    {
+        my_quarantine_evict(heap);
+    }
+}
@@ -7,644 +7,1678 @@
  * management of heap metadata.
  */
 
-#include "secmalloc.h"
 #define _GNU_SOURCE
+#include "secmalloc.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <sys/mman.h>
-#include <linux/mman.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include "log.h"
+#include "trace.h"
 
 // Global variables
-void                    *heapdata = NULL; // Pointer to the heap data
-struct chunkmetadata    *heapmetadata = NULL; // Pointer to the heap metadata
-size_t                  heapdata_size = PAGE_HEAP_SIZE; // Current size of the heap data, will increase as needed
-size_t                  heapmetadata_size = PAGE_HEAP_SIZE; // Current size of the heap metadata, will increase as needed
+struct secmalloc_heap    secmalloc_default_heap = {
+    .data = NULL, // Pointer to the heap data
+    .metadata = NULL, // Pointer to the heap metadata
+    .data_size = PAGE_HEAP_SIZE, // Current size of the heap data, will increase as needed
+    .metadata_size = PAGE_HEAP_SIZE, // Current size of the heap metadata, will increase as needed
+    .data_committed = 0, // Size of the heap data readable and writable
+    .metadata_committed = 0, // Size of the heap metadata readable and writable
+    .growth_syscalls = 0, // Number of syscalls made to grow the heap
+    .nsegments = 0, // Data segments are mapped as the heap grows
+    .purged_bytes = 0, // Bytes given back to the OS
+    .refaults = 0, // Pages given back to the OS then allocated again
+    .last_purge = 0, // Time of the last purge pass
+    .lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP, // Lock of the heap
+    .node = -1, // Memory is not bound to a NUMA node
+    .buddy = NULL, // The buddy zone is created on first use
+    .fit_sizes = NULL, // Reserved along with the metadata
+    .fit_count = 0, // No slot used yet
+    .slot_free = 0, // No slot left by a merge yet
+    .last_chunk = 0, // Set along with the first chunk
+    .data_covered = 0, // Set along with the first chunk
+    .fit_committed = 0, // No slot committed yet
+    .fit_unordered = 0, // The slots follow the list
+    .fit_nodes = NULL, // Reserved along with the metadata, the index is reset then
+    .cold = NULL, // Reserved along with the metadata
+    .alloc_site = NULL, // Set by each allocation
+    .canary_state = 0, // Seeded by the first allocation
+};
+
+struct growth_policy    growth_policy = {
+    .initialized = 0, // The policy is read from the environment at first growth
+    .min_step = HEAP_COMMIT_STEP,
+    .max_step = GROWTH_MAX_STEP,
+    .factor = GROWTH_FACTOR,
+    .cap = 0,
+    .hugepage = HUGEPAGE_NONE,
+    .populate = 0,
+};
 
 /**
- * @brief Initialize heap data.
+ * @brief Get the growth policy of the heaps.
  *
- * This function initializes the heap data by mapping memory.
+ * The policy is read from the MSM_GROWTH_MIN_STEP, MSM_GROWTH_MAX_STEP,
+ * MSM_GROWTH_FACTOR, MSM_GROWTH_CAP, MSM_HUGEPAGE and MSM_POPULATE environment
+ * variables along with the other tunables, this function checks it the first
+ * time it is called.
  *
- * @return void* A pointer to the initialized heap data, or NULL if the initialization fails.
+ * @return struct growth_policy* A pointer to the growth policy.
  */
-void* my_init_heapdata()
+struct growth_policy* my_growth_policy()
 {
-    my_log_message("call init_heapdata\n");
-    if (heapdata == NULL)
+    if (growth_policy.initialized == 0)
     {
-        // Attempt to map memory for heap data
-        heapdata = mmap((void*)((size_t)BASE_ADDRESS + MAX_METADATA_SIZE), PAGE_HEAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        my_config();
+        growth_policy.initialized = 1;
 
-        // Check if the mmap operation was successful
-        if (heapdata == MAP_FAILED) {
-            perror("mmap");
-            my_log_message("Error: Failed to mmap memory for heap data.\n");
-            return NULL;
+        // Hugetlb ranges are reserved without taking pages from the pool, make sure it has some
+        if (growth_policy.hugepage == HUGEPAGE_HUGETLB)
+        {
+            void    *probe = mmap(NULL, HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (probe == MAP_FAILED)
+            {
+                LOG_WARN("Error: No hugetlb page available, falling back to transparent huge pages.\n");
+                growth_policy.hugepage = HUGEPAGE_THP;
+            }
+            else
+            {
+                munmap(probe, HUGE_PAGE_SIZE);
+            }
+        }
+        else if (growth_policy.hugepage > HUGEPAGE_HUGETLB)
+        {
+            growth_policy.hugepage = HUGEPAGE_THP;
+        }
+
+        // Steps are whole pages and the maximum step can not be below the minimum step
+        size_t    granule = my_page_granule();
+        growth_policy.min_step = ((growth_policy.min_step + granule - 1) / granule) * granule;
+        if (growth_policy.min_step == 0)
+        {
+            growth_policy.min_step = granule;
+        }
+        if (growth_policy.max_step < growth_policy.min_step)
+        {
+            growth_policy.max_step = growth_policy.min_step;
         }
+        LOG_INFO("growth policy : min step %zu, max step %zu, factor %zu%%, cap %zu, hugepage %zu, populate %zu\n", growth_policy.min_step, growth_policy.max_step, growth_policy.factor, growth_policy.cap, growth_policy.hugepage, growth_policy.populate);
     }
-    my_log_message("return heapdata %p\n", heapdata);
-    return heapdata;
+    return &growth_policy;
 }
 
 /**
- * @brief Initialize heap metadata.
+ * @brief Get the granule the heaps are committed and purged by.
  *
- * This function initializes the heap metadata by mapping memory.
- *
- * @return struct chunkmetadata* A pointer to the initialized heap metadata, or NULL if the initialization fails.
+ * @return size_t HUGE_PAGE_SIZE when huge pages are enabled, PAGE_HEAP_SIZE otherwise.
  */
-struct chunkmetadata* my_init_heapmetadata()
+size_t my_page_granule()
 {
-    my_log_message("call init_heapmetadata\n");
-    if (heapmetadata == NULL)
-    {
-        // Attempt to map memory for heap metadata
-        heapmetadata = (struct chunkmetadata*) mmap(BASE_ADDRESS, PAGE_HEAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-
-        // Check if the mmap operation was successful
-        if (heapmetadata == MAP_FAILED) {
-            perror("mmap");
-            my_log_message("Error: Failed to mmap memory for heap metadata.\n");
-            return NULL;
-        }
-
-        // Initialize the first chunk metadata
-        heapmetadata->size = PAGE_HEAP_SIZE;
-        heapmetadata->flags = FREE;
-        heapmetadata->addr = heapdata;
-        heapmetadata->canary = 0xdeadbeef; // will be replaced by a random value during first malloc
-        heapmetadata->next = NULL;
-    }
-    my_log_message("return heapmetadata %p\n", heapmetadata);
-    return heapmetadata;
+    return my_growth_policy()->hugepage != HUGEPAGE_NONE ? HUGE_PAGE_SIZE : PAGE_HEAP_SIZE;
 }
 
 /**
- * @brief Generate a random canary value.
+ * @brief Compute the size to commit for a region.
  *
- * This function generates a random canary value using /dev/urandom.
+ * The region grows geometrically: the step is the given percentage of what is
+ * already committed, bounded by the minimum and maximum steps, and never less
+ * than what is needed.
  *
- * @return long The generated canary value, or -1 if the generation fails.
+ * @param committed The size of the region already committed.
+ * @param needed The size of the region needed.
+ * @return size_t The new size to commit, a multiple of the page granule.
  */
-long my_generate_canary()
+size_t my_growth_target(size_t committed, size_t needed)
 {
-    my_log_message("call generate_canary\n");
-    long    canary = 0;
-    int     fd = open("/dev/urandom", O_RDONLY);
+    struct growth_policy    *policy = my_growth_policy();
+    size_t                  step = committed / 100 * policy->factor;
 
-    // Check if opening /dev/urandom was successful
-    if (fd == -1)
+    if (step < policy->min_step)
     {
-        perror("open");
-        my_log_message("Error: Failed to open /dev/urandom for canary generation.\n");
-        return -1;
+        step = policy->min_step;
     }
-
-    // Read random data into the canary variable
-    ssize_t    result = read(fd, &canary, sizeof(long));
-    if (result == -1)
+    if (step > policy->max_step)
     {
-        perror("read");
-        my_log_message("Error: Failed to read from /dev/urandom for canary generation.\n");
-        close(fd); // Close the file descriptor before returning
-        return -1;
+        step = policy->max_step;
     }
-    else if (result != sizeof(long))
+
+    size_t    target = committed + step;
+    if (target < needed)
     {
-        my_log_message("Error: Incomplete read from /dev/urandom. Expected %zu bytes but got %zd bytes.\n", sizeof(long), result);
-        close(fd); // Close the file descriptor before returning
-        return -1;
+        target = needed;
     }
-
-    close(fd); // Close the file descriptor after reading
-    my_log_message("return canary %ld\n", canary);
-    return canary;
+    size_t    granule = my_page_granule();
+    return ((target + granule - 1) / granule) * granule;
 }
 
 /**
- * @brief Get the total allocated size of the heap metadata.
+ * @brief Get the flags of the mappings of the heaps.
  *
- * This function calculates the total allocated size of the heap metadata.
- *
- * @return size_t The total allocated size of the heap metadata.
+ * @return int The flags given to mmap.
  */
-size_t my_get_allocated_heapmetadata_size()
+static int my_map_flags()
 {
-    my_log_message("call get_allocated_heapmetadata_size\n");
-    size_t    size = 0;
-    void      *item = heapmetadata;
-
-    while (((struct chunkmetadata*)item)->size != 0)
+    int    flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    if (my_growth_policy()->hugepage == HUGEPAGE_HUGETLB)
     {
-        size += sizeof(struct chunkmetadata);
-        item = (void*)((size_t)item + sizeof(struct chunkmetadata));
+        flags |= MAP_HUGETLB;
     }
-
-    my_log_message("return size %zu\n", size);
-    return size;
+    return flags;
 }
 
 /**
- * @brief Get the total allocated size of the heap data.
+ * @brief Reserve an address range.
  *
- * This function calculates the total allocated size of the heap data.
+ * This function reserves, without committing any memory, a range anywhere in
+ * the address space where a region can then grow without moving.
  *
- * @return size_t The total allocated size of the heap data.
+ * With huge pages the range is aligned on HUGE_PAGE_SIZE, either backed by
+ * the hugetlb pool or advised for transparent huge pages. When the hugetlb
+ * pool is not usable the heaps fall back to transparent huge pages.
+ *
+ * @param size The size of the range, a multiple of the page granule.
+ * @return void* The start of the reserved range, or NULL if the reservation fails.
  */
-size_t my_get_allocated_heapdata_size()
+static void* my_reserve(size_t size)
 {
-    my_log_message("call get_allocated_heapdata_size\n");
-    struct chunkmetadata    *last_item = NULL;
-    size_t                  size = 0;
+    LOG_TRACE("call reserve %zu bytes\n", size);
+    struct growth_policy    *policy = my_growth_policy();
 
-    for (struct chunkmetadata *item = heapmetadata; item != NULL; item = item->next)
+    if (policy->hugepage == HUGEPAGE_HUGETLB)
     {
-        size += item->size + sizeof(long); // add the size of the canary
-        last_item = item;
+        // Hugetlb mappings are aligned by the kernel
+        void    *base = mmap(NULL, size, PROT_NONE, my_map_flags(), -1, 0);
+        if (base != MAP_FAILED)
+        {
+            LOG_TRACE("return reserved hugetlb range %p\n", base);
+            return base;
+        }
+        LOG_WARN("Error: Failed to reserve hugetlb range, falling back to transparent huge pages.\n");
+        policy->hugepage = HUGEPAGE_THP;
     }
 
-    if (last_item->flags == FREE)
+    size_t    extra = policy->hugepage == HUGEPAGE_THP ? HUGE_PAGE_SIZE : 0;
+    char      *map = mmap(NULL, size + extra, PROT_NONE, my_map_flags(), -1, 0);
+    if (map == MAP_FAILED)
     {
-        size -= last_item->size;
+        perror("mmap");
+        LOG_ERROR("Error: Failed to reserve address range.\n");
+        return NULL;
     }
 
-    my_log_message("return size %zu\n", size);
-    return size;
+    char    *base = map;
+    if (extra != 0)
+    {
+        // Trim the range to align it on a huge page, then let the kernel back it with huge pages
+        base = (char*)(((size_t)map + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1));
+        if (base > map)
+        {
+            munmap(map, base - map);
+        }
+        munmap(base + size, map + extra - base);
+        if (madvise(base, size, MADV_HUGEPAGE) == -1)
+        {
+            perror("madvise");
+            LOG_WARN("Error: Failed to advise huge pages at %p.\n", base);
+        }
+    }
+    LOG_TRACE("return reserved range %p\n", base);
+    return base;
 }
 
 /**
- * @brief Get the last metadata block.
+ * @brief Fault in the pages of a committed range.
  *
- * This function returns the last metadata block in the linked list.
+ * This function prefaults the pages with MADV_POPULATE_WRITE, and touches
+ * them one by one on kernels not supporting it.
  *
- * @return struct chunkmetadata* A pointer to the last metadata block.
+ * @param addr The start of the range.
+ * @param size The size of the range.
+ * @return int 0 on success, -1 on failure.
  */
-struct chunkmetadata* my_lastmetadata()
+int my_populate(void *addr, size_t size)
 {
-    my_log_message("call lastmetadata\n");
-    struct chunkmetadata    *item = heapmetadata;
-
-    while (item->next != NULL)
+    size_t    start = (size_t)addr & ~((size_t)PAGE_HEAP_SIZE - 1);
+    size_t    end = ((size_t)addr + size + PAGE_HEAP_SIZE - 1) & ~((size_t)PAGE_HEAP_SIZE - 1);
+    if (end <= start)
     {
-        item = item->next;
+        return 0;
     }
 
-    my_log_message("Last metadata block at %p, size : %zu, flags : %d\n", item, item->size, item->flags);
-    return item;
-}
-
-/**
- * @brief Resize the heap metadata.
- *
- * This function resizes the heap metadata when necessary.
- */
-void my_resizeheapmetadata()
-{
-    my_log_message("call resizeheapmetadata\n");
-
-    // Ensure the current heap metadata size is valid
-    if (heapmetadata == NULL) {
-        my_log_message("Error: Heap metadata is not initialized.\n");
-        return;
+    if (madvise((void*)start, end - start, MADV_POPULATE_WRITE) == 0)
+    {
+        LOG_INFO("populated %zu bytes at %p\n", end - start, (void*)start);
+        return 0;
     }
-
-    void    *old_heapmetadata = heapmetadata;
-
-    // Calculate the new size of the heap metadata
-    size_t    new_size = heapmetadata_size + PAGE_HEAP_SIZE;
-
-    // Attempt to resize the heap metadata using mremap
-    void    *new_heapmetadata = mremap(heapmetadata, heapmetadata_size, new_size, MREMAP_MAYMOVE);
-
-    // Check if the remapping was successful
-    if (new_heapmetadata == MAP_FAILED) {
-        perror("mremap");
-        my_log_message("Error: Failed to resize heap metadata.\n");
-        return;
+    if (errno != EINVAL)
+    {
+        perror("madvise");
+        LOG_WARN("Error: Failed to populate memory at %p.\n", (void*)start);
+        return -1;
     }
 
-    if (old_heapmetadata != new_heapmetadata){
-        my_log_message("Error: old_heapmetadata != new_heapmetadata\n");
-        my_log_message("old_heapmetadata : %p\n", old_heapmetadata);
-        my_log_message("new_heapmetadata : %p\n", new_heapmetadata);
+    // Write the pages without changing their content
+    for (size_t page = start; page < end; page += PAGE_HEAP_SIZE)
+    {
+        *(volatile char*)page = *(volatile char*)page;
     }
-
-    // Update the heap metadata pointer and size
-    heapmetadata = new_heapmetadata;
-    heapmetadata_size = new_size;
-
-    my_log_message("new heapmetadata size %zu\n", heapmetadata_size);
-    return;
+    LOG_INFO("touched %zu bytes at %p\n", end - start, (void*)start);
+    return 0;
 }
 
 /**
- * @brief Resize the heap data.
+ * @brief Commit memory in a reserved range.
  *
- * This function resizes the heap data to the specified new size.
+ * This function makes readable and writable the part of a region needed to
+ * hold the specified size, following the growth policy.
  *
- * @param new_size The new size for the heap data.
+ * @param heap The heap owning the region.
+ * @param addr The start of the region.
+ * @param committed The size of the region already committed, updated on success.
+ * @param needed The size of the region needed.
+ * @param max The size reserved for the region.
+ * @return int 0 on success, -1 on failure.
  */
-void my_resizeheapdata(size_t new_size)
+static int my_heap_commit(struct secmalloc_heap *heap, void *addr, size_t *committed, size_t needed, size_t max)
 {
-    my_log_message("call resizeheapdata\n");
-
-    // Ensure the current heap data size is valid
-    if (heapdata == NULL) {
-        my_log_message("Error: Heap data is not initialized.\n");
-        return;
+    if (needed <= *committed)
+    {
+        return 0;
     }
 
-    void    *old_heapdata = heapdata;
-    // Attempt to resize the heap data using mremap
-    void    *new_heapdata = mremap(heapdata, heapdata_size, new_size, MREMAP_MAYMOVE);
-
-    if (old_heapdata != new_heapdata){
-        my_log_message("Error: old_heapdata != new_heapdata\n");
-        my_log_message("old_heapdata : %p\n", old_heapdata);
-        my_log_message("new_heapdata : %p\n", new_heapdata);
+    // The cap applies to the memory committed for both regions of the heap
+    size_t    cap = my_growth_policy()->cap;
+    size_t    other = heap->data_committed + heap->metadata_committed - *committed;
+    if (cap != 0 && (cap <= other || cap - other < max))
+    {
+        max = cap <= other ? 0 : cap - other;
     }
-
-    // Check if the remapping was successful
-    if (new_heapdata == MAP_FAILED) {
-        perror("mremap");
-        my_log_message("Error: Failed to resize heap data.\n");
-        return;
+    if (needed > max)
+    {
+        LOG_ERROR("Error: %zu bytes needed but only %zu bytes reserved.\n", needed, max);
+        return -1;
     }
 
-    // Update the heap data pointer and size
-    heapdata = new_heapdata;
-    heapdata_size = new_size;
+    size_t    new_committed = my_growth_target(*committed, needed);
+    if (new_committed > max)
+    {
+        new_committed = max;
+    }
 
-    // Get the last metadata block
-    struct chunkmetadata    *last = my_lastmetadata();
-    if (last != NULL)
+    if (mprotect((void*)((size_t)addr + *committed), new_committed - *committed, PROT_READ | PROT_WRITE) == -1)
     {
-        last->size = new_size;
+        perror("mprotect");
+        LOG_ERROR("Error: Failed to commit memory at %p.\n", addr);
+        return -1;
     }
-    else
+
+    heap->growth_syscalls++;
+    LOG_INFO("committed %zu bytes at %p\n", new_committed, addr);
+
+    // Latency-critical heaps take the page faults now rather than on first touch
+    if (my_growth_policy()->populate)
     {
-        my_log_message("Error: No metadata found to update the size.\n");
+        my_populate((void*)((size_t)addr + *committed), new_committed - *committed);
     }
 
-    my_log_message("new heapdata size %zu\n", heapdata_size);
-    return;
+    *committed = new_committed;
+    return 0;
 }
 
 /**
- * @brief Look up a free block with enough size.
+ * @brief Decommit memory in a reserved range.
  *
- * This function looks up a free block in the heap metadata that is large enough to accommodate the requested size.
+ * This function gives the pages back to the OS and makes them inaccessible,
+ * the range stays reserved and reads as zero when committed again.
  *
- * @param size The size required for the block.
- * @return struct chunkmetadata* A pointer to the found free block, or NULL if no block is found.
+ * @param addr The start of the range to decommit, a multiple of the page granule.
+ * @param size The size of the range to decommit, a multiple of the page granule.
+ * @return int 0 on success, -1 on failure.
  */
-struct chunkmetadata* my_lookup(size_t size)
+static int my_decommit(void *addr, size_t size)
 {
-    my_log_message("call lookup\n");
-    // Check if the heap metadata is initialized
-    if (heapmetadata == NULL) {
-        my_log_message("Error: Heap metadata is not initialized.\n");
-        return NULL;
+    if (mmap(addr, size, PROT_NONE, my_map_flags() | MAP_FIXED, -1, 0) == MAP_FAILED)
+    {
+        perror("mmap");
+        LOG_ERROR("Error: Failed to decommit memory at %p.\n", addr);
+        return -1;
     }
-
-    // Traverse the  linked list of chunkmetadata to find a suitable free block
-    for (struct chunkmetadata *item = heapmetadata; item != NULL; item = item->next)
+    if (my_growth_policy()->hugepage == HUGEPAGE_THP)
     {
-        // Check if the current block is free and has enough size
-        if (item->flags == FREE && item->size >= size + sizeof(long))
-        {
-            my_log_message("Found suitable free block %p pointing to %p of size %zu bytes.\n", item, item->addr, item->size);
-            return item; // Return the suitable free block
-        }
+        madvise(addr, size, MADV_HUGEPAGE);
     }
-
-    my_log_message("Error: No suitable free block found for size %zu bytes.\n", size);
-    return NULL; // Return NULL if no suitable block is found
+    LOG_INFO("decommitted %zu bytes at %p\n", size, addr);
+    return 0;
 }
 
 /**
- * @brief Split a block into two blocks.
- *
- * This function splits a given block into two blocks.
+ * @brief Commit the entries of a range parallel to the metadata slots or to the data.
  *
- * @param bloc The block to split.
- * @param size The size of the first block after the split.
- * @param canary The canary value to place in the block.
+ * @param base The start of the range.
+ * @param entry The size of an entry.
+ * @param from The number of entries already committed.
+ * @param to The number of entries needed.
+ * @return int 0 on success, -1 on failure.
  */
-void my_split(struct chunkmetadata *bloc, size_t size, long canary)
+static int my_commit_entries(void *base, size_t entry, size_t from, size_t to)
 {
-    my_log_message("call split block %p pointing to %p of size %zu bytes into %zu bytes and %zu bytes.\n", bloc,  bloc->addr, bloc->size, size, bloc->size - size - sizeof(long));
-    // Check if the block to be split is valid
-    if (bloc == NULL) {
-        my_log_message("Error: Attempted to split a NULL block.\n");
-        return;
-    }
-    // Create new metadata block for the second part
-    struct chunkmetadata    *newbloc = (struct chunkmetadata*) ((size_t)heapmetadata + my_get_allocated_heapmetadata_size());
-    my_log_message("in split : selected empty new newbloc %p pointing to %p, size = %zu, flags = %d\n", newbloc, newbloc->addr, newbloc->size, newbloc->flags);
-
-    // Set metadata for the new block
-    newbloc->size = bloc->size - size - sizeof(long);
-    newbloc->flags = FREE;
-    newbloc->addr = (void*)((size_t)bloc->addr + size + sizeof(long));
-    newbloc->canary = 0xdeadbeef;
-    newbloc->next = bloc->next;
-
-    // Set the metadata for the first block
-    // bloc == newbloc should really not happen
-    if (bloc == newbloc)
-    {
-        my_log_message("Error: bloc %p == newbloc %p\n", bloc, newbloc);
-        bloc->next = newbloc->next;
-    }
-    else
+    size_t    granule = my_page_granule();
+    size_t    start = ((from * entry + granule - 1) / granule) * granule;
+    size_t    end = ((to * entry + granule - 1) / granule) * granule;
+    if (end > start && mprotect((char*)base + start, end - start, PROT_READ | PROT_WRITE) == -1)
     {
-        // Should always be the case
-        bloc->next = newbloc;
+        perror("mprotect");
+        return -1;
     }
-
-    bloc->size = size;
-    bloc->flags = BUSY;
-    bloc->canary = canary;
-
-    my_log_message("end split : newbloc %p pointing to %p, size = %zu, flags = %d, canary = %ld, next = %p\n", newbloc, newbloc->addr, newbloc->size, newbloc->flags, newbloc->canary, newbloc->next);
-    return;
+    return 0;
 }
 
 /**
- * @brief Place a canary at the end of a block.
- *
- * This function places a canary value at the end of the specified block.
+ * @brief Get the size of the range reserved for the shadow of a data segment.
  *
- * @param bloc The block to place the canary in.
- * @param canary The canary value to place.
+ * @param segment The segment.
+ * @return size_t The size of the range, a multiple of the page granule.
  */
-void my_place_canary(struct chunkmetadata *bloc, long canary)
+static size_t my_shadow_reserved(struct heap_segment *segment)
 {
-    my_log_message("call place_canary\n");
+    size_t    granule = my_page_granule();
+    return ((SHADOW_SIZE(segment->reserved) + granule - 1) / granule) * granule;
+}
 
-    // Check if the block is valid
-    if (bloc == NULL)
+/**
+ * @brief Commit the shadow of the committed data of a segment.
+ *
+ * @param segment The segment.
+ * @param from The size of the data whose shadow is already committed.
+ * @return int 0 on success, -1 on failure.
+ */
+static int my_shadow_commit(struct heap_segment *segment, size_t from)
+{
+    size_t    to = (segment->committed + SHADOW_LINE_SIZE - 1) / SHADOW_LINE_SIZE;
+    if (my_commit_entries(segment->shadow, sizeof(struct shadow_line), from / SHADOW_LINE_SIZE, to) == -1)
     {
-        my_log_message("Error: Attempted to place canary in a NULL block.\n");
-        return;
+        LOG_ERROR("Error: Failed to commit the shadow of the heap data.\n");
+        return -1;
     }
-    // Calculate the address where the canary should be placed
-    long *canary_ptr = (long*)((size_t)bloc->addr + bloc->size);
-
-    // Place the canary value at the calculated address
-    *canary_ptr = canary;
-
-    my_log_message("Canary placed at %p with value %ld\n", canary_ptr, *canary_ptr);
-    return;
+    return 0;
 }
 
 /**
- * @brief Allocate memory of the specified size.
+ * @brief Add a data segment to a heap.
  *
- * This function allocates memory of the specified size and returns a pointer to it.
+ * This function reserves a new segment, large enough for the specified size,
+ * and commits that size in it.
  *
- * @param size The size of the memory block to allocate.
- * @return void* A pointer to the allocated memory, or NULL if the allocation fails.
+ * @param heap The heap to grow.
+ * @param size The size of the segment handed out to blocks.
+ * @return struct heap_segment* A pointer to the new segment, or NULL if the creation fails.
  */
-void* my_malloc(size_t size)
+static struct heap_segment* my_heap_new_segment(struct secmalloc_heap *heap, size_t size)
 {
-    my_log_message("\n\nCALL MALLOC SIZE %zu\n", size);
+    LOG_TRACE("call new segment of size %zu\n", size);
 
-    // If requested size is 0, return NULL
-    if (size == 0)
+    if (heap->nsegments == HEAP_MAX_SEGMENTS)
     {
+        LOG_ERROR("Error: Too many heap segments.\n");
         return NULL;
     }
 
-    // Check if the heap data is initialized
-    if (heapdata == NULL)
-    {
-        if (my_init_heapdata() == NULL)
-        {
-            return NULL; // Initialization failed
-        }
-    }
-
-    // Check if the heap metadata is initialized
-    if (heapmetadata == NULL)
+    struct heap_segment    *segment = &heap->segments[heap->nsegments];
+    segment->reserved = size > HEAP_SEGMENT_SIZE ? size : HEAP_SEGMENT_SIZE;
+    segment->reserved = ((segment->reserved + my_page_granule() - 1) / my_page_granule()) * my_page_granule();
+    if (segment->reserved > HEAP_SEGMENT_MAX_SIZE)
     {
-        if (my_init_heapmetadata() == NULL)
-        {
-            return NULL; // Initialization failed
-        }
+        LOG_ERROR("Error: Segment of %zu bytes too large.\n", size);
+        return NULL;
     }
-
-    // Get the total size of allocated heap metadata and resize if needed
-    size_t    allocated_heapmetadata_size = my_get_allocated_heapmetadata_size();
-    if (PAGE_HEAP_SIZE - allocated_heapmetadata_size % PAGE_HEAP_SIZE < sizeof(struct chunkmetadata))
+    segment->committed = 0;
+    segment->base = my_reserve(segment->reserved);
+    if (segment->base == NULL)
     {
-        my_resizeheapmetadata();
+        return NULL;
     }
-
-    // Get the total size of allocated data heap and resize if needed
-    size_t    allocated_heapdata_size = my_get_allocated_heapdata_size();
-    size_t    needed_size = size + sizeof(long);
-    size_t    available_size = heapdata_size - allocated_heapdata_size;
-    if (available_size < needed_size)
+    segment->shadow = my_reserve(my_shadow_reserved(segment));
+    if (segment->shadow == NULL)
     {
-        size_t    new_size = allocated_heapdata_size + needed_size;
-        new_size = ((new_size / PAGE_HEAP_SIZE) + ((new_size % PAGE_HEAP_SIZE != 0) ? 1 : 0)) * PAGE_HEAP_SIZE;
-        my_resizeheapdata(new_size);
+        munmap(segment->base, segment->reserved);
+        return NULL;
     }
-
-    // Look up a free block with large enough size
-    struct chunkmetadata    *bloc = my_lookup(size);
-    if (bloc == NULL)
+    if (heap->node >= 0)
     {
-        return NULL; // No suitable block found
+        my_numa_bind(segment->base, segment->reserved, heap->node);
     }
 
-    // Generate a canary
-    long    canary = my_generate_canary();
-    if (canary == -1)
+    if (my_heap_commit(heap, segment->base, &segment->committed, size, segment->reserved) == -1 || my_shadow_commit(segment, 0) == -1)
     {
-        return NULL; // Canary generation failed
+        munmap(segment->shadow, my_shadow_reserved(segment));
+        munmap(segment->base, segment->reserved);
+        return NULL;
     }
+    segment->size = size;
+    __atomic_store_n(&heap->nsegments, heap->nsegments + 1, __ATOMIC_RELEASE); // my_numa_owner() reads the segments without the lock
+    heap->data_size += size;
+    heap->data_committed += segment->committed;
 
-    // Split the block
-    my_split(bloc, size, canary);
-
-    // Place the canary at the end of the block data in heapdata
-    my_place_canary(bloc, canary);
-
-    // Return the address of the data block in heapdata
-    my_log_message("RETURN MALLOC: bloc %p bloc->addr %p bloc->size %zu\n", bloc, bloc->addr, bloc->size);
-    return bloc->addr;
+    LOG_TRACE("return segment %p\n", segment->base);
+    return segment;
 }
 
 /**
- * @brief Verify the canary value of a block.
+ * @brief Find the data segment of a heap holding an address.
  *
- * This function verifies the canary value of the specified block.
- *
- * @param item The block to verify.
- * @return int Returns 1 if the canary is valid, -1 otherwise.
+ * @param heap The heap to search.
+ * @param ptr The address.
+ * @return struct heap_segment* A pointer to the segment, or NULL if the address is not in the heap.
  */
-int my_verify_canary(struct chunkmetadata *item)
+struct heap_segment* my_heap_segment(struct secmalloc_heap *heap, void *ptr)
 {
-    my_log_message("Verifying canary\n");
-
-    // Calculate the expected canary value
-    long    expected_canary = item->canary;
-
-    // Locate the canary at the end of the block
-    long    *canary = (long*)((size_t)item->addr + item->size);
-
-    // Verify if the canary matches the expected value
-    if (*canary != expected_canary)
+    for (size_t i = 0; i < heap->nsegments; i++)
     {
-        my_log_message("Error: Canary verification failed: Expected %ld but found %ld\n", expected_canary, *canary);
-        return -1; // Canary verification failed
+        struct heap_segment    *segment = &heap->segments[i];
+        if ((size_t)ptr >= (size_t)segment->base && (size_t)ptr < (size_t)segment->base + segment->size)
+        {
+            return segment;
+        }
     }
-
-    my_log_message("Canary %ld verified\n", *canary);
-    return 1; // Canary verification successful
+    return NULL;
 }
 
 /**
- * @brief Clean the memory of a block.
+ * @brief Initialize the data region of a heap.
  *
- * This function cleans the memory of the specified block by setting it to zero.
+ * This function initializes the heap data by creating its first segment.
  *
+ * @param heap The heap to initialize.
+ * @return void* A pointer to the initialized heap data, or NULL if the initialization fails.
+ */
+void* my_heap_init_data(struct secmalloc_heap *heap)
+{
+    LOG_TRACE("call init_heapdata\n");
+    if (heap->data == NULL)
+    {
+        // Attempt to create the first segment of heap data
+        heap->nsegments = 0;
+        heap->data_size = 0;
+        heap->data_committed = 0;
+        struct heap_segment    *segment = my_heap_new_segment(heap, PAGE_HEAP_SIZE);
+        if (segment == NULL)
+        {
+            LOG_ERROR("Error: Failed to mmap memory for heap data.\n");
+            return NULL;
+        }
+        heap->data = segment->base;
+    }
+    LOG_TRACE("return heapdata %p\n", heap->data);
+    return heap->data;
+}
+
+/**
+ * @brief Initialize heap data.
+ *
+ * This function initializes the data of the default heap.
+ *
+ * @return void* A pointer to the initialized heap data, or NULL if the initialization fails.
+ */
+void* my_init_heapdata()
+{
+    return my_heap_init_data(&secmalloc_default_heap);
+}
+
+/**
+ * @brief Commit the free sizes, the tree nodes and the cold metadata of the metadata slots of a heap.
+ *
+ * This function makes readable and writable the free sizes, the tree nodes
+ * and the cold metadata of all the slots the committed metadata can hold.
+ *
+ * @param heap The heap.
+ * @return int 0 on success, -1 on failure.
+ */
+static int my_heap_fit_commit(struct secmalloc_heap *heap)
+{
+    size_t    slots = heap->metadata_committed / sizeof(struct chunkmetadata);
+    if (slots <= heap->fit_committed)
+    {
+        return 0;
+    }
+
+    if (my_commit_entries(heap->fit_sizes, sizeof(size_t), heap->fit_committed, slots) == -1
+        || my_commit_entries(heap->fit_nodes, sizeof(struct fit_node), heap->fit_committed, slots) == -1
+        || my_commit_entries(heap->cold, sizeof(struct chunkcold), heap->fit_committed, slots) == -1)
+    {
+        LOG_ERROR("Error: Failed to commit the free sizes of the heap metadata.\n");
+        return -1;
+    }
+    heap->fit_committed = slots;
+    return 0;
+}
+
+/**
+ * @brief Initialize the metadata region of a heap.
+ *
+ * This function initializes the heap metadata by reserving its range and
+ * committing the first page of it.
+ *
+ * @param heap The heap to initialize.
+ * @return struct chunkmetadata* A pointer to the initialized heap metadata, or NULL if the initialization fails.
+ */
+struct chunkmetadata* my_heap_init_metadata(struct secmalloc_heap *heap)
+{
+    LOG_TRACE("call init_heapmetadata\n");
+    if (heap->metadata == NULL)
+    {
+        // Attempt to reserve the metadata range and commit its first page
+        struct chunkmetadata    *metadata = (struct chunkmetadata*) my_reserve(MAX_METADATA_SIZE);
+        if (metadata == NULL)
+        {
+            return NULL;
+        }
+        heap->metadata_committed = 0;
+        if (my_heap_commit(heap, metadata, &heap->metadata_committed, PAGE_HEAP_SIZE, MAX_METADATA_SIZE) == -1)
+        {
+            LOG_ERROR("Error: Failed to mmap memory for heap metadata.\n");
+            munmap(metadata, MAX_METADATA_SIZE);
+            return NULL;
+        }
+
+        // The free sizes, the best-fit tree and the cold metadata of the slots live in arrays along the metadata
+        heap->fit_sizes = my_reserve(FIT_SIZES_SIZE);
+        heap->fit_nodes = my_reserve(FIT_NODES_SIZE);
+        heap->cold = my_reserve(COLD_SIZE);
+        heap->fit_committed = 0;
+        heap->fit_count = 0;
+        heap->slot_free = 0;
+        heap->fit_unordered = 0;
+        my_fit_init(heap);
+        if (heap->fit_sizes == NULL || heap->fit_nodes == NULL || heap->cold == NULL || my_heap_fit_commit(heap) == -1)
+        {
+            LOG_ERROR("Error: Failed to mmap memory for heap metadata.\n");
+            if (heap->fit_sizes != NULL)
+            {
+                munmap(heap->fit_sizes, FIT_SIZES_SIZE);
+            }
+            if (heap->fit_nodes != NULL)
+            {
+                munmap(heap->fit_nodes, FIT_NODES_SIZE);
+            }
+            if (heap->cold != NULL)
+            {
+                munmap(heap->cold, COLD_SIZE);
+            }
+            munmap(metadata, MAX_METADATA_SIZE);
+            return NULL;
+        }
+        heap->metadata = metadata;
+        heap->metadata_size = PAGE_HEAP_SIZE;
+
+        // Initialize the first chunk metadata
+        metadata->size = heap->data ? heap->segments[0].size : PAGE_HEAP_SIZE;
+        metadata->flags = FREE;
+        metadata->segment = 0;
+        metadata->offset = 0;
+        metadata->state = CHUNK_FRESH;
+        metadata->next = 0;
+        heap->data_covered = metadata->size + sizeof(long);
+        my_fit_update(heap, metadata);
+    }
+    LOG_TRACE("return heapmetadata %p\n", heap->metadata);
+    return heap->metadata;
+}
+
+/**
+ * @brief Initialize heap metadata.
+ *
+ * This function initializes the metadata of the default heap.
+ *
+ * @return struct chunkmetadata* A pointer to the initialized heap metadata, or NULL if the initialization fails.
+ */
+struct chunkmetadata* my_init_heapmetadata()
+{
+    return my_heap_init_metadata(&secmalloc_default_heap);
+}
+
+/**
+ * @brief Generate a random canary value.
+ *
+ * This function generates a random canary value using /dev/urandom.
+ *
+ * @return long The generated canary value, or -1 if the generation fails.
+ */
+long my_generate_canary()
+{
+    LOG_TRACE("call generate_canary\n");
+    long    canary = 0;
+    int     fd = open("/dev/urandom", O_RDONLY);
+
+    // Check if opening /dev/urandom was successful
+    if (fd == -1)
+    {
+        perror("open");
+        LOG_ERROR("Error: Failed to open /dev/urandom for canary generation.\n");
+        return -1;
+    }
+
+    // Read random data into the canary variable
+    ssize_t    result = read(fd, &canary, sizeof(long));
+    if (result == -1)
+    {
+        perror("read");
+        LOG_ERROR("Error: Failed to read from /dev/urandom for canary generation.\n");
+        close(fd); // Close the file descriptor before returning
+        return -1;
+    }
+    else if (result != sizeof(long))
+    {
+        LOG_ERROR("Error: Incomplete read from /dev/urandom. Expected %zu bytes but got %zd bytes.\n", sizeof(long), result);
+        close(fd); // Close the file descriptor before returning
+        return -1;
+    }
+
+    close(fd); // Close the file descriptor after reading
+    LOG_TRACE("return canary %ld\n", canary);
+    return canary;
+}
+
+/**
+ * @brief Draw a canary value for a block of a heap.
+ *
+ * The canaries come from a splitmix64 generator of the heap, seeded once from
+ * /dev/urandom, so that an allocation makes no syscall.
+ *
+ * @param heap The heap, its lock held.
+ * @return long The canary value, or -1 if the generator can not be seeded.
+ */
+long my_heap_canary(struct secmalloc_heap *heap)
+{
+    if (heap->canary_state == 0)
+    {
+        long    seed = my_generate_canary();
+        if (seed == -1)
+        {
+            return -1;
+        }
+        heap->canary_state = (unsigned long)seed | 1;
+    }
+
+    // -1 reports a failure, it is never handed out as a canary
+    unsigned long    canary;
+    do
+    {
+        heap->canary_state += 0x9e3779b97f4a7c15UL;
+        canary = heap->canary_state;
+        canary = (canary ^ (canary >> 30)) * 0xbf58476d1ce4e5b9UL;
+        canary = (canary ^ (canary >> 27)) * 0x94d049bb133111ebUL;
+        canary ^= canary >> 31;
+    } while ((long)canary == -1);
+    return (long)canary;
+}
+
+/**
+ * @brief Get the total allocated size of the metadata of a heap.
+ *
+ * This function returns the size of the slots handed out so far, the slots
+ * left by merged chunks included since they are reused before any new one.
+ *
+ * @param heap The heap to inspect.
+ * @return size_t The total allocated size of the heap metadata.
+ */
+size_t my_heap_allocated_metadata_size(struct secmalloc_heap *heap)
+{
+    LOG_TRACE("call get_allocated_heapmetadata_size\n");
+    size_t    size = heap->fit_count * sizeof(struct chunkmetadata);
+
+    LOG_TRACE("return size %zu\n", size);
+    return size;
+}
+
+/**
+ * @brief Get the total allocated size of the heap metadata.
+ *
+ * This function calculates the total allocated size of the default heap metadata.
+ *
+ * @return size_t The total allocated size of the heap metadata.
+ */
+size_t my_get_allocated_heapmetadata_size()
+{
+    return my_heap_allocated_metadata_size(&secmalloc_default_heap);
+}
+
+/**
+ * @brief Get the total allocated size of the data of a heap.
+ *
+ * This function returns the size of the data covered by the chunks, but the
+ * free end of the data, from the counter kept along the changes of the list.
+ *
+ * @param heap The heap to inspect.
+ * @return size_t The total allocated size of the heap data.
+ */
+size_t my_heap_allocated_data_size(struct secmalloc_heap *heap)
+{
+    LOG_TRACE("call get_allocated_heapdata_size\n");
+    struct chunkmetadata    *last_item = my_heap_lastmetadata(heap);
+    size_t                  size = heap->data_covered;
+
+    if (last_item->flags == FREE)
+    {
+        size -= last_item->size;
+    }
+
+    LOG_TRACE("return size %zu\n", size);
+    return size;
+}
+
+/**
+ * @brief Get the total allocated size of the heap data.
+ *
+ * This function calculates the total allocated size of the default heap data.
+ *
+ * @return size_t The total allocated size of the heap data.
+ */
+size_t my_get_allocated_heapdata_size()
+{
+    return my_heap_allocated_data_size(&secmalloc_default_heap);
+}
+
+/**
+ * @brief Get the last metadata block of a heap.
+ *
+ * This function returns the last metadata block in the linked list, which
+ * my_fit_update() records as the chunks change.
+ *
+ * @param heap The heap to inspect.
+ * @return struct chunkmetadata* A pointer to the last metadata block.
+ */
+struct chunkmetadata* my_heap_lastmetadata(struct secmalloc_heap *heap)
+{
+    LOG_TRACE("call lastmetadata\n");
+    struct chunkmetadata    *item = heap->metadata + heap->last_chunk - 1;
+
+    LOG_TRACE("Last metadata block at %p, size : %zu, flags : %d\n", item, item->size, item->flags);
+    return item;
+}
+
+/**
+ * @brief Get the last metadata block.
+ *
+ * This function returns the last metadata block in the linked list of the default heap.
+ *
+ * @return struct chunkmetadata* A pointer to the last metadata block.
+ */
+struct chunkmetadata* my_lastmetadata()
+{
+    return my_heap_lastmetadata(&secmalloc_default_heap);
+}
+
+/**
+ * @brief Resize the metadata of a heap.
+ *
+ * This function resizes the heap metadata when necessary. The metadata grows in
+ * place inside its reserved range, so the chunk pointers stay valid.
+ *
+ * @param heap The heap to resize.
+ */
+void my_heap_resize_metadata(struct secmalloc_heap *heap)
+{
+    LOG_TRACE("call resizeheapmetadata\n");
+
+    // Ensure the current heap metadata size is valid
+    if (heap->metadata == NULL) {
+        LOG_ERROR("Error: Heap metadata is not initialized.\n");
+        return;
+    }
+
+    // Calculate the new size of the heap metadata
+    size_t    new_size = heap->metadata_size + PAGE_HEAP_SIZE;
+
+    // Attempt to commit the new size of the heap metadata
+    if (my_heap_commit(heap, heap->metadata, &heap->metadata_committed, new_size, MAX_METADATA_SIZE) == -1 || my_heap_fit_commit(heap) == -1) {
+        LOG_ERROR("Error: Failed to resize heap metadata.\n");
+        return;
+    }
+
+    // Update the heap metadata size
+    heap->metadata_size = new_size;
+
+    LOG_TRACE("new heapmetadata size %zu\n", heap->metadata_size);
+    return;
+}
+
+/**
+ * @brief Resize the heap metadata.
+ *
+ * This function resizes the default heap metadata when necessary.
+ */
+void my_resizeheapmetadata()
+{
+    my_heap_resize_metadata(&secmalloc_default_heap);
+}
+
+/**
+ * @brief Take an unused metadata slot of a heap.
+ *
+ * The slots left by merged chunks are taken first, then the slot above the
+ * highest one handed out, so that no scan of the slots is needed.
+ *
+ * @param heap The heap.
+ * @return struct chunkmetadata* A pointer to the slot.
+ */
+static struct chunkmetadata* my_heap_new_slot(struct secmalloc_heap *heap)
+{
+    if (heap->slot_free != 0)
+    {
+        struct chunkmetadata    *item = heap->metadata + heap->slot_free - 1;
+        heap->slot_free = item->next;
+        item->next = 0;
+        return item;
+    }
+    return heap->metadata + heap->fit_count++;
+}
+
+/**
+ * @brief Give back the metadata slot of a chunk removed from the list.
+ *
+ * @param heap The heap.
+ * @param item The chunk, already out of the list and of the fit index.
+ */
+static void my_heap_release_slot(struct secmalloc_heap *heap, struct chunkmetadata *item)
+{
+    memset(item, 0, sizeof(struct chunkmetadata));
+    item->next = heap->slot_free;
+    heap->slot_free = CHUNK_LINK(heap, item);
+}
+
+/**
+ * @brief Resize the data of a heap.
+ *
+ * This function resizes the heap data to the specified new size. The last data
+ * segment grows in place inside its reserved range, and a new segment is added
+ * anywhere in the address space when it is full, so the allocated blocks never move.
+ *
+ * @param heap The heap to resize.
+ * @param new_size The new size for the heap data.
+ */
+void my_heap_resize_data(struct secmalloc_heap *heap, size_t new_size)
+{
+    LOG_TRACE("call resizeheapdata\n");
+
+    // Ensure the current heap data size is valid
+    if (heap->data == NULL) {
+        LOG_ERROR("Error: Heap data is not initialized.\n");
+        return;
+    }
+
+    if (new_size <= heap->data_size)
+    {
+        return;
+    }
+    size_t    delta = new_size - heap->data_size;
+
+    // Get the last metadata block, it gets all the new room when it is free
+    struct chunkmetadata    *last = my_heap_lastmetadata(heap);
+    struct heap_segment     *segment = &heap->segments[heap->nsegments - 1];
+    size_t                  end = segment->size;
+
+    if (segment->size + delta <= segment->reserved)
+    {
+        // Attempt to commit the new size of the last segment
+        size_t    committed = segment->committed;
+        if (my_heap_commit(heap, segment->base, &segment->committed, segment->size + delta, segment->reserved) == -1) {
+            LOG_ERROR("Error: Failed to resize heap data.\n");
+            return;
+        }
+        heap->data_committed += segment->committed - committed;
+        if (my_shadow_commit(segment, committed) == -1)
+        {
+            LOG_ERROR("Error: Failed to resize heap data.\n");
+            return;
+        }
+        segment->size += delta;
+        heap->data_size += delta;
+    }
+    else
+    {
+        // The last segment is full, the new one must hold the free end of the last block too
+        size_t    size = delta + (last->flags == FREE ? last->size : 0);
+        size = ((size + PAGE_HEAP_SIZE - 1) / PAGE_HEAP_SIZE) * PAGE_HEAP_SIZE;
+        segment = my_heap_new_segment(heap, size);
+        if (segment == NULL)
+        {
+            LOG_ERROR("Error: Failed to resize heap data.\n");
+            return;
+        }
+        end = 0;
+        delta = size;
+    }
+
+    size_t    index = segment - heap->segments;
+    if (last->flags == FREE && last->segment == index && last->offset + last->size == end)
+    {
+        last->size += delta;
+        heap->data_covered += delta;
+        my_fit_update(heap, last);
+    }
+    else
+    {
+        // Chain a new free block for the new room
+        struct chunkmetadata    *item = my_heap_new_slot(heap);
+        item->size = delta;
+        item->flags = FREE;
+        item->segment = index;
+        item->offset = end;
+        item->state = CHUNK_FRESH;
+        item->next = 0;
+        last->next = CHUNK_LINK(heap, item);
+        heap->data_covered += delta + sizeof(long);
+        my_fit_update(heap, last);
+        my_fit_update(heap, item);
+    }
+
+    LOG_TRACE("new heapdata size %zu\n", heap->data_size);
+    return;
+}
+
+/**
+ * @brief Resize the heap data.
+ *
+ * This function resizes the default heap data to the specified new size.
+ *
+ * @param new_size The new size for the heap data.
+ */
+void my_resizeheapdata(size_t new_size)
+{
+    my_heap_resize_data(&secmalloc_default_heap, new_size);
+}
+
+/**
+ * @brief Look up a free block with enough size in a heap.
+ *
+ * This function looks up a free block in the heap metadata that is large enough to accommodate the requested size.
+ *
+ * @param heap The heap to search.
+ * @param size The size required for the block.
+ * @return struct chunkmetadata* A pointer to the found free block, or NULL if no block is found.
+ */
+struct chunkmetadata* my_heap_lookup(struct secmalloc_heap *heap, size_t size)
+{
+    LOG_TRACE("call lookup\n");
+    // Check if the heap metadata is initialized
+    if (heap->metadata == NULL) {
+        LOG_ERROR("Error: Heap metadata is not initialized.\n");
+        return NULL;
+    }
+
+    // Scan the free sizes of the slots to find the first suitable free block of the list
+    struct chunkmetadata    *item = my_fit_lookup(heap, size + sizeof(long));
+    if (item != NULL)
+    {
+        LOG_TRACE("Found suitable free block %p pointing to %p of size %zu bytes.\n", item, CHUNK_ADDR(heap, item), item->size);
+        return item; // Return the suitable free block
+    }
+
+    LOG_TRACE("Error: No suitable free block found for size %zu bytes.\n", size);
+    return NULL; // Return NULL if no suitable block is found
+}
+
+/**
+ * @brief Look up a free block with enough size.
+ *
+ * This function looks up a free block in the default heap that is large enough to accommodate the requested size.
+ *
+ * @param size The size required for the block.
+ * @return struct chunkmetadata* A pointer to the found free block, or NULL if no block is found.
+ */
+struct chunkmetadata* my_lookup(size_t size)
+{
+    return my_heap_lookup(&secmalloc_default_heap, size);
+}
+
+/**
+ * @brief Check whether a chunk is followed in memory by another one.
+ *
+ * @param item The first chunk.
+ * @param next The second chunk.
+ * @return int 1 if next starts right after item and its canary in the same segment, 0 otherwise.
+ */
+static int my_contiguous_chunks(struct chunkmetadata *item, struct chunkmetadata *next)
+{
+    return item->segment == next->segment && item->offset + item->size + sizeof(long) == next->offset;
+}
+
+/**
+ * @brief Split a block of a heap into two blocks.
+ *
+ * This function splits a given block into two blocks.
+ *
+ * @param heap The heap owning the block.
+ * @param bloc The block to split.
+ * @param size The size of the first block after the split.
+ * @param canary The canary value to place in the block.
+ */
+void my_heap_split(struct secmalloc_heap *heap, struct chunkmetadata *bloc, size_t size, long canary)
+{
+    LOG_TRACE("call split block %p pointing to %p of size %zu bytes into %zu bytes and %zu bytes.\n", bloc, CHUNK_ADDR(heap, bloc), bloc->size, size, bloc->size - size - sizeof(long));
+    // Check if the block to be split is valid
+    if (bloc == NULL) {
+        LOG_ERROR("Error: Attempted to split a NULL block.\n");
+        return;
+    }
+    // An exact fit leaves no room for a second block, a block of size 0 would
+    // be taken for an unused metadata slot
+    if (bloc->size == size + sizeof(long))
+    {
+        // Only the tail of a segment needs its size to keep the canary inside
+        if (bloc->next == 0 || !my_contiguous_chunks(bloc, CHUNK_NEXT(heap, bloc)))
+        {
+            bloc->size = size;
+            heap->data_covered -= sizeof(long);
+        }
+        bloc->flags = BUSY;
+        bloc->state = CHUNK_USED;
+        CHUNK_COLD(heap, bloc)->canary = canary;
+        my_fit_update(heap, bloc);
+        LOG_TRACE("end split : exact fit, no new block\n");
+        return;
+    }
+
+    // Create new metadata block for the second part
+    struct chunkmetadata    *newbloc = my_heap_new_slot(heap);
+    LOG_TRACE("in split : selected empty new newbloc %p, size = %zu, flags = %d\n", newbloc, newbloc->size, newbloc->flags);
+
+    // Set metadata for the new block
+    newbloc->size = bloc->size - size - sizeof(long);
+    newbloc->flags = FREE;
+    newbloc->segment = bloc->segment;
+    newbloc->offset = bloc->offset + size + sizeof(long);
+    newbloc->state = bloc->state;
+    CHUNK_COLD(heap, newbloc)->freed_at = CHUNK_COLD(heap, bloc)->freed_at; // the canary of the block is replaced below
+    newbloc->next = bloc->next;
+
+    // Set the metadata for the first block
+    // bloc == newbloc should really not happen
+    if (bloc == newbloc)
+    {
+        LOG_ERROR("Error: bloc %p == newbloc %p\n", bloc, newbloc);
+        bloc->next = newbloc->next;
+    }
+    else
+    {
+        // Should always be the case
+        bloc->next = CHUNK_LINK(heap, newbloc);
+    }
+
+    bloc->size = size;
+    bloc->flags = BUSY;
+    bloc->state = CHUNK_USED;
+    CHUNK_COLD(heap, bloc)->canary = canary;
+    my_fit_update(heap, bloc);
+    my_fit_update(heap, newbloc);
+
+    LOG_TRACE("end split : newbloc %p pointing to %p, size = %zu, flags = %d, canary = %ld, next = %p\n", newbloc, CHUNK_ADDR(heap, newbloc), newbloc->size, newbloc->flags, CHUNK_COLD(heap, newbloc)->canary, (void*)CHUNK_NEXT(heap, newbloc));
+    return;
+}
+
+/**
+ * @brief Split a block into two blocks.
+ *
+ * This function splits a given block of the default heap into two blocks.
+ *
+ * @param bloc The block to split.
+ * @param size The size of the first block after the split.
+ * @param canary The canary value to place in the block.
+ */
+void my_split(struct chunkmetadata *bloc, size_t size, long canary)
+{
+    my_heap_split(&secmalloc_default_heap, bloc, size, canary);
+}
+
+/**
+ * @brief Place a canary at the end of a block of a heap.
+ *
+ * This function places a canary value at the end of the specified block.
+ *
+ * @param heap The heap owning the block.
+ * @param bloc The block to place the canary in.
+ * @param canary The canary value to place.
+ */
+void my_heap_place_canary(struct secmalloc_heap *heap, struct chunkmetadata *bloc, long canary)
+{
+    LOG_TRACE("call place_canary\n");
+
+    // Check if the block is valid
+    if (bloc == NULL)
+    {
+        LOG_ERROR("Error: Attempted to place canary in a NULL block.\n");
+        return;
+    }
+    // Calculate the address where the canary should be placed
+    long *canary_ptr = (long*)((size_t)CHUNK_ADDR(heap, bloc) + bloc->size);
+
+    // Place the canary value at the calculated address
+    *canary_ptr = canary;
+
+    LOG_TRACE("Canary placed at %p with value %ld\n", canary_ptr, *canary_ptr);
+    return;
+}
+
+/**
+ * @brief Place a canary at the end of a block.
+ *
+ * This function places a canary value at the end of the specified block of the default heap.
+ *
+ * @param bloc The block to place the canary in.
+ * @param canary The canary value to place.
+ */
+void my_place_canary(struct chunkmetadata *bloc, long canary)
+{
+    my_heap_place_canary(&secmalloc_default_heap, bloc, canary);
+}
+
+/**
+ * @brief Allocate memory of the specified size in a heap.
+ *
+ * This function allocates memory of the specified size and returns a pointer to it.
+ *
+ * @param heap The heap to allocate from.
+ * @param size The size of the memory block to allocate.
+ * @return void* A pointer to the allocated memory, or NULL if the allocation fails.
+ */
+void* my_heap_malloc(struct secmalloc_heap *heap, size_t size)
+{
+    LOG_TRACE("\n\nCALL MALLOC SIZE %zu\n", size);
+
+    // If requested size is 0, return NULL
+    if (size == 0)
+    {
+        return NULL;
+    }
+
+    // The size of a block must fit in its metadata along with its canary
+    if (size > CHUNK_MAX_SIZE - sizeof(long))
+    {
+        LOG_ERROR("Error: Size %zu too large\n", size);
+        return NULL;
+    }
+
+    // Check if the heap data is initialized
+    if (heap->data == NULL)
+    {
+        if (my_heap_init_data(heap) == NULL)
+        {
+            return NULL; // Initialization failed
+        }
+    }
+
+    // Check if the heap metadata is initialized
+    if (heap->metadata == NULL)
+    {
+        if (my_heap_init_metadata(heap) == NULL)
+        {
+            return NULL; // Initialization failed
+        }
+    }
+
+    // Page-sized blocks come from the buddy zone when it is enabled and not full
+    void    *ptr = my_buddy_alloc(heap, size);
+    if (ptr != NULL)
+    {
+        LOG_TRACE("RETURN MALLOC: buddy block %p\n", ptr);
+        return ptr;
+    }
+
+    // A block of the same size freed recently is taken back as it is
+    struct chunkmetadata    *bloc = my_heap_defer_reuse(heap, size);
+    if (bloc != NULL)
+    {
+        long    canary = my_heap_canary(heap);
+        if (canary == -1)
+        {
+            return NULL; // Canary generation failed
+        }
+        if (bloc->state == CHUNK_PURGED)
+        {
+            heap->refaults += my_purged_pages(heap, bloc, size);
+        }
+        bloc->flags = BUSY;
+        bloc->state = CHUNK_USED;
+        CHUNK_COLD(heap, bloc)->canary = canary;
+        CHUNK_COLD(heap, bloc)->site = heap->alloc_site;
+        my_fit_update(heap, bloc);
+        my_heap_place_canary(heap, bloc, canary);
+        LOG_TRACE("RETURN MALLOC: bloc %p bloc->addr %p bloc->size %zu\n", bloc, CHUNK_ADDR(heap, bloc), bloc->size);
+        return CHUNK_ADDR(heap, bloc);
+    }
+
+    // Get the total size of allocated heap metadata and resize if needed
+    size_t    allocated_heapmetadata_size = my_heap_allocated_metadata_size(heap);
+    if (allocated_heapmetadata_size + 3 * sizeof(struct chunkmetadata) > heap->metadata_size)
+    {
+        my_heap_resize_metadata(heap);
+        if (allocated_heapmetadata_size + 3 * sizeof(struct chunkmetadata) > heap->metadata_size)
+        {
+            return NULL; // No room left for the metadata of a new block
+        }
+    }
+
+    // Get the total size of allocated data heap and resize if needed
+    size_t    allocated_heapdata_size = my_heap_allocated_data_size(heap);
+    size_t    needed_size = my_fit_round(size + sizeof(long));
+    size_t    available_size = heap->data_size - allocated_heapdata_size;
+    if (available_size < needed_size)
+    {
+        size_t    new_size = allocated_heapdata_size + needed_size;
+        new_size = ((new_size / PAGE_HEAP_SIZE) + ((new_size % PAGE_HEAP_SIZE != 0) ? 1 : 0)) * PAGE_HEAP_SIZE;
+        my_heap_resize_data(heap, new_size);
+    }
+
+    // Look up a free block with large enough size, merging the deferred frees on a miss
+    bloc = my_heap_lookup(heap, size);
+    if (bloc == NULL && my_heap_defer_flush(heap))
+    {
+        bloc = my_heap_lookup(heap, size);
+    }
+    if (bloc == NULL)
+    {
+        // The free room is split in blocks too small, grow the data by a block the lookup is sure to find
+        my_heap_resize_data(heap, heap->data_size + my_fit_round(needed_size));
+        bloc = my_heap_lookup(heap, size);
+        if (bloc == NULL)
+        {
+            return NULL; // No suitable block found
+        }
+    }
+
+    // Generate a canary
+    long    canary = my_heap_canary(heap);
+    if (canary == -1)
+    {
+        return NULL; // Canary generation failed
+    }
+
+    // Pages given back to the OS will fault again
+    if (bloc->state == CHUNK_PURGED)
+    {
+        heap->refaults += my_purged_pages(heap, bloc, size);
+    }
+
+    // Split the block
+    my_heap_split(heap, bloc, size, canary);
+    CHUNK_COLD(heap, bloc)->site = heap->alloc_site;
+
+    // Place the canary at the end of the block data in heapdata
+    my_heap_place_canary(heap, bloc, canary);
+
+    // Return the address of the data block in heapdata
+    LOG_TRACE("RETURN MALLOC: bloc %p bloc->addr %p bloc->size %zu\n", bloc, CHUNK_ADDR(heap, bloc), bloc->size);
+    return CHUNK_ADDR(heap, bloc);
+}
+
+/**
+ * @brief Allocate memory of the specified size.
+ *
+ * This function allocates memory of the specified size in the default heap, or
+ * in the heap of the NUMA node of the calling thread when the heaps of the
+ * nodes are used, and returns a pointer to it.
+ *
+ * @param size The size of the memory block to allocate.
+ * @return void* A pointer to the allocated memory, or NULL if the allocation fails.
+ */
+void* my_malloc(size_t size)
+{
+    MY_TRACE(TRACE_CALL_MALLOC, 0, size);
+    struct secmalloc_heap    *heap = my_numa_local_heap();
+    if (heap == NULL)
+    {
+        heap = &secmalloc_default_heap;
+    }
+    pthread_mutex_lock(&heap->lock);
+    heap->alloc_site = __builtin_return_address(0);
+    void    *ptr = my_heap_malloc(heap, size);
+    pthread_mutex_unlock(&heap->lock);
+    MY_TRACE(TRACE_RETURN_MALLOC, ptr, 0);
+    return ptr;
+}
+
+/**
+ * @brief Verify the canary value of a block of a heap.
+ *
+ * This function verifies the canary value of the specified block.
+ *
+ * @param heap The heap owning the block.
+ * @param item The block to verify.
+ * @return int Returns 1 if the canary is valid, -1 otherwise.
+ */
+int my_heap_verify_canary(struct secmalloc_heap *heap, struct chunkmetadata *item)
+{
+    LOG_TRACE("Verifying canary\n");
+
+    // Calculate the expected canary value
+    long    expected_canary = CHUNK_COLD(heap, item)->canary;
+
+    // Locate the canary at the end of the block
+    long    *canary = (long*)((size_t)CHUNK_ADDR(heap, item) + item->size);
+
+    // Verify if the canary matches the expected value
+    if (*canary != expected_canary)
+    {
+        LOG_ERROR("Error: Canary verification failed: Expected %ld but found %ld\n", expected_canary, *canary);
+        return -1; // Canary verification failed
+    }
+
+    LOG_TRACE("Canary %ld verified\n", *canary);
+    return 1; // Canary verification successful
+}
+
+/**
+ * @brief Verify the canary value of a block.
+ *
+ * This function verifies the canary value of the specified block of the default heap.
+ *
+ * @param item The block to verify.
+ * @return int Returns 1 if the canary is valid, -1 otherwise.
+ */
+int my_verify_canary(struct chunkmetadata *item)
+{
+    return my_heap_verify_canary(&secmalloc_default_heap, item);
+}
+
+/**
+ * @brief Clean the memory of a block of a heap.
+ *
+ * This function cleans the memory of the specified block by setting it to zero.
+ *
+ * @param heap The heap owning the block.
  * @param item The block to clean.
  */
-void my_clean_memory(struct chunkmetadata *item)
+void my_heap_clean_memory(struct secmalloc_heap *heap, struct chunkmetadata *item)
 {
-    my_log_message("Cleaning memory at %p of size %zu bytes\n", item->addr, item->size);
+    LOG_TRACE("Cleaning memory at %p of size %zu bytes\n", CHUNK_ADDR(heap, item), item->size);
 
     // Set the block's memory to zero
-    memset(item->addr, 0, item->size + sizeof(long));
+    memset(CHUNK_ADDR(heap, item), 0, item->size + sizeof(long));
 
-    my_log_message("Memory cleaned\n");
+    LOG_TRACE("Memory cleaned\n");
 }
 
 /**
- * @brief Merge consecutive free chunks.
+ * @brief Clean the memory of a block.
+ *
+ * This function cleans the memory of the specified block of the default heap.
+ *
+ * @param item The block to clean.
+ */
+void my_clean_memory(struct chunkmetadata *item)
+{
+    my_heap_clean_memory(&secmalloc_default_heap, item);
+}
+
+/**
+ * @brief Combine the states of two merged free chunks.
+ *
+ * A merged chunk holds written pages, with the most recent free time, if any
+ * of its parts does, and is purged if any of its parts is purged.
+ *
+ * @param heap The heap owning the chunks.
+ * @param item The chunk kept by the merge.
+ * @param other The chunk merged into it.
+ */
+static void my_merge_state(struct secmalloc_heap *heap, struct chunkmetadata *item, struct chunkmetadata *other)
+{
+    if (other->state == CHUNK_USED)
+    {
+        if (item->state != CHUNK_USED || CHUNK_COLD(heap, other)->freed_at > CHUNK_COLD(heap, item)->freed_at)
+        {
+            CHUNK_COLD(heap, item)->freed_at = CHUNK_COLD(heap, other)->freed_at;
+        }
+        item->state = CHUNK_USED;
+    }
+    else if (item->state != CHUNK_USED && other->state == CHUNK_PURGED)
+    {
+        item->state = CHUNK_PURGED;
+    }
+}
+
+/**
+ * @brief Merge consecutive free chunks of a heap.
  *
  * This function merges consecutive free chunks in the heap metadata.
+ *
+ * @param heap The heap to merge.
  */
-void my_merge_chunks()
+void my_heap_merge_chunks(struct secmalloc_heap *heap)
 {
-    my_log_message("Call merge chunks\n");
+    LOG_TRACE("Call merge chunks\n");
 
     // Iterate over the heapmetadata to merge free chunks
-    struct chunkmetadata    *item = heapmetadata;
+    struct chunkmetadata    *item = heap->metadata;
     while (item != NULL)
     {
         // If the chunk is free, attempt to merge it with the next free chunks
         if (item->flags == FREE)
         {
-            struct chunkmetadata    *end = item->next;
+            struct chunkmetadata    *end = CHUNK_NEXT(heap, item);
             size_t                  new_size = item->size;
             int                     count = 0;
 
-            // Merge consecutive free chunks
-            while (end != NULL && end->flags == FREE)
+            // Merge consecutive free chunks, chunks of different segments are not contiguous
+            while (end != NULL && end->flags == FREE && my_contiguous_chunks(item, end))
             {
                 struct chunkmetadata *next = end;
-                my_log_message("Merging chunk at %p with next chunk at %p\n", item->addr, next->addr);
-                if (end->next != NULL)
-                {
-                    new_size += next->size + sizeof(long); // add the size of the canary
-                }
-                else
-                {
-                    new_size += next->size;
-                }
+                LOG_TRACE("Merging chunk at %p with next chunk at %p\n", CHUNK_ADDR(heap, item), CHUNK_ADDR(heap, next));
+                new_size += next->size + sizeof(long); // add the size of the canary
                 count++;
-                end = next->next;
+                end = CHUNK_NEXT(heap, next);
                 item->size = new_size;
-                item->next = end;
+                item->next = next->next;
+                my_merge_state(heap, item, next);
+                my_fit_clear(heap, next);
+                my_heap_release_slot(heap, next);
             }
 
             // Update the size of the merged chunk
             // Log the number of chunks merged
             if (count > 0)
             {
-                my_log_message("%d chunks merged\n", count);
+                LOG_TRACE("%d chunks merged\n", count);
             }
         }
-        item = item->next;
+
+        // The walk refreshes the free size of every slot of the list
+        my_fit_update(heap, item);
+        item = CHUNK_NEXT(heap, item);
     }
 
-    my_log_message("return merge chunk\n");
+    LOG_TRACE("return merge chunk\n");
     return;
 }
 
+#if TLSF
 /**
- * @brief Free a block of memory.
+ * @brief Merge a free chunk with its free neighbours.
+ *
+ * This function merges the chunk with the next and the previous chunks when
+ * they are free and contiguous, in constant time rather than walking the list.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The chunk.
+ */
+static void my_heap_merge_neighbours(struct secmalloc_heap *heap, struct chunkmetadata *item)
+{
+    struct chunkmetadata    *next = CHUNK_NEXT(heap, item);
+    if (next != NULL && next->flags == FREE && my_contiguous_chunks(item, next))
+    {
+        LOG_TRACE("Merging chunk at %p with next chunk at %p\n", CHUNK_ADDR(heap, item), CHUNK_ADDR(heap, next));
+        item->size += next->size + sizeof(long); // add the size of the canary
+        item->next = next->next;
+        my_merge_state(heap, item, next);
+        my_fit_clear(heap, next);
+        my_heap_release_slot(heap, next);
+    }
+
+    struct chunkmetadata    *prev = my_fit_prev(heap, item);
+    if (prev != NULL && prev->flags == FREE && my_contiguous_chunks(prev, item))
+    {
+        LOG_TRACE("Merging chunk at %p with next chunk at %p\n", CHUNK_ADDR(heap, prev), CHUNK_ADDR(heap, item));
+        prev->size += item->size + sizeof(long); // add the size of the canary
+        prev->next = item->next;
+        my_merge_state(heap, prev, item);
+        my_fit_clear(heap, item);
+        my_heap_release_slot(heap, item);
+        item = prev;
+    }
+    my_fit_update(heap, item);
+}
+#endif
+
+/**
+ * @brief Merge consecutive free chunks.
+ *
+ * This function merges consecutive free chunks in the default heap metadata.
+ */
+void my_merge_chunks()
+{
+    my_heap_merge_chunks(&secmalloc_default_heap);
+}
+
+/**
+ * @brief Make a freed block of a heap reusable.
+ *
+ * This function marks the block as free and merges it with the free blocks
+ * around it.
+ *
+ * @param heap The heap owning the block.
+ * @param item The block, cleaned.
+ */
+void my_heap_release(struct secmalloc_heap *heap, struct chunkmetadata *item)
+{
+    // Mark the chunk as free
+    item->flags = FREE;
+    item->state = CHUNK_USED;
+    CHUNK_COLD(heap, item)->freed_at = my_now_ms();
+
+    // Merge consecutive free chunks, or leave it to a batch when it is deferred
+    if (my_defer_threshold() > 0)
+    {
+        my_heap_defer_free(heap, item);
+    }
+    else
+    {
+#if TLSF
+        my_heap_merge_neighbours(heap, item);
+#else
+        my_heap_merge_chunks(heap);
+#endif
+    }
+}
+
+/**
+ * @brief Free a block of memory of a heap.
  *
  * This function frees the specified block of memory.
  *
+ * @param heap The heap owning the block.
  * @param ptr A pointer to the memory block to free.
  */
-void my_free(void *ptr)
+void my_heap_free(struct secmalloc_heap *heap, void *ptr)
 {
-    my_log_message("\n\nCALL FREE PTR %p\n", ptr);
+    LOG_TRACE("\n\nCALL FREE PTR %p\n", ptr);
 
     // Check if the heaps is initialized
-    if (heapdata == NULL || heapmetadata == NULL)
+    if (heap->data == NULL || heap->metadata == NULL)
     {
-        my_log_message("Error: Heap not initialized\n");
+        LOG_ERROR("Error: Heap not initialized\n");
         return;
     }
 
     // If ptr is NULL, log an error and return
     if (ptr == NULL)
     {
-        my_log_message("Error: Invalid pointer to free: NULL\n");
+        LOG_ERROR("Error: Invalid pointer to free: NULL\n");
         return;
     }
 
-    // Verify if ptr is one of the addresses where we allocated memory
-    for (struct chunkmetadata *item = heapmetadata; item != NULL; item = item->next)
+    // Blocks of the buddy zone are found from their address
+    if (my_buddy_owns(heap, ptr))
     {
-        // If ptr matches an allocated address in heapmetadata, proceed to free it
-        if (item->addr == ptr)
-        {
-            my_log_message("Found metadata block %p corresponding to ptr %p\n", item, ptr);
+        my_buddy_free(heap, ptr);
+        LOG_TRACE("RETURN FREE\n");
+        return;
+    }
 
-            // If the chunk is already free, log an error and return
-            if (item->flags == FREE)
-            {
-                my_log_message("Error: Double free\n");
-                return;
-            }
+    // Classify the pointer from the shadow of the data rather than walking the blocks
+    struct chunkmetadata    *item;
+    enum shadow_state       state = my_shadow_classify(heap, ptr, &item);
+    if (state == SHADOW_FOREIGN)
+    {
+        LOG_ERROR("Error: Invalid pointer to free: not in the heap\n");
+        return;
+    }
+    if (state == SHADOW_INTERIOR)
+    {
+        LOG_ERROR("Error: Invalid pointer to free: not the start of a block\n");
+        return;
+    }
+    LOG_TRACE("Found metadata block %p corresponding to ptr %p\n", item, ptr);
 
-            // If the canary is not the one we expect we log an error
-            if (my_verify_canary(item) == -1)
-            {
-                my_log_message("Error: Canary verification failed : Buffer overflow detected\n");
-            }
+    // If the chunk is already free, log an error and return
+    if (state == SHADOW_FREE)
+    {
+        LOG_ERROR("Error: Double free\n");
+        return;
+    }
+
+    // If the canary is not the one we expect we log an error
+    if (my_config()->canary && my_heap_verify_canary(heap, item) == -1)
+    {
+        LOG_ERROR("Error: Canary verification failed : Buffer overflow detected in the block allocated from %p\n", CHUNK_COLD(heap, item)->site);
+    }
 
-            // Clean the memory before marking it as free
-            my_clean_memory(item);
+    // Clean the memory before marking it as free, the quarantine needs it to detect writes after free
+    if (my_config()->scrub || my_quarantine_percent() > 0)
+    {
+        my_heap_clean_memory(heap, item);
+    }
 
-            // Mark the chunk as free
-            item->flags = FREE;
+    // Hold the chunk in quarantine before it can be reused, or release it right away
+    if (my_quarantine_percent() > 0)
+    {
+        my_heap_quarantine(heap, item);
+    }
+    else
+    {
+        my_heap_release(heap, item);
+    }
 
-            // Merge consecutive free chunks
-            my_merge_chunks();
+#if !TLSF
+    // Give back to the OS the free pages that decayed, TLSF leaves it to the thread or to secmalloc_purge to bound the free
+    my_heap_purge_maybe(heap);
+#endif
 
-            // Log the event
+    LOG_TRACE("RETURN FREE\n");
+    return;
+}
 
-            my_log_message("RETURN FREE\n");
-            return;
-        }
+/**
+ * @brief Free a block of memory.
+ *
+ * This function frees the specified block of memory of the default heap, or of
+ * the heap of the NUMA node owning it.
+ *
+ * @param ptr A pointer to the memory block to free.
+ */
+void my_free(void *ptr)
+{
+    MY_TRACE(TRACE_CALL_FREE, ptr, 0);
+    struct secmalloc_heap    *heap = my_numa_owner(ptr);
+    if (heap == NULL)
+    {
+        heap = &secmalloc_default_heap;
     }
-
-    // If ptr is not found in the heap, log an error
-    my_log_message("Error: Invalid pointer to free: not in the heap\n");
-    return;
+    pthread_mutex_lock(&heap->lock);
+    my_heap_free(heap, ptr);
+    pthread_mutex_unlock(&heap->lock);
+    MY_TRACE(TRACE_RETURN_FREE, 0, 0);
 }
 
 /**
@@ -658,7 +1692,10 @@ void my_free(void *ptr)
  */
 void* my_calloc(size_t nmemb, size_t size)
 {
-    my_log_message("\n\nCALL CALLOC nmemb %zu, size %zu\n", nmemb, size);
+    LOG_TRACE("\n\nCALL CALLOC nmemb %zu, size %zu\n", nmemb, size);
+    MY_TRACE(TRACE_CALL_CALLOC, nmemb, size);
+
+    pthread_mutex_lock(&secmalloc_default_heap.lock);
 
     // Check if the heap data is initialized
     if (heapdata == NULL)
@@ -672,9 +1709,12 @@ void* my_calloc(size_t nmemb, size_t size)
         my_init_heapmetadata();
     }
 
+    pthread_mutex_unlock(&secmalloc_default_heap.lock);
+
     // If the number of elements or size is zero, return NULL
     if (nmemb == 0 || size == 0)
     {
+        MY_TRACE(TRACE_RETURN_CALLOC, NULL, 0);
         return NULL;
     }
 
@@ -687,6 +1727,7 @@ void* my_calloc(size_t nmemb, size_t size)
     // If allocation failed, return NULL
     if (ptr == NULL)
     {
+        MY_TRACE(TRACE_RETURN_CALLOC, NULL, 0);
         return NULL;
     }
 
@@ -694,23 +1735,21 @@ void* my_calloc(size_t nmemb, size_t size)
     memset(ptr, 0, total_size);
 
     // Return the pointer to the allocated and zero-initialized memory
-    my_log_message("RETURN CALLOC : %p\n", ptr);
+    LOG_TRACE("RETURN CALLOC : %p\n", ptr);
+    MY_TRACE(TRACE_RETURN_CALLOC, ptr, 0);
     return ptr;
 }
 
 /**
- * @brief Reallocate memory.
- *
- * This function reallocates the specified block of memory to the new size.
+ * @brief Reallocate memory of the default heap, the lock of the heap being held.
  *
  * @param ptr A pointer to the memory block to reallocate.
  * @param size The new size of the memory block.
  * @return void* A pointer to the reallocated memory, or NULL if the reallocation fails.
  */
-
-void* my_realloc(void *ptr, size_t size)
+static void* my_realloc_locked(void *ptr, size_t size)
 {
-    my_log_message("\n\nCALL REALLOC ptr %p, size %zu\n", ptr, size);
+    LOG_TRACE("\n\nCALL REALLOC ptr %p, size %zu\n", ptr, size);
 
     // Check if the heap data is initialized
     if (heapdata == NULL)
@@ -736,88 +1775,617 @@ void* my_realloc(void *ptr, size_t size)
         my_free(ptr);
         return  NULL;
     }
-	
 
-    for (struct chunkmetadata *item = heapmetadata; item != NULL; item = item->next)
+    // Blocks of the buddy zone are moved to a new block
+    if (my_buddy_owns(&secmalloc_default_heap, ptr))
+    {
+        size_t    old_size = my_buddy_size(&secmalloc_default_heap, ptr);
+        if (old_size == 0)
+        {
+            LOG_ERROR("Error : invalid pointer to realloc : not in the heap\n");
+            return NULL;
+        }
+
+        void    *new_ptr = my_malloc(size);
+        if (new_ptr == NULL)
+        {
+            return NULL;
+        }
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        my_free(ptr);
+
+        LOG_TRACE("RETURN REALLOC : %p\n", new_ptr);
+        return new_ptr;
+    }
+
+    // Classify the pointer from the shadow of the data rather than walking the blocks
+    struct chunkmetadata    *item;
+    enum shadow_state       state = my_shadow_classify(&secmalloc_default_heap, ptr, &item);
+    if (state == SHADOW_FREE)
+    {
+        LOG_ERROR("Error : invalid pointer to realloc : already free\n");
+        return NULL;
+    }
+    if (state != SHADOW_BUSY)
+    {
+        LOG_ERROR("Error : invalid pointer to realloc : not in the heap\n");
+        return NULL;
+    }
+    LOG_TRACE("Found metadata block %p corresponding to ptr %p\n", item, ptr);
+
+    if (my_config()->canary && my_verify_canary(item) == -1)
+    {
+        LOG_ERROR("Error: Canary verification failed : Buffer overflow detected\n");
+    }
+
+    if (size == item->size)
+    {
+        LOG_TRACE("RETURN REALLOC : %p\n", ptr);	
+        return ptr;
+    }
+
+    /* // Locate the canary at the end of the block */
+    /* #<{(| long    canary = *(long*)((size_t)item->addr + item->size); |)}># */
+    /* long canary = item->canary; */
+    /*  */
+    /*  */
+    /*  */
+    /*  */
+    /* // if < size realloc with taille plus petite */
+    /* if (size < item->size) */
+    /* { */
+    /*     // Split l'item */
+    /*     my_split(item, size, canary); */
+    /*  */
+    /*     // Place the canary at the end of the block data in heapdata */
+    /*     my_place_canary(item, canary); */
+    /*  */
+    /* 	my_merge_chunks(); */
+    /*  */
+    /* 	my_log_message("RETURN REALLOC : %p\n", item->addr); */
+    /*     return item->addr; */
+    /* } */
+    /*  */
+    /* // if > size realloc with taille plus grande */
+    /* if (size > item->size) */
+    /* { */
+    /*     // If free */
+    /*     if (item->next->flags == FREE) */
+    /*     { */
+    /*         if (size < item->size + item->next->size) */
+    /*         { */
+    /*  */
+    /* 			// set metadata for the next item */
+    /* 			item->next->addr = (void*)((size_t)item->addr + size + sizeof(long));  */
+    /*             item->next->size = item->next->size + item->size - size; */
+    /*  */
+    /* 			// Set metadata for the new item */
+    /*             item->size = size; */
+    /*  */
+    /*             // Place the canary at the end of the block data in heapdata */
+    /*             my_place_canary(item, canary); */
+    /*  */
+    /* 			my_log_message("RETURN REALLOC : %p\n", item->addr); */
+    /*             return item->addr; */
+    /*         } */
+    /*     } */
+    /* } */
+
+    size_t    old_size = item->size;
+    void      *new_ptr = my_malloc(size);
+
+    if (new_ptr == NULL)
+    {
+        return NULL;
+    }
+
+    // Only the old block is copied, reading past it could cross the committed end of the heap
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    my_free(ptr);
+
+    LOG_TRACE("RETURN REALLOC : %p\n", new_ptr);;
+    return new_ptr;
+}
+
+/**
+ * @brief Reallocate memory.
+ *
+ * This function reallocates the specified block of memory to the new size.
+ *
+ * @param ptr A pointer to the memory block to reallocate.
+ * @param size The new size of the memory block.
+ * @return void* A pointer to the reallocated memory, or NULL if the reallocation fails.
+ */
+void* my_realloc(void *ptr, size_t size)
+{
+    MY_TRACE(TRACE_CALL_REALLOC, ptr, size);
+    struct secmalloc_heap    *heap = ptr == NULL ? NULL : my_numa_owner(ptr);
+    void                     *new_ptr;
+    if (heap != NULL)
+    {
+        new_ptr = my_numa_realloc(heap, ptr, size);
+    }
+    else
+    {
+        pthread_mutex_lock(&secmalloc_default_heap.lock);
+        new_ptr = my_realloc_locked(ptr, size);
+        pthread_mutex_unlock(&secmalloc_default_heap.lock);
+    }
+    MY_TRACE(TRACE_RETURN_REALLOC, new_ptr, 0);
+    return new_ptr;
+}
+
+
+/**
+ * @brief Create a private heap.
+ *
+ * This function reserves a new pair of data and metadata regions, independent
+ * from the default heap and from any other private heap.
+ *
+ * @return struct secmalloc_heap* A pointer to the new heap, or NULL if the creation fails.
+ */
+struct secmalloc_heap* secmalloc_heap_create()
+{
+    LOG_TRACE("\n\nCALL HEAP CREATE\n");
+
+    // The heap descriptor lives in its own mapping, we can not use malloc here
+    struct secmalloc_heap    *heap = mmap(NULL, sizeof(struct secmalloc_heap), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (heap == MAP_FAILED)
+    {
+        perror("mmap");
+        LOG_ERROR("Error: Failed to mmap memory for heap descriptor.\n");
+        return NULL;
+    }
+
+    heap->nsegments = 0;
+    heap->data = NULL;
+    heap->metadata = NULL;
+    heap->data_size = PAGE_HEAP_SIZE;
+    heap->metadata_size = PAGE_HEAP_SIZE;
+    heap->data_committed = 0;
+    heap->metadata_committed = 0;
+    heap->growth_syscalls = 0;
+    heap->purged_bytes = 0;
+    heap->refaults = 0;
+    heap->last_purge = 0;
+    heap->node = -1;
+    heap->buddy = NULL;
+    heap->fit_sizes = NULL;
+    heap->fit_count = 0;
+    heap->slot_free = 0;
+    heap->last_chunk = 0;
+    heap->data_covered = 0;
+    heap->fit_committed = 0;
+    heap->fit_unordered = 0;
+    heap->fit_nodes = NULL;
+    heap->cold = NULL;
+
+    pthread_mutexattr_t    attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&heap->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    // Data must be mapped first, the first metadata block points to it
+    if (my_heap_init_data(heap) == NULL || my_heap_init_metadata(heap) == NULL)
+    {
+        secmalloc_heap_destroy(heap);
+        return NULL;
+    }
+
+    LOG_TRACE("RETURN HEAP CREATE : %p\n", heap);
+    return heap;
+}
+
+/**
+ * @brief Allocate memory in a private heap.
+ *
+ * @param heap The heap to allocate from.
+ * @param size The size of the memory block to allocate.
+ * @return void* A pointer to the allocated memory, or NULL if the allocation fails.
+ */
+void* secmalloc_heap_alloc(struct secmalloc_heap *heap, size_t size)
+{
+    if (heap == NULL)
+    {
+        LOG_ERROR("Error: Invalid heap to alloc from: NULL\n");
+        return NULL;
+    }
+    pthread_mutex_lock(&heap->lock);
+    heap->alloc_site = __builtin_return_address(0);
+    void    *ptr = my_heap_malloc(heap, size);
+    pthread_mutex_unlock(&heap->lock);
+    return ptr;
+}
+
+/**
+ * @brief Free memory of a private heap.
+ *
+ * @param heap The heap owning the block.
+ * @param ptr A pointer to the memory block to free.
+ */
+void secmalloc_heap_free(struct secmalloc_heap *heap, void *ptr)
+{
+    if (heap == NULL)
+    {
+        LOG_ERROR("Error: Invalid heap to free from: NULL\n");
+        return;
+    }
+    pthread_mutex_lock(&heap->lock);
+    my_heap_free(heap, ptr);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/**
+ * @brief Destroy a private heap.
+ *
+ * This function releases every block of the heap at once by unmapping the
+ * ranges reserved for its data segments and metadata, no individual free is needed.
+ *
+ * @param heap The heap to destroy.
+ */
+void secmalloc_heap_destroy(struct secmalloc_heap *heap)
+{
+    LOG_TRACE("\n\nCALL HEAP DESTROY %p\n", heap);
+
+    if (heap == NULL || heap == &secmalloc_default_heap)
+    {
+        LOG_ERROR("Error: Invalid heap to destroy\n");
+        return;
+    }
+
+    // Every block lives in one of the segments
+    for (size_t i = 0; i < heap->nsegments; i++)
+    {
+        if (munmap(heap->segments[i].base, heap->segments[i].reserved) == -1 || munmap(heap->segments[i].shadow, my_shadow_reserved(&heap->segments[i])) == -1)
+        {
+            perror("munmap");
+            LOG_ERROR("Error: Failed to munmap heap data.\n");
+        }
+    }
+
+    if (heap->metadata != NULL && (munmap(heap->metadata, MAX_METADATA_SIZE) == -1 || munmap(heap->fit_sizes, FIT_SIZES_SIZE) == -1 || munmap(heap->fit_nodes, FIT_NODES_SIZE) == -1 || munmap(heap->cold, COLD_SIZE) == -1))
+    {
+        perror("munmap");
+        LOG_ERROR("Error: Failed to munmap heap metadata.\n");
+    }
+    my_buddy_destroy(heap);
+
+    pthread_mutex_destroy(&heap->lock);
+    munmap(heap, sizeof(struct secmalloc_heap));
+    LOG_TRACE("RETURN HEAP DESTROY\n");
+}
+
+/**
+ * @brief Get the memory of a heap backed by huge pages.
+ *
+ * This function sums the huge pages the kernel reports in /proc/self/smaps
+ * for the mappings of the data segments and metadata of the heap.
+ *
+ * @param heap The heap to inspect.
+ * @return size_t The size of the heap backed by huge pages.
+ */
+static size_t my_heap_hugepage_bytes(struct secmalloc_heap *heap)
+{
+    if (my_growth_policy()->hugepage == HUGEPAGE_NONE || heap->metadata == NULL)
+    {
+        return 0;
+    }
+
+    FILE    *smaps = fopen("/proc/self/smaps", "r");
+    if (smaps == NULL)
+    {
+        LOG_ERROR("Error: Failed to open /proc/self/smaps.\n");
+        return 0;
+    }
+
+    size_t    total = 0;
+    int       inside = 0;
+    char      line[256];
+    while (fgets(line, sizeof(line), smaps) != NULL)
     {
-        if (item->addr == ptr)
+        size_t    start;
+        size_t    end;
+        size_t    kb;
+        if (sscanf(line, "%zx-%zx ", &start, &end) == 2)
         {
-			my_log_message("Found metadata block %p corresponding to ptr %p\n", item, ptr);
-            
-            if (my_verify_canary(item) == -1)
+            // A new mapping, check whether it is part of the heap
+            inside = start >= (size_t)heap->metadata && end <= (size_t)heap->metadata + MAX_METADATA_SIZE;
+            for (size_t i = 0; i < heap->nsegments && !inside; i++)
             {
-                my_log_message("Error: Canary verification failed : Buffer overflow detected\n");
+                inside = start >= (size_t)heap->segments[i].base && end <= (size_t)heap->segments[i].base + heap->segments[i].reserved;
             }
+        }
+        else if (inside && (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1 || sscanf(line, "Private_Hugetlb: %zu kB", &kb) == 1))
+        {
+            total += kb * 1024;
+        }
+    }
+    fclose(smaps);
+    return total;
+}
+
+/**
+ * @brief Get the statistics of a heap.
+ *
+ * @param heap The heap to inspect, or NULL for the default heap.
+ * @param stats The structure filled with the statistics.
+ */
+void secmalloc_heap_stats(struct secmalloc_heap *heap, struct secmalloc_stats *stats)
+{
+    if (heap == NULL)
+    {
+        heap = &secmalloc_default_heap;
+    }
+
+    stats->data_size = heap->data ? heap->data_size : 0;
+    stats->metadata_size = heap->metadata ? heap->metadata_size : 0;
+    stats->committed = heap->data_committed + heap->metadata_committed + (heap->buddy ? heap->buddy->blocks * BUDDY_BLOCK_SIZE : 0);
+    stats->growth_syscalls = heap->growth_syscalls;
+    stats->purged_bytes = heap->purged_bytes;
+    stats->refaults = heap->refaults;
+    stats->hugepage_bytes = my_heap_hugepage_bytes(heap);
+    stats->quarantine_bytes = heap->quarantine_bytes;
+    stats->use_after_free = heap->use_after_free;
+}
+
+/**
+ * @brief Give back to the OS the free memory of a heap.
+ *
+ * This function unmaps the last data segments holding only a free block,
+ * shrinks the free block at the end of the data to the specified pad, purges
+ * the pages of the other free blocks, and decommits the metadata pages above
+ * the last used slot.
+ *
+ * @param heap The heap to trim.
+ * @param pad The free space to keep at the end of the heap data.
+ * @return size_t The number of bytes released.
+ */
+size_t my_heap_trim(struct secmalloc_heap *heap, size_t pad)
+{
+    LOG_TRACE("call heap_trim with pad %zu\n", pad);
+
+    if (heap->data == NULL || heap->metadata == NULL)
+    {
+        return 0;
+    }
+
+    // The free blocks must be released and merged to find the free end of the data
+    my_heap_quarantine_flush(heap);
+    my_heap_defer_flush(heap);
+
+    size_t                  released = 0;
+    struct chunkmetadata    *last = my_heap_lastmetadata(heap);
+    struct heap_segment     *segment = &heap->segments[heap->nsegments - 1];
+
+    // Unmap the last segments when a single free block covers them
+    while (pad == 0 && heap->nsegments > 1 && last->flags == FREE && last->segment == heap->nsegments - 1 && last->offset == 0)
+    {
+        struct chunkmetadata    *prev = heap->metadata;
+        while (CHUNK_NEXT(heap, prev) != last)
+        {
+            prev = CHUNK_NEXT(heap, prev);
+        }
+        if (munmap(segment->base, segment->reserved) == -1)
+        {
+            perror("munmap");
+            LOG_ERROR("Error: Failed to munmap heap segment.\n");
+            break;
+        }
+        prev->next = 0;
+        heap->data_covered -= last->size + sizeof(long);
+        my_fit_clear(heap, last);
+        my_heap_release_slot(heap, last);
+        munmap(segment->shadow, my_shadow_reserved(segment));
+        released += segment->committed;
+        heap->data_size -= segment->size;
+        heap->data_committed -= segment->committed;
+        heap->nsegments--;
+        last = prev;
+        segment = &heap->segments[heap->nsegments - 1];
+        my_fit_update(heap, last);
+    }
+
+    // Shrink the free block at the end of the data, a block of size 0 would be taken for an unused slot
+    size_t    granule = my_page_granule();
+    size_t    base = (size_t)segment->base;
+    size_t    keep = pad > 0 ? pad : 1;
+    size_t    end = ((size_t)CHUNK_ADDR(heap, last) + keep + granule - 1) & ~(granule - 1);
+    if (last->flags == FREE && last->size > keep && end < base + segment->size)
+    {
+        last->size -= base + segment->size - end;
+        heap->data_covered -= base + segment->size - end;
+        my_fit_update(heap, last);
+        heap->data_size -= base + segment->size - end;
+        segment->size = end - base;
+    }
+
+    // Decommit what the growth policy committed above the end of the data
+    end = ((base + segment->size + granule - 1) / granule) * granule;
+    if (end < base + segment->committed && my_decommit((void*)end, base + segment->committed - end) == 0)
+    {
+        released += base + segment->committed - end;
+        heap->data_committed -= base + segment->committed - end;
+        segment->committed = end - base;
+    }
+
+    // Purge the pages of the free blocks left
+    released += my_heap_purge(heap, 0);
+
+    // Decommit the metadata above the last used slot
+    struct chunkmetadata    *highest = heap->metadata;
+    for (struct chunkmetadata *item = heap->metadata; item != NULL; item = CHUNK_NEXT(heap, item))
+    {
+        if (item > highest)
+        {
+            highest = item;
+        }
+    }
+    size_t    used = (size_t)(highest + 1) - (size_t)heap->metadata;
+    size_t    size = ((used + sizeof(struct chunkmetadata) + granule - 1) / granule) * granule;
+    if (size > heap->metadata_committed)
+    {
+        size = heap->metadata_committed;
+    }
 
-			if (size == item->size)
-			{
-				my_log_message("RETURN REALLOC : %p\n", ptr);	
-				return ptr;
-			}
-
-            /* // Locate the canary at the end of the block */
-            /* #<{(| long    canary = *(long*)((size_t)item->addr + item->size); |)}># */
-			/* long canary = item->canary; */
-			/*  */
-	        /*  */
-		    /*  */
-            /*  */
-            /* // if < size realloc with taille plus petite */
-            /* if (size < item->size) */
-            /* { */
-            /*     // Split l'item */
-            /*     my_split(item, size, canary); */
-            /*  */
-            /*     // Place the canary at the end of the block data in heapdata */
-            /*     my_place_canary(item, canary); */
-            /*  */
-			/* 	my_merge_chunks(); */
-            /*  */
-			/* 	my_log_message("RETURN REALLOC : %p\n", item->addr); */
-            /*     return item->addr; */
-            /* } */
-            /*  */
-            /* // if > size realloc with taille plus grande */
-            /* if (size > item->size) */
-            /* { */
-            /*     // If free */
-            /*     if (item->next->flags == FREE) */
-            /*     { */
-            /*         if (size < item->size + item->next->size) */
-            /*         { */
-            /*  */
-			/* 			// set metadata for the next item */
-			/* 			item->next->addr = (void*)((size_t)item->addr + size + sizeof(long));  */
-            /*             item->next->size = item->next->size + item->size - size; */
-            /*  */
-			/* 			// Set metadata for the new item */
-            /*             item->size = size; */
-            /*  */
-            /*             // Place the canary at the end of the block data in heapdata */
-            /*             my_place_canary(item, canary); */
-            /*  */
-			/* 			my_log_message("RETURN REALLOC : %p\n", item->addr); */
-            /*             return item->addr; */
-            /*         } */
-            /*     } */
-            /* } */
-
-            void *new_ptr = my_malloc(size);
-
-            if (new_ptr == NULL)
+    // The slots above the last used one are handed out again from the first one, the free ones below are chained again
+    memset(highest + 1, 0, size - used);
+    heap->fit_count = highest + 1 - heap->metadata;
+    heap->slot_free = 0;
+    for (struct chunkmetadata *item = highest; item > heap->metadata; item--)
+    {
+        if (item->size == 0)
+        {
+            my_heap_release_slot(heap, item);
+        }
+    }
+    if (size < heap->metadata_committed && my_decommit((void*)((size_t)heap->metadata + size), heap->metadata_committed - size) == 0)
+    {
+        released += heap->metadata_committed - size;
+        heap->metadata_committed = size;
+        if (heap->metadata_size > size)
+        {
+            heap->metadata_size = size;
+        }
+    }
+
+    LOG_TRACE("return trimmed %zu bytes\n", released);
+    return released;
+}
+
+/**
+ * @brief Give back to the OS the free memory of the default heap.
+ *
+ * @param pad The free space to keep at the end of the heap data.
+ * @return size_t The number of bytes released.
+ */
+size_t secmalloc_trim(size_t pad)
+{
+    LOG_TRACE("\n\nCALL TRIM pad %zu\n", pad);
+
+    pthread_mutex_lock(&secmalloc_default_heap.lock);
+    size_t    released = my_heap_trim(&secmalloc_default_heap, pad);
+    pthread_mutex_unlock(&secmalloc_default_heap.lock);
+
+    LOG_TRACE("RETURN TRIM : %zu\n", released);
+    return released;
+}
+
+/**
+ * @brief Prepare the default heap for a latency-critical phase.
+ *
+ * This function grows the heap data so that its free end holds at least the
+ * specified size, and faults in the pages of that free end, so that the next
+ * allocations neither grow the heap nor take a page fault.
+ *
+ * @param size The size to prepare.
+ * @return int 0 on success, -1 on failure.
+ */
+int secmalloc_prewarm(size_t size)
+{
+    LOG_TRACE("\n\nCALL PREWARM size %zu\n", size);
+
+    pthread_mutex_lock(&secmalloc_default_heap.lock);
+    struct secmalloc_heap    *heap = &secmalloc_default_heap;
+    if (my_heap_init_data(heap) == NULL || my_heap_init_metadata(heap) == NULL)
+    {
+        pthread_mutex_unlock(&heap->lock);
+        return -1;
+    }
+
+    // Room for the blocks and their canaries at the end of the heap data, as the lookup sees it
+    size_t    needed = my_fit_round(size + sizeof(long));
+    size_t    allocated = my_heap_allocated_data_size(heap);
+    if (heap->data_size - allocated < needed)
+    {
+        my_heap_resize_data(heap, allocated + needed);
+    }
+
+    struct chunkmetadata    *last = my_heap_lastmetadata(heap);
+    int                     ret = -1;
+    if (last->flags == FREE && last->size >= needed)
+    {
+        ret = my_populate(CHUNK_ADDR(heap, last), needed);
+        last->state = CHUNK_FRESH; // the purge must not undo the prewarm
+
+    }
+    pthread_mutex_unlock(&heap->lock);
+
+    LOG_TRACE("RETURN PREWARM : %d\n", ret);
+    return ret;
+}
+
+/**
+ * @brief Prepare the default heap for the size classes of a latency-critical phase.
+ *
+ * This function grows the heap and faults in its pages for every block of
+ * the classes at once, then splits the first blocks of each class the
+ * quick-reuse cache holds and leaves them free in the cache, so that the
+ * first allocations of the class take them without a lookup nor a split.
+ * The blocks past the depth of the cache, or of the classes too large for it,
+ * are split from the prepared end of the heap.
+ *
+ * @param classes The size classes and their numbers of blocks.
+ * @param count The number of classes.
+ * @return int 0 on success, -1 on failure.
+ */
+int secmalloc_prewarm_classes(const struct secmalloc_prewarm_class *classes, size_t count)
+{
+    LOG_TRACE("\n\nCALL PREWARM CLASSES %p count %zu\n", classes, count);
+
+    // Room for every block of every class along with its canary
+    size_t    total = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (classes[i].size == 0 || classes[i].size > CHUNK_MAX_SIZE - sizeof(long))
+        {
+            LOG_ERROR("Error: Invalid size %zu to prewarm\n", classes[i].size);
+            return -1;
+        }
+        total += classes[i].count * (classes[i].size + sizeof(long));
+    }
+    if (secmalloc_prewarm(total) == -1)
+    {
+        return -1;
+    }
+
+    struct secmalloc_heap    *heap = &secmalloc_default_heap;
+    int                      ret = 0;
+    pthread_mutex_lock(&heap->lock);
+    for (size_t i = 0; i < count && ret == 0; i++)
+    {
+        // Split the blocks first, a block seeded right away would be taken back by the next one
+        struct chunkmetadata    *blocks[DEFER_BIN_DEPTH];
+        size_t                  wanted = my_heap_defer_room(heap, classes[i].size);
+        size_t                  split = 0;
+        wanted = wanted < classes[i].count ? wanted : classes[i].count;
+        while (split < wanted)
+        {
+            void    *ptr = my_heap_malloc(heap, classes[i].size);
+            if (ptr == NULL)
             {
-                return NULL;
+                ret = -1;
+                break;
             }
+            if (my_shadow_classify(heap, ptr, &blocks[split]) != SHADOW_BUSY)
+            {
+                my_heap_free(heap, ptr); // served by the buddy zone, not cached
+                break;
+            }
+            split++;
+        }
 
-            memcpy(new_ptr, ptr, size);
-            my_free(ptr);
-
-            my_log_message("RETURN REALLOC : %p\n", new_ptr);;
-            return new_ptr;
+        for (size_t j = 0; j < split; j++)
+        {
+            blocks[j]->flags = FREE;
+            blocks[j]->state = CHUNK_FRESH; // the purge must not undo the prewarm
+            my_heap_defer_seed(heap, blocks[j]);
         }
     }
-    my_log_message("Error : invalid pointer to realloc : not in the heap\n");
-    return NULL;
+    pthread_mutex_unlock(&heap->lock);
+
+    LOG_TRACE("RETURN PREWARM CLASSES : %d\n", ret);
+    return ret;
 }
 
 
@@ -846,4 +2414,9 @@ void *realloc(void *ptr, size_t size)
     return new_ptr;
 }
 
+int mallopt(int param, int value)
+{
+    return secmalloc_mallopt(param, value);
+}
+
 #endif
@@ -0,0 +1,137 @@
+/**
+ * @file shadow.c
+ * @brief Implementation of the shadow of the heap data.
+ *
+ * This file contains the implementation of a compact shadow of the chunks of
+ * the data segments, so that a pointer handed to free or realloc is found to
+ * be a busy chunk, an already free one, a pointer inside a chunk or a pointer
+ * outside of the heap without walking the list.
+ *
+ * The sizes are not rounded, but a chunk and its canary span at least
+ * SHADOW_GRANULE + 1 bytes so at most one chunk starts in each granule. Each
+ * line of the shadow records the granules where a chunk starts and where a
+ * busy chunk starts, along with the slot of its first chunk, the chunk of a
+ * granule being reached from it in at most 63 steps of the list.
+ */
+
+#include "secmalloc.h"
+#include "log.h"
+
+/**
+ * @brief Get the line of the shadow describing an offset in a data segment.
+ *
+ * @param segment The segment.
+ * @param offset The offset in the segment.
+ * @param bit Filled with the bit of the granule of the offset in the line.
+ * @return struct shadow_line* A pointer to the line, or NULL if the segment has no shadow.
+ */
+static struct shadow_line* my_shadow_line(struct heap_segment *segment, size_t offset, unsigned long *bit)
+{
+    if (segment->shadow == NULL)
+    {
+        return NULL;
+    }
+
+    *bit = 1UL << (offset / SHADOW_GRANULE % 64);
+    return &segment->shadow[offset / SHADOW_LINE_SIZE];
+}
+
+/**
+ * @brief Record the start and the state of a chunk in the shadow of a heap.
+ *
+ * This function is called along with each update of the fit index, i.e.
+ * whenever a chunk is created, resized, allocated or freed.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The chunk.
+ */
+void my_shadow_update(struct secmalloc_heap *heap, struct chunkmetadata *item)
+{
+    unsigned long         bit;
+    struct shadow_line    *line = my_shadow_line(&heap->segments[item->segment], item->offset, &bit);
+    if (line == NULL)
+    {
+        return;
+    }
+
+    // The line keeps the slot of the chunk starting the lowest
+    if ((line->starts & (bit - 1)) == 0)
+    {
+        line->first = item - heap->metadata + 1;
+    }
+    line->starts |= bit;
+    if (item->flags == BUSY)
+    {
+        line->busy |= bit;
+    }
+    else
+    {
+        line->busy &= ~bit;
+    }
+}
+
+/**
+ * @brief Remove from the shadow of a heap a chunk no longer in the list.
+ *
+ * The chunk must still point to the chunk that followed it, which becomes
+ * the first of the line when the removed one was.
+ *
+ * @param heap The heap owning the chunk.
+ * @param item The chunk.
+ */
+void my_shadow_clear(struct secmalloc_heap *heap, struct chunkmetadata *item)
+{
+    unsigned long         bit;
+    struct shadow_line    *line = my_shadow_line(&heap->segments[item->segment], item->offset, &bit);
+    if (line == NULL || (line->starts & bit) == 0)
+    {
+        return;
+    }
+
+    line->starts &= ~bit;
+    line->busy &= ~bit;
+    if ((line->starts & (bit - 1)) == 0)
+    {
+        line->first = line->starts != 0 ? item->next : 0;
+    }
+}
+
+/**
+ * @brief Classify a pointer handed to the heap functions.
+ *
+ * @param heap The heap.
+ * @param ptr The pointer.
+ * @param item Filled with the chunk starting at the pointer, NULL if there is none.
+ * @return enum shadow_state The kind of the pointer.
+ */
+enum shadow_state my_shadow_classify(struct secmalloc_heap *heap, void *ptr, struct chunkmetadata **item)
+{
+    *item = NULL;
+
+    unsigned long          bit;
+    struct heap_segment    *segment = my_heap_segment(heap, ptr);
+    struct shadow_line     *line = segment == NULL ? NULL : my_shadow_line(segment, (size_t)ptr - (size_t)segment->base, &bit);
+    if (line == NULL)
+    {
+        return SHADOW_FOREIGN;
+    }
+    if ((line->starts & bit) == 0 || line->first == 0)
+    {
+        return SHADOW_INTERIOR;
+    }
+
+    // Step from the first chunk of the line over the chunks starting before the granule
+    struct chunkmetadata    *chunk = heap->metadata + line->first - 1;
+    for (int steps = __builtin_popcountl(line->starts & (bit - 1)); steps > 0 && chunk != NULL; steps--)
+    {
+        chunk = CHUNK_NEXT(heap, chunk);
+    }
+    if (chunk == NULL || CHUNK_ADDR(heap, chunk) != ptr)
+    {
+        return SHADOW_INTERIOR;
+    }
+
+    // A chunk in quarantine is still busy for the heap but already freed for the callers
+    *item = chunk;
+    return (line->busy & bit) != 0 && chunk->state != CHUNK_QUARANTINED ? SHADOW_BUSY : SHADOW_FREE;
+}
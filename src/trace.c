@@ -0,0 +1,255 @@
+/**
+ * @file trace.c
+ * @brief Implementation of the binary trace of the allocations.
+ *
+ * This file contains the implementation of a tracer recording the calls to
+ * the allocation functions as fixed-size events, when MSM_TRACE is set to the
+ * path of a trace file. The file is mapped shared and split into rings, each
+ * thread claiming one and being the only writer of it, so recording an event
+ * takes no lock and no syscall. The ring of a thread is released when the
+ * thread exits, for a new thread to claim it. The tools/trace_decode.c tool
+ * turns a trace back into the messages of the log.
+ */
+
+#define _GNU_SOURCE
+#include "secmalloc.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "log.h"
+#include "trace.h"
+
+int                                 my_trace_on = -1; // Read from MSM_TRACE at the first event
+static struct trace_header          *trace_file = NULL; // Mapping of the trace file
+static pid_t                        trace_pid = 0; // Process which created the trace file
+static pthread_mutex_t              trace_lock = PTHREAD_MUTEX_INITIALIZER; // Lock of the creation of the trace file
+static pthread_key_t                trace_key; // Key whose destructor releases the ring of an exiting thread
+static uint64_t                     trace_free = 0; // Bitmap of the rings released by the threads of the process
+static __thread struct trace_ring   *trace_ring = NULL; // Ring of the calling thread, claimed at its first event
+static __thread int                 trace_full = 0; // Whether the calling thread found every ring claimed
+
+_Static_assert(TRACE_RINGS <= 64, "the rings released are held in a 64-bit bitmap");
+
+/**
+ * @brief Read the time stamp counter.
+ *
+ * @return uint64_t The counter, or the monotonic time in nanoseconds where there is none.
+ */
+static uint64_t my_trace_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec    ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Get a monotonic time in nanoseconds.
+ *
+ * @return uint64_t The time in nanoseconds.
+ */
+static uint64_t my_trace_ns()
+{
+    struct timespec    ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Sample the clocks at exit, for the decoder to convert the counter to time.
+ */
+static void my_trace_exit()
+{
+    if (getpid() == trace_pid)
+    {
+        trace_file->end_tsc = my_trace_clock();
+        trace_file->end_ns = my_trace_ns();
+    }
+}
+
+/**
+ * @brief Make the thread of a forked child claim a ring of its own.
+ *
+ * The rings released in the parent may be claimed again by the parent, the
+ * child does not take them.
+ */
+static void my_trace_fork_child()
+{
+    trace_ring = NULL;
+    trace_full = 0;
+    trace_free = 0;
+}
+
+/**
+ * @brief Release the ring of an exiting thread.
+ *
+ * @param arg The ring.
+ */
+static void my_trace_release(void *arg)
+{
+    struct trace_ring    *ring = arg;
+    size_t               index = ring - (struct trace_ring*)(trace_file + 1);
+
+    // An event recorded by a later destructor of the thread claims a ring again
+    trace_ring = NULL;
+    __atomic_fetch_or(&trace_free, 1ULL << index, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Create the trace file the first time an event is recorded.
+ *
+ * The tracer is enabled before the handlers are registered, so that an
+ * allocation they make records its events.
+ */
+static void my_trace_open()
+{
+    pthread_mutex_lock(&trace_lock);
+    if (my_trace_on != -1)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+
+    const char    *path = my_config()->trace;
+    void          *map = MAP_FAILED;
+    if (path != NULL)
+    {
+        int    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600); // 600 - rw for owner
+        if (fd == -1 || ftruncate(fd, TRACE_FILE_SIZE) == -1)
+        {
+            perror("trace");
+            LOG_ERROR("Error: Failed to create the trace file %s.\n", path);
+        }
+        else
+        {
+            map = mmap(NULL, TRACE_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED)
+            {
+                perror("mmap");
+                LOG_ERROR("Error: Failed to map the trace file %s.\n", path);
+            }
+        }
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    }
+
+    if (map != MAP_FAILED && pthread_key_create(&trace_key, my_trace_release) != 0)
+    {
+        LOG_ERROR("Error: Failed to create the key of the trace rings.\n");
+        munmap(map, TRACE_FILE_SIZE);
+        map = MAP_FAILED;
+    }
+    if (map == MAP_FAILED)
+    {
+        __atomic_store_n(&my_trace_on, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+
+    trace_file = map;
+    trace_file->magic = TRACE_MAGIC;
+    trace_file->version = TRACE_VERSION;
+    trace_file->start_tsc = my_trace_clock();
+    trace_file->start_ns = my_trace_ns();
+    trace_pid = getpid();
+    __atomic_store_n(&my_trace_on, 1, __ATOMIC_RELEASE);
+
+    atexit(my_trace_exit);
+    pthread_atfork(NULL, NULL, my_trace_fork_child);
+    pthread_mutex_unlock(&trace_lock);
+    LOG_INFO("trace : %zu bytes mapped at %p for %s\n", TRACE_FILE_SIZE, map, path);
+}
+
+/**
+ * @brief Claim a ring for the calling thread.
+ *
+ * A ring released by an exited thread is taken first, its events stay
+ * before the new ones. The ring is released when the thread exits.
+ *
+ * @return struct trace_ring* A pointer to the ring, or NULL if every ring is claimed.
+ */
+static struct trace_ring* my_trace_claim()
+{
+    uint64_t    released = __atomic_load_n(&trace_free, __ATOMIC_ACQUIRE);
+    uint32_t    n;
+    while (released != 0 && !__atomic_compare_exchange_n(&trace_free, &released, released & (released - 1), 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    {
+    }
+    if (released != 0)
+    {
+        n = __builtin_ctzll(released);
+    }
+    else
+    {
+        n = __atomic_load_n(&trace_file->rings, __ATOMIC_RELAXED);
+        do
+        {
+            if (n == TRACE_RINGS)
+            {
+                if (trace_full == 0)
+                {
+                    __atomic_fetch_add(&trace_file->dropped, 1, __ATOMIC_RELAXED);
+                    trace_full = 1;
+                }
+                return NULL;
+            }
+        }
+        while (!__atomic_compare_exchange_n(&trace_file->rings, &n, n + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
+    struct trace_ring    *ring = (struct trace_ring*)(trace_file + 1) + n;
+    ring->tid = syscall(SYS_gettid);
+    ring->pid = getpid();
+    trace_ring = ring;
+    trace_full = 0;
+    pthread_setspecific(trace_key, ring);
+    return ring;
+}
+
+/**
+ * @brief Record an event in the ring of the calling thread.
+ *
+ * @param op The operation, see enum trace_op.
+ * @param addr The address argument or result of the operation.
+ * @param size The size argument of the operation.
+ */
+void my_trace_event(uint32_t op, uint64_t addr, uint64_t size)
+{
+    if (__atomic_load_n(&my_trace_on, __ATOMIC_ACQUIRE) == -1)
+    {
+        my_trace_open();
+    }
+    if (my_trace_on == 0 || (trace_full && __atomic_load_n(&trace_free, __ATOMIC_RELAXED) == 0))
+    {
+        return;
+    }
+
+    struct trace_ring    *ring = trace_ring;
+    if (ring == NULL && (ring = my_trace_claim()) == NULL)
+    {
+        return;
+    }
+
+    uint64_t              head = ring->head;
+    struct trace_event    *event = &ring->events[head % TRACE_RING_EVENTS];
+    event->tsc = my_trace_clock();
+    event->addr = addr;
+    event->size = size;
+    event->tid = ring->tid;
+    event->op = op;
+
+    // A reader takes the events before the head, publish the head once the event is written
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -7,11 +7,19 @@
 
 
 #include <criterion/criterion.h>
+#include <fcntl.h>
+#include <linux/mempolicy.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include "secmalloc.h"
 #include "log.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 /***** Begin of simples tests mmap *****/
@@ -117,6 +125,186 @@ Test(simple, log_02)
     cr_assert(ret == 0);
 }
 
+/**
+ * @brief Test the messages are gathered then written as they were logged.
+ */
+Test(simple, log_03)
+{
+    char    path[64];
+    snprintf(path, sizeof(path), "/tmp/msm_log_03_%d", getpid());
+    unlink(path);
+    setenv("MSM_OUTPUT", path, 1);
+
+    static char    large[LOG_BUFFER_SIZE + 100];
+    memset(large, 'x', LOG_BUFFER_SIZE + 99);
+    large[LOG_BUFFER_SIZE + 99] = '\0';
+    cr_assert(my_log_message("first %d\n", 1) == 0);
+    cr_assert(my_log_message("%s\n", large) == 0);
+    cr_assert(my_log_message("last %s\n", "message") == 0);
+
+    // Only the message flushed with the large one is written yet
+    char    buf[LOG_BUFFER_SIZE + 200];
+    int     fd = open(path, O_RDONLY);
+    cr_assert(fd != -1);
+    cr_assert(read(fd, buf, sizeof(buf)) == 8 + LOG_BUFFER_SIZE + 100);
+    cr_assert(my_log_flush() == 0);
+    ssize_t    size = read(fd, buf, sizeof(buf));
+    cr_assert(size == 13);
+    cr_assert(memcmp(buf, "last message\n", 13) == 0);
+    close(fd);
+    unlink(path);
+}
+
+#if LOG_LEVEL == LOG_LEVEL_TRACE
+/**
+ * @brief Test the messages above the level logged are skipped without evaluating their arguments.
+ */
+Test(simple, log_04)
+{
+    char    path[64];
+    snprintf(path, sizeof(path), "/tmp/msm_log_04_%d", getpid());
+    unlink(path);
+    setenv("MSM_OUTPUT", path, 1);
+    setenv("MSM_LOG_LEVEL", "warn", 1);
+
+    int    count = 0;
+    LOG_TRACE("trace %d\n", ++count);
+    cr_assert(my_log_level == LOG_LEVEL_WARN);
+    LOG_INFO("info %d\n", ++count);
+    LOG_WARN("warn %d\n", ++count);
+    LOG_ERROR("Error %d\n", ++count);
+    cr_assert(count == 2);
+    cr_assert(my_log_flush() == 0);
+
+    char    buf[64] = {0};
+    int     fd = open(path, O_RDONLY);
+    cr_assert(fd != -1);
+    cr_assert(read(fd, buf, sizeof(buf)) == 15);
+    cr_assert(strcmp(buf, "warn 1\nError 2\n") == 0);
+    close(fd);
+    unlink(path);
+}
+#endif
+
+/**
+ * @brief Test nothing is logged nor evaluated when MSM_OUTPUT is not set.
+ */
+Test(simple, log_05)
+{
+    unsetenv("MSM_OUTPUT");
+    int    count = 0;
+    LOG_ERROR("Error %d\n", ++count);
+    cr_assert(my_log_level == LOG_LEVEL_NONE);
+    LOG_ERROR("Error %d\n", ++count);
+    cr_assert(count == 0);
+}
+
+/**
+ * @brief Test the writer thread writes every message logged by a process before it exits.
+ */
+Test(simple, log_06)
+{
+    char    path[64];
+    snprintf(path, sizeof(path), "/tmp/msm_log_06_%d", getpid());
+    unlink(path);
+    setenv("MSM_OUTPUT", path, 1);
+    setenv("MSM_LOG_ASYNC", "1", 1);
+
+    pid_t    pid = fork();
+    cr_assert(pid != -1);
+    if (pid == 0)
+    {
+        for (int i = 0; i < 5000; i++)
+        {
+            my_log_message("message %04d\n", i);
+        }
+        exit(my_log_dropped() == 0 ? 0 : 1);
+    }
+    int    status = 0;
+    cr_assert(waitpid(pid, &status, 0) == pid);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    static char    buf[5000 * 13 + 1];
+    int            fd = open(path, O_RDONLY);
+    cr_assert(fd != -1);
+    size_t         size = 0;
+    ssize_t        ret = 0;
+    while ((ret = read(fd, buf + size, sizeof(buf) - size)) > 0)
+    {
+        size += ret;
+    }
+    cr_assert(size == 5000 * 13);
+    cr_assert(memcmp(buf, "message 0000\n", 13) == 0);
+    cr_assert(memcmp(buf + 4999 * 13, "message 4999\n", 13) == 0);
+    close(fd);
+    unlink(path);
+    unsetenv("MSM_LOG_ASYNC");
+}
+
+/**
+ * @brief Log messages until the process exits, for a thread of log_07.
+ */
+static void* log_thread(void *arg)
+{
+    for (int i = 0; ; i++)
+    {
+        my_log_message("thread %04d\n", i % 10000);
+        if (i == 0)
+        {
+            __atomic_store_n((int *)arg, 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Test the buffers of the threads still logging are flushed at exit with whole messages.
+ */
+Test(simple, log_07)
+{
+    char    path[64];
+    snprintf(path, sizeof(path), "/tmp/msm_log_07_%d", getpid());
+    unlink(path);
+    setenv("MSM_OUTPUT", path, 1);
+
+    pid_t    pid = fork();
+    cr_assert(pid != -1);
+    if (pid == 0)
+    {
+        pthread_t    thread;
+        int          started = 0;
+        if (pthread_create(&thread, NULL, log_thread, &started) != 0)
+        {
+            exit(1);
+        }
+        while (__atomic_load_n(&started, __ATOMIC_ACQUIRE) == 0)
+        {
+            sched_yield();
+        }
+        my_log_message("main %04d\n", 0);
+        exit(0);
+    }
+    int    status = 0;
+    cr_assert(waitpid(pid, &status, 0) == pid);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    FILE    *file = fopen(path, "r");
+    cr_assert(file != NULL);
+    char    line[64];
+    int     main_lines = 0;
+    int     thread_lines = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        main_lines += strcmp(line, "main 0000\n") == 0;
+        thread_lines += strncmp(line, "thread ", 7) == 0 && strlen(line) == 12;
+        cr_assert(strcmp(line, "main 0000\n") == 0 || (strncmp(line, "thread ", 7) == 0 && strlen(line) == 12));
+    }
+    cr_assert(main_lines == 1);
+    cr_assert(thread_lines > 0);
+    fclose(file);
+    unlink(path);
+}
+
 /* ***** End of simples tests log ***** */
 
 
@@ -160,12 +348,12 @@ Test(simple, canary_03)
     /* printf("canary_03\n"); */
     void    *ptr1 = my_malloc(100);
     cr_assert(ptr1 != NULL);
-    cr_assert(heapmetadata->canary == *((long *)((size_t)heapdata + 100)));
+    cr_assert(CHUNK_COLD(&secmalloc_default_heap, heapmetadata)->canary == *((long *)((size_t)heapdata + 100)));
 
     void    *ptr2 = my_malloc(200);
     cr_assert(ptr2 != NULL);
-    cr_assert(heapmetadata->next->canary == *((long *)((size_t)heapdata + 300 + sizeof(long))));
-    cr_assert(heapmetadata->canary == *((long *)((size_t)heapdata + 100)));
+    cr_assert(CHUNK_COLD(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata))->canary == *((long *)((size_t)heapdata + 300 + sizeof(long))));
+    cr_assert(CHUNK_COLD(&secmalloc_default_heap, heapmetadata)->canary == *((long *)((size_t)heapdata + 100)));
 }
 
 /**
@@ -181,6 +369,27 @@ Test(simple, canary_04)
     cr_assert(heapmetadata->flags == FREE);
 }
 
+/**
+ * @brief Test the canaries of a heap are drawn from its own generator, seeded once.
+ */
+Test(simple, canary_05)
+{
+    struct secmalloc_heap    *heap = secmalloc_heap_create();
+    cr_assert(heap->canary_state == 0);
+    long    first = my_heap_canary(heap);
+    cr_assert(first != -1);
+    cr_assert(heap->canary_state != 0);
+    for (int i = 0; i < 100; i++)
+    {
+        long    canary = my_heap_canary(heap);
+        cr_assert(canary != -1);
+        cr_assert(canary != first);
+    }
+    void    *ptr = secmalloc_heap_alloc(heap, 100);
+    cr_assert(*(long *)((char *)ptr + 100) == CHUNK_COLD(heap, heap->metadata)->canary);
+    secmalloc_heap_destroy(heap);
+}
+
 /* ***** End of simples tests canary ***** */
 
 
@@ -200,9 +409,9 @@ Test(simple, init_heaps_01)
     cr_assert(heapdata != NULL);
     cr_assert(heapmetadata->size == PAGE_HEAP_SIZE);
     cr_assert(heapmetadata->flags == FREE);
-    cr_assert(heapmetadata->addr == heapdata);
-    cr_assert(heapmetadata->canary == 0xdeadbeef);
-    cr_assert(heapmetadata->next == NULL);
+    cr_assert(CHUNK_ADDR(&secmalloc_default_heap, heapmetadata) == heapdata);
+    cr_assert(heapmetadata->state == CHUNK_FRESH);
+    cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata) == NULL);
 }
 
 /* ***** End of simples tests heap ***** */
@@ -220,11 +429,11 @@ Test(simple, my_malloc_01)
     cr_assert(ptr != NULL);
     cr_assert(ptr == heapdata);
     // verify the first metadata bloc (heapmetadata)
-    cr_assert(heapmetadata->addr == ptr);
+    cr_assert(CHUNK_ADDR(&secmalloc_default_heap, heapmetadata) == ptr);
     cr_assert(heapmetadata->size == 100);
     cr_assert(heapmetadata->flags == BUSY);
     long    canary = *((long *)((size_t)ptr + 100));
-    cr_assert(heapmetadata->canary == canary);
+    cr_assert(CHUNK_COLD(&secmalloc_default_heap, heapmetadata)->canary == canary);
     /* printf("heapmetadata->next = %p\n", heapmetadata->next); */
     /* printf("heapmetadata = %p\n", heapmetadata); */
     /* printf("sizeof(struct chunkmetadata) = %ld\n", sizeof(struct chunkmetadata)); */
@@ -233,13 +442,13 @@ Test(simple, my_malloc_01)
     /* printf("heapmetadata->next = %p\n", heapmetadata->next); */
     /* printf("(void *) ((size_t)heapmetadata + sizeof(struct chunkmetadata))) = %p\n", (void *) */
     /*((size_t)heapmetadata + sizeof(struct chunkmetadata))); */
-    cr_assert(heapmetadata->next == (void *) ((size_t)heapmetadata + sizeof(struct chunkmetadata)));
+    cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata) == (void *) ((size_t)heapmetadata + sizeof(struct chunkmetadata)));
     // verify the next metadata bloc
-    cr_assert(heapmetadata->next->size == PAGE_HEAP_SIZE - 100 - sizeof(long));
-    cr_assert(heapmetadata->next->flags == FREE);
-    cr_assert(heapmetadata->next->addr == (void *) ((size_t)heapdata + 100 + sizeof(long)));
-    cr_assert(heapmetadata->next->canary == 0xdeadbeef);
-    cr_assert(heapmetadata->next->next == NULL);
+    cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)->size == PAGE_HEAP_SIZE - 100 - sizeof(long));
+    cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)->flags == FREE);
+    cr_assert(CHUNK_ADDR(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)) == (void *) ((size_t)heapdata + 100 + sizeof(long)));
+    cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)->state == CHUNK_FRESH);
+    cr_assert(CHUNK_NEXT(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)) == NULL);
 }
 
 /**
@@ -282,7 +491,7 @@ Test(simple, my_malloc_04)
 	void    *ptr = my_malloc(1000);
 	cr_assert(ptr != NULL);
 	long    canary = *((long *)((size_t)ptr + 1000));
-	cr_assert(heapmetadata->canary == canary);
+	cr_assert(CHUNK_COLD(&secmalloc_default_heap, heapmetadata)->canary == canary);
 }
 
 /**
@@ -299,10 +508,10 @@ Test(simple, my_malloc_05)
 	/* printf("ptr3 = %p\n", ptr3); */
 	cr_assert(ptr1 != NULL);
 	cr_assert(heapmetadata->size == 4096);
-	cr_assert(heapmetadata->next->addr == ptr2);
+	cr_assert(CHUNK_ADDR(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)) == ptr2);
 	cr_assert(ptr2 != NULL);
-	cr_assert(heapmetadata->next->size == 4096);
-	cr_assert(heapmetadata->next->next->addr == ptr3);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)->size == 4096);
+	cr_assert(CHUNK_ADDR(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata))) == ptr3);
 	cr_assert(ptr3 != NULL);
 }
 
@@ -326,7 +535,7 @@ Test(simple, my_malloc_07)
 	void    *ptr = my_malloc(4096-sizeof(long));
 	cr_assert (ptr != NULL);
 	void    *ptr2 = my_malloc(666);
-	cr_assert(heapmetadata->next->addr == ptr2);
+	cr_assert(CHUNK_ADDR(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)) == ptr2);
 }
 
 /* ***** End of simples tests malloc ***** */
@@ -353,7 +562,7 @@ Test(simple, free_02)
 	void    *ptr = my_malloc(100);
 	cr_assert(ptr != NULL);
 	my_free(ptr);
-	cr_assert(heapmetadata->next == NULL);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata) == NULL);
 }
 
 /**
@@ -447,7 +656,7 @@ Test(simple, malloc_free_03)
 	void    *ptr3 = my_malloc(100);
 	my_free(ptr);
 	my_free(ptr2);
-	cr_assert(heapmetadata->next->addr == ptr3);
+	cr_assert(CHUNK_ADDR(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)) == ptr3);
 	my_free(ptr3);
 }
 
@@ -488,8 +697,8 @@ Test(simple, malloc_free_04)
 	/* printf("heapmetadata->next->addr = %p\n", heapmetadata->next->addr); */
 	/* printf("heapmetadata->next->size = %ld\n", heapmetadata->next->size); */
 	/* printf("heapmetadata->next->flags = %d\n", heapmetadata->next->flags); */
-	cr_assert(heapmetadata->addr == ptr1);
-	cr_assert(heapmetadata->next->addr == ptr3);
+	cr_assert(CHUNK_ADDR(&secmalloc_default_heap, heapmetadata) == ptr1);
+	cr_assert(CHUNK_ADDR(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)) == ptr3);
 	my_free(ptr3);
 }
 
@@ -508,8 +717,11 @@ Test(simple, malloc_free_05)
 	my_free(ptr2);
 	void    *ptr4 = my_malloc(1000);
 	cr_assert(ptr4 != NULL);
-	cr_assert(heapmetadata->addr == ptr4);
+#if !TLSF
+	// TLSF takes the block of the smallest class instead
+	cr_assert(CHUNK_ADDR(&secmalloc_default_heap, heapmetadata) == ptr4);
 	cr_assert(ptr4 == ptr1);
+#endif
 }
 
 /* ***** End of simples tests free / malloc ***** */
@@ -602,12 +814,79 @@ Test(simple, resize_05)
 	cr_assert(heapmetadata->size == 10000);
 	cr_assert(heapmetadata->flags == BUSY);
 	/* printf("heapmetadata->next->size = %ld\n", heapmetadata->next->size); */
-	cr_assert(heapmetadata->next->size == 4096*3-10000-sizeof(long));
-	cr_assert(heapmetadata->next->flags == FREE);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)->size == 4096*3-10000-sizeof(long));
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)->flags == FREE);
 	my_free(ptr);
 	cr_assert(heapmetadata->flags == FREE);
 }
 
+/**
+ * @brief Test heap growth never moves the heap data nor the heap metadata.
+ */
+Test(simple, resize_08)
+{
+	char    *ptr = my_malloc(100);
+	void    *data = heapdata;
+	void    *metadata = heapmetadata;
+	memset(ptr, 0x42, 100);
+	for (int i = 0; i < 2000; i++)
+	{
+		cr_assert(my_malloc(300) != NULL);
+	}
+	cr_assert(heapdata == data);
+	cr_assert(heapmetadata == metadata);
+	cr_assert(heapdata_size > 2000 * 300);
+	cr_assert(heapmetadata_size > 2000 * sizeof(struct chunkmetadata));
+	for (int i = 0; i < 100; i++)
+	{
+		cr_assert(ptr[i] == 0x42);
+	}
+}
+
+/**
+ * @brief Test heap memory is committed by steps inside the reserved range.
+ */
+Test(simple, resize_09)
+{
+	my_malloc(100);
+	cr_assert(heapdata == secmalloc_default_heap.segments[0].base);
+	cr_assert(secmalloc_default_heap.data_committed == HEAP_COMMIT_STEP);
+	my_malloc(HEAP_COMMIT_STEP);
+	cr_assert(secmalloc_default_heap.data_committed == 2 * HEAP_COMMIT_STEP);
+	cr_assert(heapdata_size < secmalloc_default_heap.data_committed);
+	cr_assert(secmalloc_default_heap.nsegments == 1);
+}
+
+/**
+ * @brief Test a new segment is added when the first one is full.
+ */
+Test(simple, resize_10)
+{
+	void    *ptr1 = my_malloc(100);
+	void    *ptr2 = my_malloc(HEAP_SEGMENT_SIZE);
+	cr_assert(ptr1 != NULL);
+	cr_assert(ptr2 != NULL);
+	cr_assert(secmalloc_default_heap.nsegments == 2);
+	cr_assert(ptr2 == secmalloc_default_heap.segments[1].base);
+	cr_assert(my_heap_segment(&secmalloc_default_heap, ptr1) == &secmalloc_default_heap.segments[0]);
+	cr_assert(my_heap_segment(&secmalloc_default_heap, ptr2) == &secmalloc_default_heap.segments[1]);
+	cr_assert(my_heap_segment(&secmalloc_default_heap, (void*)0xdeadbeef) == NULL);
+
+	// The free end of the first segment is still used
+	void    *ptr3 = my_malloc(100);
+	cr_assert(my_heap_segment(&secmalloc_default_heap, ptr3) == &secmalloc_default_heap.segments[0]);
+
+	// Free blocks of different segments are not merged
+	my_free(ptr3);
+	my_free(ptr1);
+	CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)->flags = FREE; // ptr2, without scrubbing the whole segment
+	my_merge_chunks();
+	cr_assert(heapmetadata->flags == FREE);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata) != NULL);
+	cr_assert(CHUNK_ADDR(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)) == secmalloc_default_heap.segments[1].base);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)) == NULL);
+}
+
 /* ***** End of simples tests resize ***** */
 
 
@@ -623,8 +902,8 @@ Test(simple, my_calloc_01)
 	cr_assert(ptr != NULL);
 	cr_assert(heapmetadata->size == 100);
 	cr_assert(heapmetadata->flags == BUSY);
-	cr_assert(heapmetadata->next->size == 4096-100-sizeof(long));
-	cr_assert(heapmetadata->next->flags == FREE);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)->size == 4096-100-sizeof(long));
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)->flags == FREE);
 }
 
 /**
@@ -784,4 +1063,1740 @@ Test(simple, my_realloc_05)
 /* 	#<{(| cr_assert(heapmetadata->next->addr == ptr3); |)}># */
 /* } */
 
+/**
+ * @brief Test growing the last block of the heap copies only the old block, not past the committed end.
+ */
+Test(simple, my_realloc_09)
+{
+	setenv("MSM_GROWTH_MIN_STEP", "4096", 1);
+	setenv("MSM_GROWTH_FACTOR", "0", 1);
+	setenv("MSM_BUDDY", "4096", 1);
+	char	*ptr = my_malloc(16);
+	cr_assert(ptr != NULL);
+	memset(ptr, 'A', 16);
+
+	// The new block comes from the buddy zone, the heap does not grow past the committed slack
+	struct heap_segment	*segment = &secmalloc_default_heap.segments[0];
+	size_t	slack = (char*)segment->base + segment->committed - ptr;
+	cr_assert(slack < 8 * PAGE_HEAP_SIZE);
+	char	*ptr2 = my_realloc(ptr, 8 * PAGE_HEAP_SIZE);
+	cr_assert(ptr2 != NULL);
+	for (int i = 0; i < 16; i++)
+	{
+		cr_assert(ptr2[i] == 'A');
+	}
+	my_free(ptr2);
+}
+
 /* ***** End of simples tests realloc ***** */
+
+
+/* ***** Begin of simples tests private heap ***** */
+
+/**
+ * @brief Test private heap creation.
+ */
+Test(simple, heap_01)
+{
+	struct secmalloc_heap    *heap = secmalloc_heap_create();
+	cr_assert(heap != NULL);
+	cr_assert(heap->data != NULL);
+	cr_assert(heap->metadata != NULL);
+	cr_assert(CHUNK_ADDR(heap, heap->metadata) == heap->data);
+	cr_assert(heap->metadata->flags == FREE);
+	cr_assert(heapdata == NULL);
+	cr_assert(heapmetadata == NULL);
+	secmalloc_heap_destroy(heap);
+}
+
+/**
+ * @brief Test private heap allocation and free.
+ */
+Test(simple, heap_02)
+{
+	struct secmalloc_heap    *heap = secmalloc_heap_create();
+	void    *ptr = secmalloc_heap_alloc(heap, 100);
+	cr_assert(ptr == heap->data);
+	cr_assert(heap->metadata->size == 100);
+	cr_assert(heap->metadata->flags == BUSY);
+	long    canary = *((long *)((size_t)ptr + 100));
+	cr_assert(CHUNK_COLD(heap, heap->metadata)->canary == canary);
+	secmalloc_heap_free(heap, ptr);
+	cr_assert(heap->metadata->flags == FREE);
+	cr_assert(CHUNK_NEXT(heap, heap->metadata) == NULL);
+	secmalloc_heap_destroy(heap);
+}
+
+/**
+ * @brief Test private heaps are independent from each other and from the default heap.
+ */
+Test(simple, heap_03)
+{
+	struct secmalloc_heap    *heap1 = secmalloc_heap_create();
+	struct secmalloc_heap    *heap2 = secmalloc_heap_create();
+	void    *ptr1 = secmalloc_heap_alloc(heap1, 100);
+	void    *ptr2 = secmalloc_heap_alloc(heap2, 100);
+	void    *ptr3 = my_malloc(100);
+	cr_assert(ptr1 != NULL && ptr2 != NULL && ptr3 != NULL);
+	cr_assert(ptr1 != ptr2 && ptr1 != ptr3 && ptr2 != ptr3);
+	secmalloc_heap_free(heap2, ptr1); // not in heap2
+	cr_assert(heap1->metadata->flags == BUSY);
+	secmalloc_heap_destroy(heap1);
+	cr_assert(heap2->metadata->flags == BUSY);
+	cr_assert(heapmetadata->flags == BUSY);
+	secmalloc_heap_destroy(heap2);
+}
+
+/**
+ * @brief Test private heap growth and bulk release.
+ */
+Test(simple, heap_04)
+{
+	struct secmalloc_heap    *heap = secmalloc_heap_create();
+	void    *ptr = NULL;
+	for (int i = 0; i < 100; i++)
+	{
+		ptr = secmalloc_heap_alloc(heap, 300);
+		cr_assert(ptr != NULL);
+	}
+	cr_assert(heap->data_size > PAGE_HEAP_SIZE);
+	secmalloc_heap_destroy(heap);
+	cr_assert(secmalloc_heap_alloc(NULL, 100) == NULL);
+}
+
+/* ***** End of simples tests private heap ***** */
+
+
+/* ***** Begin of simples tests arena ***** */
+
+/**
+ * @brief Test arena allocations are aligned and distinct.
+ */
+Test(simple, arena_01)
+{
+	struct secmalloc_arena    *arena = secmalloc_arena_create(0);
+	cr_assert(arena != NULL);
+	char    *ptr1 = secmalloc_arena_alloc(arena, 10);
+	char    *ptr2 = secmalloc_arena_alloc(arena, 100);
+	cr_assert(ptr1 != NULL && ptr2 != NULL);
+	cr_assert((size_t)ptr1 % ARENA_ALIGNMENT == 0);
+	cr_assert((size_t)ptr2 % ARENA_ALIGNMENT == 0);
+	cr_assert(ptr2 >= ptr1 + 10 + sizeof(long));
+	cr_assert(secmalloc_arena_alloc(arena, 0) == NULL);
+	secmalloc_arena_destroy(arena);
+}
+
+/**
+ * @brief Test arena reset scrubs and reuses memory.
+ */
+Test(simple, arena_02)
+{
+	struct secmalloc_arena    *arena = secmalloc_arena_create(0);
+	char    *ptr1 = secmalloc_arena_alloc(arena, 100);
+	memset(ptr1, 0x42, 100);
+	cr_assert(secmalloc_arena_reset(arena) == 0);
+	for (int i = 0; i < 100; i++)
+	{
+		cr_assert(ptr1[i] == 0);
+	}
+	char    *ptr2 = secmalloc_arena_alloc(arena, 100);
+	cr_assert(ptr1 == ptr2);
+	secmalloc_arena_destroy(arena);
+}
+
+/**
+ * @brief Test arena reset detects buffer overflows.
+ */
+Test(simple, arena_03)
+{
+	struct secmalloc_arena    *arena = secmalloc_arena_create(0);
+	char    *ptr = secmalloc_arena_alloc(arena, 100);
+	secmalloc_arena_alloc(arena, 100);
+	memset(ptr, 0x42, 101);
+	cr_assert(secmalloc_arena_reset(arena) == -1);
+	cr_assert(secmalloc_arena_reset(arena) == 0);
+	secmalloc_arena_destroy(arena);
+}
+
+/**
+ * @brief Test arena grows with new chunks, including for large objects.
+ */
+Test(simple, arena_04)
+{
+	struct secmalloc_arena    *arena = secmalloc_arena_create(PAGE_HEAP_SIZE);
+	char    *ptr = NULL;
+	for (int i = 0; i < 100; i++)
+	{
+		ptr = secmalloc_arena_alloc(arena, 300);
+		cr_assert(ptr != NULL);
+		memset(ptr, 0x42, 300);
+	}
+	ptr = secmalloc_arena_alloc(arena, 3 * PAGE_HEAP_SIZE);
+	cr_assert(ptr != NULL);
+	memset(ptr, 0x42, 3 * PAGE_HEAP_SIZE);
+	cr_assert(arena->head->next != NULL);
+	cr_assert(secmalloc_arena_reset(arena) == 0);
+	cr_assert(arena->current == arena->head);
+	secmalloc_arena_destroy(arena);
+}
+
+/* ***** End of simples tests arena ***** */
+
+
+/* ***** Begin of simples tests pool ***** */
+
+/**
+ * @brief Test pool allocations are aligned, distinct and reused.
+ */
+Test(simple, pool_01)
+{
+	struct secmalloc_pool    *pool = secmalloc_pool_create(24, 16);
+	cr_assert(pool != NULL);
+	char    *ptr1 = secmalloc_pool_alloc(pool);
+	char    *ptr2 = secmalloc_pool_alloc(pool);
+	cr_assert(ptr1 != NULL && ptr2 != NULL);
+	cr_assert((size_t)ptr1 % 16 == 0);
+	cr_assert((size_t)ptr2 % 16 == 0);
+	cr_assert(ptr2 == ptr1 + pool->stride);
+	secmalloc_pool_free(pool, ptr1);
+	cr_assert(secmalloc_pool_alloc(pool) == ptr1);
+	secmalloc_pool_destroy(pool);
+}
+
+/**
+ * @brief Test pool detects double free and invalid free.
+ */
+Test(simple, pool_02)
+{
+	struct secmalloc_pool    *pool = secmalloc_pool_create(32, 0);
+	char    *ptr1 = secmalloc_pool_alloc(pool);
+	secmalloc_pool_free(pool, ptr1);
+	secmalloc_pool_free(pool, ptr1); // double free, ignored
+	secmalloc_pool_free(pool, (void*)0xdeadbeef); // not in the pool, ignored
+	char    *ptr2 = secmalloc_pool_alloc(pool);
+	secmalloc_pool_free(pool, ptr2 + 1); // not the start of an object, ignored
+	char    *ptr3 = secmalloc_pool_alloc(pool);
+	cr_assert(ptr2 == ptr1);
+	cr_assert(ptr3 != ptr2);
+	secmalloc_pool_destroy(pool);
+}
+
+/**
+ * @brief Test pool grows with new slabs and cleans freed objects.
+ */
+Test(simple, pool_03)
+{
+	struct secmalloc_pool    *pool = secmalloc_pool_create(100, 0);
+	char    *ptr = NULL;
+	for (size_t i = 0; i < 3 * pool->objects_per_slab; i++)
+	{
+		ptr = secmalloc_pool_alloc(pool);
+		cr_assert(ptr != NULL);
+		memset(ptr, 0x42, 100);
+	}
+	cr_assert(pool->slabs->next->next != NULL);
+	secmalloc_pool_free(pool, ptr);
+	for (int i = sizeof(void*); i < 100; i++)
+	{
+		cr_assert(ptr[i] == 0);
+	}
+	secmalloc_pool_destroy(pool);
+}
+
+/**
+ * @brief Test pool rejects invalid parameters.
+ */
+Test(simple, pool_04)
+{
+	cr_assert(secmalloc_pool_create(0, 8) == NULL);
+	cr_assert(secmalloc_pool_create(16, 3) == NULL);
+	cr_assert(secmalloc_pool_alloc(NULL) == NULL);
+}
+
+/**
+ * @brief Test pool free rejects the pointers out of its committed slabs without reading them.
+ */
+Test(simple, pool_05)
+{
+	struct secmalloc_pool    *pool = secmalloc_pool_create(48, 0);
+	struct secmalloc_pool    *other = secmalloc_pool_create(48, 0);
+	char    *ptr = secmalloc_pool_alloc(pool);
+	char    *ptr2 = secmalloc_pool_alloc(other);
+	cr_assert(pool->nslabs == 1);
+	cr_assert(ptr >= pool->base && ptr < pool->base + pool->slab_size);
+	secmalloc_pool_free(pool, ptr + pool->slab_size); // reserved but not committed, ignored
+	secmalloc_pool_free(pool, ptr2); // object of another pool, ignored
+	cr_assert(*(long*)(ptr2 + 48) == (other->canary ^ (long)ptr2));
+	secmalloc_pool_free(pool, ptr);
+	cr_assert(secmalloc_pool_alloc(pool) == ptr);
+	secmalloc_pool_destroy(other);
+	secmalloc_pool_destroy(pool);
+}
+
+/* ***** End of simples tests pool ***** */
+
+
+/* ***** Begin of simples tests growth ***** */
+
+/**
+ * @brief Test the growth is geometric and bounded by the steps.
+ */
+Test(simple, growth_01)
+{
+	struct growth_policy    *policy = my_growth_policy();
+	cr_assert(my_growth_target(0, PAGE_HEAP_SIZE) == policy->min_step);
+	cr_assert(my_growth_target(policy->min_step, policy->min_step + 1) == 2 * policy->min_step);
+	cr_assert(my_growth_target(4 * policy->min_step, 4 * policy->min_step + 1) == 8 * policy->min_step);
+	cr_assert(my_growth_target(policy->max_step * 4, policy->max_step * 4 + 1) == policy->max_step * 5);
+	cr_assert(my_growth_target(0, 3 * policy->min_step + 1) == 3 * policy->min_step + PAGE_HEAP_SIZE);
+}
+
+/**
+ * @brief Test a loop of small mallocs makes few growth syscalls.
+ */
+Test(simple, growth_02)
+{
+	struct secmalloc_stats    stats;
+	for (int i = 0; i < 1000; i++)
+	{
+		cr_assert(my_malloc(100) != NULL);
+	}
+	secmalloc_heap_stats(NULL, &stats);
+	cr_assert(stats.data_size >= 1000 * 100);
+	cr_assert(stats.committed >= stats.data_size + stats.metadata_size);
+	cr_assert(stats.growth_syscalls < 10);
+}
+
+/**
+ * @brief Test the growth policy is read from the environment.
+ */
+Test(simple, growth_03)
+{
+	setenv("MSM_GROWTH_MIN_STEP", "1048576", 1);
+	setenv("MSM_GROWTH_CAP", "4194304", 1);
+	cr_assert(my_malloc(100) != NULL);
+	cr_assert(secmalloc_default_heap.data_committed == 1048576);
+	cr_assert(my_malloc(2 * 1048576) != NULL);
+	cr_assert(my_malloc(2 * 1048576) == NULL);
+}
+
+/* ***** End of simples tests growth ***** */
+
+/* ***** Begin of simples tests purge ***** */
+
+/**
+ * @brief Check whether a page is resident in memory.
+ */
+static int is_resident(void *page)
+{
+	unsigned char	vec = 0;
+	cr_assert(mincore(page, PAGE_HEAP_SIZE, &vec) == 0);
+	return vec & 1;
+}
+
+/**
+ * @brief Test the free pages are purged right away without decay.
+ */
+Test(simple, purge_01)
+{
+	setenv("MSM_PURGE_DECAY", "0", 1);
+	char	*ptr = my_malloc(4 * PAGE_HEAP_SIZE);
+	cr_assert(ptr != NULL);
+	memset(ptr, 'A', 4 * PAGE_HEAP_SIZE);
+	char	*page = (char*)(((size_t)ptr + PAGE_HEAP_SIZE - 1) & ~((size_t)PAGE_HEAP_SIZE - 1));
+	cr_assert(is_resident(page));
+	my_free(ptr);
+#if TLSF
+	// TLSF never purges on free
+	secmalloc_purge(NULL);
+#endif
+	cr_assert(is_resident(page) == 0);
+
+	struct secmalloc_stats	stats;
+	secmalloc_heap_stats(NULL, &stats);
+	cr_assert(stats.purged_bytes >= 3 * PAGE_HEAP_SIZE);
+	cr_assert(stats.refaults == 0);
+}
+
+/**
+ * @brief Test the pages of a purged block are counted as refaults when reused.
+ */
+Test(simple, purge_02)
+{
+	setenv("MSM_PURGE_DECAY", "0", 1);
+	char	*ptr = my_malloc(4 * PAGE_HEAP_SIZE);
+	my_free(ptr);
+#if TLSF
+	// TLSF never purges on free
+	secmalloc_purge(NULL);
+#endif
+	char	*ptr2 = my_malloc(4 * PAGE_HEAP_SIZE);
+	cr_assert(ptr2 == ptr);
+	cr_assert(ptr2[0] == 0 && ptr2[4 * PAGE_HEAP_SIZE - 1] == 0);
+
+	struct secmalloc_stats	stats;
+	secmalloc_heap_stats(NULL, &stats);
+	cr_assert(stats.refaults >= 3);
+}
+
+/**
+ * @brief Test the free pages are kept until the decay time elapsed or an explicit purge.
+ */
+Test(simple, purge_03)
+{
+	char	*ptr = my_malloc(4 * PAGE_HEAP_SIZE);
+	char	*ptr2 = my_malloc(16);
+	memset(ptr, 'A', 4 * PAGE_HEAP_SIZE);
+	my_free(ptr);
+	char	*page = (char*)(((size_t)ptr + PAGE_HEAP_SIZE - 1) & ~((size_t)PAGE_HEAP_SIZE - 1));
+	cr_assert(is_resident(page));
+
+	struct secmalloc_stats	stats;
+	secmalloc_heap_stats(NULL, &stats);
+	cr_assert(stats.purged_bytes == 0);
+	size_t	purged = secmalloc_purge(NULL);
+	cr_assert(purged >= 3 * PAGE_HEAP_SIZE);
+	cr_assert(is_resident(page) == 0);
+	secmalloc_heap_stats(NULL, &stats);
+	cr_assert(stats.purged_bytes == purged);
+
+	// The busy block is left untouched
+	cr_assert(secmalloc_purge(NULL) == 0);
+	my_free(ptr2);
+}
+
+/**
+ * @brief Test the purge of a private heap.
+ */
+Test(simple, purge_04)
+{
+	struct secmalloc_heap	*heap = secmalloc_heap_create();
+	char	*ptr = secmalloc_heap_alloc(heap, 8 * PAGE_HEAP_SIZE);
+	memset(ptr, 'A', 8 * PAGE_HEAP_SIZE);
+	secmalloc_heap_free(heap, ptr);
+	cr_assert(secmalloc_purge(heap) >= 7 * PAGE_HEAP_SIZE);
+
+	struct secmalloc_stats	stats;
+	secmalloc_heap_stats(NULL, &stats);
+	cr_assert(stats.purged_bytes == 0);
+	secmalloc_heap_destroy(heap);
+}
+
+/**
+ * @brief Test the background thread started by mallopt purges the default heap in place of the free.
+ */
+Test(simple, purge_05)
+{
+	setenv("MSM_PURGE_DECAY", "20", 1);
+	char	*ptr = my_malloc(4 * PAGE_HEAP_SIZE);
+	char	*ptr2 = my_malloc(16);
+	memset(ptr, 'A', 4 * PAGE_HEAP_SIZE);
+	cr_assert(secmalloc_mallopt(M_SECMALLOC_PURGE_THREAD, 1) == 1);
+
+	// The first free would purge on its own, the decay elapsed since the last purge that never ran
+	my_free(ptr);
+	char	*page = (char*)(((size_t)ptr + PAGE_HEAP_SIZE - 1) & ~((size_t)PAGE_HEAP_SIZE - 1));
+	cr_assert(is_resident(page));
+	for (int i = 0; i < 100 && is_resident(page); i++)
+	{
+		usleep(10000);
+	}
+	cr_assert(is_resident(page) == 0);
+	my_free(ptr2);
+}
+
+/* ***** End of simples tests purge ***** */
+
+/* ***** Begin of simples tests trim ***** */
+
+/**
+ * @brief Test the free end of the heap data is given back to the OS.
+ */
+Test(simple, trim_01)
+{
+	char	*ptr = my_malloc(1048576);
+	memset(ptr, 'A', 1048576);
+	my_free(ptr);
+
+	struct secmalloc_stats	before;
+	struct secmalloc_stats	after;
+	secmalloc_heap_stats(NULL, &before);
+	size_t	released = secmalloc_trim(0);
+	secmalloc_heap_stats(NULL, &after);
+	cr_assert(released >= 1048576 - PAGE_HEAP_SIZE);
+	cr_assert(after.committed < before.committed);
+	cr_assert(after.data_size == PAGE_HEAP_SIZE);
+
+	// The heap grows again
+	ptr = my_malloc(1048576);
+	cr_assert(ptr != NULL);
+	memset(ptr, 'A', 1048576);
+	my_free(ptr);
+}
+
+/**
+ * @brief Test the pad is kept at the end of the heap data.
+ */
+Test(simple, trim_02)
+{
+	char	*ptr = my_malloc(100);
+	char	*ptr2 = my_malloc(1048576);
+	my_free(ptr2);
+	secmalloc_trim(65536);
+	cr_assert(my_lastmetadata()->flags == FREE);
+	cr_assert(my_lastmetadata()->size >= 65536);
+	cr_assert(heapdata_size <= 100 + sizeof(long) + 65536 + PAGE_HEAP_SIZE);
+	cr_assert(my_verify_canary(heapmetadata) == 1);
+	my_free(ptr);
+}
+
+/**
+ * @brief Test the metadata above the last used slot is given back to the OS.
+ */
+Test(simple, trim_03)
+{
+	void	*ptrs[400];
+	for (int i = 0; i < 400; i++)
+	{
+		ptrs[i] = my_malloc(16);
+	}
+	for (int i = 0; i < 400; i++)
+	{
+		my_free(ptrs[i]);
+	}
+	size_t	committed = secmalloc_default_heap.metadata_committed;
+	cr_assert(committed > PAGE_HEAP_SIZE);
+	cr_assert(secmalloc_trim(0) > 0);
+	cr_assert(secmalloc_default_heap.metadata_committed == PAGE_HEAP_SIZE);
+	cr_assert(my_get_allocated_heapmetadata_size() == sizeof(struct chunkmetadata));
+
+	// Slots are used again from the start
+	cr_assert(my_malloc(16) == ptrs[0]);
+	cr_assert(my_malloc(16) == ptrs[1]);
+	cr_assert(my_get_allocated_heapmetadata_size() == 3 * sizeof(struct chunkmetadata));
+}
+
+/* ***** End of simples tests trim ***** */
+
+/* ***** Begin of simples tests hugepage ***** */
+
+/**
+ * @brief Test the heap regions are aligned on huge pages.
+ */
+Test(simple, hugepage_01)
+{
+	setenv("MSM_HUGEPAGE", "1", 1);
+	char	*ptr = my_malloc(4 * HUGE_PAGE_SIZE);
+	cr_assert(ptr != NULL);
+	memset(ptr, 'A', 4 * HUGE_PAGE_SIZE);
+	cr_assert((size_t)heapdata % HUGE_PAGE_SIZE == 0);
+	cr_assert((size_t)heapmetadata % HUGE_PAGE_SIZE == 0);
+	cr_assert(secmalloc_default_heap.data_committed % HUGE_PAGE_SIZE == 0);
+	cr_assert(secmalloc_default_heap.metadata_committed % HUGE_PAGE_SIZE == 0);
+
+	struct secmalloc_stats	stats;
+	secmalloc_heap_stats(NULL, &stats);
+	cr_assert(stats.hugepage_bytes <= stats.committed);
+	my_free(ptr);
+}
+
+/**
+ * @brief Test the purge never splits a huge page.
+ */
+Test(simple, hugepage_02)
+{
+	setenv("MSM_HUGEPAGE", "1", 1);
+	setenv("MSM_PURGE_DECAY", "0", 1);
+	char	*ptr = my_malloc(HUGE_PAGE_SIZE / 2);
+	char	*ptr2 = my_malloc(16);
+	my_free(ptr);
+#if TLSF
+	// TLSF never purges on free
+	secmalloc_purge(NULL);
+#endif
+
+	struct secmalloc_stats	stats;
+	secmalloc_heap_stats(NULL, &stats);
+	cr_assert(stats.purged_bytes == 0);
+
+	ptr = my_malloc(3 * HUGE_PAGE_SIZE);
+	my_free(ptr2);
+	my_free(ptr);
+#if TLSF
+	// TLSF never purges on free
+	secmalloc_purge(NULL);
+#endif
+	secmalloc_heap_stats(NULL, &stats);
+	cr_assert(stats.purged_bytes >= 2 * HUGE_PAGE_SIZE);
+	cr_assert(stats.purged_bytes % HUGE_PAGE_SIZE == 0);
+}
+
+/**
+ * @brief Test the fall back to transparent huge pages without hugetlb pages.
+ */
+Test(simple, hugepage_03)
+{
+	setenv("MSM_HUGEPAGE", "2", 1);
+	char	*ptr = my_malloc(100);
+	cr_assert(ptr != NULL);
+	memset(ptr, 'A', 100);
+	cr_assert((size_t)heapdata % HUGE_PAGE_SIZE == 0);
+	cr_assert(my_growth_policy()->hugepage != HUGEPAGE_NONE);
+	my_free(ptr);
+}
+
+/* ***** End of simples tests hugepage ***** */
+
+/* ***** Begin of simples tests populate ***** */
+
+/**
+ * @brief Test the committed memory is faulted in right away.
+ */
+Test(simple, populate_01)
+{
+	setenv("MSM_POPULATE", "1", 1);
+	cr_assert(my_malloc(100) != NULL);
+	for (size_t offset = 0; offset < secmalloc_default_heap.data_committed; offset += PAGE_HEAP_SIZE)
+	{
+		cr_assert(is_resident((char*)heapdata + offset));
+	}
+	for (size_t offset = 0; offset < secmalloc_default_heap.metadata_committed; offset += PAGE_HEAP_SIZE)
+	{
+		cr_assert(is_resident((char*)heapmetadata + offset));
+	}
+}
+
+/**
+ * @brief Test the prewarm of the heap prepares the next allocations.
+ */
+Test(simple, prewarm_01)
+{
+	cr_assert(secmalloc_prewarm(1048576) == 0);
+	cr_assert(my_lastmetadata()->size >= 1048576 + sizeof(long));
+	char	*last = CHUNK_ADDR(&secmalloc_default_heap, my_lastmetadata());
+	for (size_t offset = PAGE_HEAP_SIZE; offset < 1048576; offset += PAGE_HEAP_SIZE)
+	{
+		cr_assert(is_resident(last + offset));
+	}
+
+	size_t	syscalls = secmalloc_default_heap.growth_syscalls;
+	for (int i = 0; i < 16; i++)
+	{
+		cr_assert(my_malloc(65536 - sizeof(long)) != NULL);
+	}
+	cr_assert(secmalloc_default_heap.growth_syscalls == syscalls);
+}
+
+/**
+ * @brief Test the prewarm of a pool maps its slabs ahead.
+ */
+Test(simple, prewarm_02)
+{
+	struct secmalloc_pool	*pool = secmalloc_pool_create(64, 0);
+	cr_assert(secmalloc_pool_prewarm(pool, 1000) == 0);
+	struct pool_slab	*slabs = pool->slabs;
+	cr_assert(slabs != NULL);
+	cr_assert(is_resident(slabs));
+	for (int i = 0; i < 1000; i++)
+	{
+		cr_assert(secmalloc_pool_alloc(pool) != NULL);
+	}
+	cr_assert(pool->slabs == slabs);
+	secmalloc_pool_destroy(pool);
+}
+
+/**
+ * @brief Test the prewarm of size classes splits their first blocks ahead and grows the heap for all of them.
+ */
+Test(simple, prewarm_03)
+{
+	struct secmalloc_prewarm_class	classes[] = {{32, 4}, {100, 20}, {5000, 3}};
+	cr_assert(secmalloc_prewarm_classes(classes, 3) == 0);
+	struct secmalloc_heap	*heap = &secmalloc_default_heap;
+	cr_assert(heap->defer_counts[(32 - 1) / DEFER_BIN_SIZE] == 4);
+	cr_assert(heap->defer_counts[(100 - 1) / DEFER_BIN_SIZE] == DEFER_BIN_DEPTH);
+
+	// The first blocks of the cached classes are taken back without a split
+	size_t	syscalls = heap->growth_syscalls;
+	size_t	slots = heap->fit_count;
+	for (int i = 0; i < 4; i++)
+	{
+		struct chunkmetadata	*seeded = heap->metadata + heap->defer_bins[(32 - 1) / DEFER_BIN_SIZE][3 - i] - 1;
+		cr_assert(my_malloc(32) == CHUNK_ADDR(heap, seeded));
+	}
+	for (int i = 0; i < DEFER_BIN_DEPTH; i++)
+	{
+		cr_assert(my_malloc(100) != NULL);
+	}
+	cr_assert(heap->fit_count == slots);
+
+	// The other blocks are split from the prepared end of the heap
+	for (int i = 0; i < 20 - DEFER_BIN_DEPTH; i++)
+	{
+		cr_assert(my_malloc(100) != NULL);
+	}
+	for (int i = 0; i < 3; i++)
+	{
+		cr_assert(my_malloc(5000) != NULL);
+	}
+	cr_assert(heap->growth_syscalls == syscalls);
+	cr_assert(secmalloc_prewarm_classes(NULL, 0) == 0);
+	struct secmalloc_prewarm_class	invalid = {0, 1};
+	cr_assert(secmalloc_prewarm_classes(&invalid, 1) == -1);
+}
+
+/* ***** End of simples tests populate ***** */
+
+/* ***** Begin of simples tests numa ***** */
+
+/**
+ * @brief Test the default heap is used on single-node systems.
+ */
+Test(simple, numa_01)
+{
+	unsetenv("MSM_NUMA");
+	if (secmalloc_numa_nodes() > 1)
+	{
+		return;
+	}
+	char	*ptr = secmalloc_numa_alloc(100);
+	cr_assert(ptr != NULL);
+	cr_assert(my_heap_segment(&secmalloc_default_heap, ptr) != NULL);
+	secmalloc_numa_free(ptr);
+	cr_assert(heapmetadata->flags == FREE);
+}
+
+/**
+ * @brief Test the heap of the node is bound to the node.
+ */
+Test(simple, numa_02)
+{
+	setenv("MSM_NUMA", "1", 1);
+	int		node = secmalloc_numa_node();
+	char	*ptr = secmalloc_numa_alloc(100);
+	cr_assert(ptr != NULL);
+	memset(ptr, 'A', 100);
+	cr_assert(heapdata == NULL);
+
+	int				mode = -1;
+	unsigned long	mask = 0;
+	cr_assert(syscall(SYS_get_mempolicy, &mode, &mask, sizeof(mask) * 8, ptr, MPOL_F_ADDR) == 0);
+	cr_assert(mode == MPOL_PREFERRED);
+	cr_assert(mask == 1UL << node);
+
+	struct secmalloc_stats	stats;
+	cr_assert(secmalloc_numa_stats(node, &stats) == 0);
+	cr_assert(stats.data_size > 0);
+	secmalloc_numa_free(ptr);
+	cr_assert(heapdata == NULL);
+}
+
+/**
+ * @brief Test the statistics of an invalid node.
+ */
+Test(simple, numa_03)
+{
+	struct secmalloc_stats	stats;
+	cr_assert(secmalloc_numa_stats(-1, &stats) == -1);
+	cr_assert(secmalloc_numa_stats(NUMA_MAX_NODES, &stats) == -1);
+}
+
+/**
+ * @brief Test my_malloc goes to the heap of the node, whose arrays along the metadata are bound to the node too.
+ */
+Test(simple, numa_04)
+{
+	setenv("MSM_NUMA", "1", 1);
+	int		node = secmalloc_numa_node();
+	char	*ptr = my_malloc(100);
+	cr_assert(ptr != NULL);
+	memset(ptr, 'A', 100);
+	cr_assert(heapdata == NULL);
+
+	struct secmalloc_heap	*heap = my_numa_owner(ptr);
+	cr_assert(heap != NULL && heap->node == node);
+	void	*ranges[] = {heap->metadata, heap->fit_sizes, heap->fit_nodes, heap->cold};
+	for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++)
+	{
+		int				mode = -1;
+		unsigned long	mask = 0;
+		cr_assert(syscall(SYS_get_mempolicy, &mode, &mask, sizeof(mask) * 8, ranges[i], MPOL_F_ADDR) == 0);
+		cr_assert(mode == MPOL_PREFERRED);
+		cr_assert(mask == 1UL << node);
+	}
+
+	// The block moves to a new block of the heap of the node, the old one is freed
+	char	*ptr2 = my_realloc(ptr, 1000);
+	cr_assert(ptr2 != NULL && my_numa_owner(ptr2) == heap);
+	cr_assert(ptr2[0] == 'A' && ptr2[99] == 'A');
+	my_free(ptr2);
+	cr_assert(heap->metadata->flags == FREE && CHUNK_NEXT(heap, heap->metadata) == NULL);
+	cr_assert(heapdata == NULL);
+}
+
+static int	numa_locked = 0; // Whether the thread of numa_05 holds the lock, set back to 0 to release it
+
+/**
+ * @brief Hold the lock of a heap until released, for numa_05.
+ */
+static void* numa_lock_thread(void *arg)
+{
+	struct secmalloc_heap	*heap = arg;
+	pthread_mutex_lock(&heap->lock);
+	__atomic_store_n(&numa_locked, 1, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&numa_locked, __ATOMIC_ACQUIRE) == 1)
+	{
+		sched_yield();
+	}
+	pthread_mutex_unlock(&heap->lock);
+	return NULL;
+}
+
+/**
+ * @brief Test the owner of a block is found without the lock of the heaps, and realloc checks the canary before copying.
+ */
+Test(simple, numa_05)
+{
+	char	path[64];
+	snprintf(path, sizeof(path), "/tmp/msm_numa_05_%d", getpid());
+	unlink(path);
+	setenv("MSM_OUTPUT", path, 1);
+	setenv("MSM_LOG_LEVEL", "error", 1);
+	setenv("MSM_NUMA", "1", 1);
+	char	*ptr = my_malloc(100);
+	struct secmalloc_heap	*heap = my_numa_owner(ptr);
+	cr_assert(heap != NULL);
+	cr_assert(my_numa_owner(NULL) == NULL);
+
+	// Another thread holds the lock of the heap while the owner is looked up
+	pthread_t	thread;
+	cr_assert(pthread_create(&thread, NULL, numa_lock_thread, heap) == 0);
+	while (__atomic_load_n(&numa_locked, __ATOMIC_ACQUIRE) == 0)
+	{
+		sched_yield();
+	}
+	cr_assert(my_numa_owner(ptr) == heap);
+	cr_assert(my_numa_owner(ptr + 50) == heap);
+	__atomic_store_n(&numa_locked, 0, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+
+	// The overflow is reported before the block is moved
+	ptr[100] ^= 1;
+	char	*ptr2 = my_realloc(ptr, 1000);
+	cr_assert(ptr2 != NULL);
+	char	buf[4096] = {0};
+	int		fd = open(path, O_RDONLY);
+	cr_assert(fd != -1);
+	cr_assert(read(fd, buf, sizeof(buf) - 1) > 0);
+	cr_assert(strstr(buf, "Canary verification failed") != NULL);
+	close(fd);
+	unlink(path);
+	my_free(ptr2);
+}
+
+/* ***** End of simples tests numa ***** */
+
+/* ***** Begin of simples tests metadata ***** */
+
+/**
+ * @brief Test the metadata walked by the lookups and the merges is split from the cold one, four entries per cache line.
+ */
+Test(simple, metadata_01)
+{
+	cr_assert(sizeof(struct chunkmetadata) == 16);
+	cr_assert(64 / sizeof(struct chunkmetadata) == 4);
+	cr_assert(sizeof(struct chunkcold) == 16);
+
+	char	*ptr = my_malloc(100);
+	cr_assert((char*)CHUNK_NEXT(&secmalloc_default_heap, heapmetadata) - (char*)heapmetadata == 16);
+	cr_assert(heapmetadata->segment == 0 && heapmetadata->offset == 0);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)->offset == 100 + sizeof(long));
+	my_free(ptr);
+}
+
+/**
+ * @brief Test the free time of a block takes the place of its canary.
+ */
+Test(simple, metadata_02)
+{
+	char	*ptr = my_malloc(100);
+	char	*ptr2 = my_malloc(100);
+	cr_assert(CHUNK_COLD(&secmalloc_default_heap, heapmetadata)->canary == *(long*)(ptr + 100));
+	my_free(ptr);
+	cr_assert(heapmetadata->flags == FREE);
+	cr_assert(CHUNK_COLD(&secmalloc_default_heap, heapmetadata)->freed_at > 0 && heapmetadata->state == CHUNK_USED);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)->flags == BUSY);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)->size == 100);
+	cr_assert(my_get_allocated_heapmetadata_size() == 3 * 16);
+	cr_assert(my_malloc(CHUNK_MAX_SIZE) == NULL);
+	my_free(ptr2);
+}
+
+/**
+ * @brief Test the cold metadata records the caller of the allocation.
+ */
+Test(simple, metadata_03)
+{
+	struct secmalloc_heap	*heap = secmalloc_heap_create();
+	char	*ptr = my_malloc(100);
+	char	*ptr2 = secmalloc_heap_alloc(heap, 100);
+	cr_assert(CHUNK_COLD(&secmalloc_default_heap, heapmetadata)->site != NULL);
+	cr_assert(CHUNK_COLD(heap, heap->metadata)->site != NULL);
+	cr_assert(CHUNK_COLD(heap, heap->metadata)->site != CHUNK_COLD(&secmalloc_default_heap, heapmetadata)->site);
+	cr_assert(my_heap_allocated_metadata_size(heap) == 2 * 16);
+	cr_assert(CHUNK_ADDR(heap, heap->metadata) == ptr2);
+	my_free(ptr);
+	secmalloc_heap_free(heap, ptr2);
+	secmalloc_heap_destroy(heap);
+}
+
+/**
+ * @brief Test the counters read by the allocations follow the list, and the slots of merged blocks are reused.
+ */
+Test(simple, metadata_04)
+{
+	struct secmalloc_heap	*heap = secmalloc_heap_create();
+	char					*ptr[200];
+	for (int i = 0; i < 200; i++)
+	{
+		ptr[i] = secmalloc_heap_alloc(heap, 16 + (i * 37) % 300);
+	}
+	for (int i = 0; i < 200; i += 2)
+	{
+		secmalloc_heap_free(heap, ptr[i]);
+	}
+	size_t	slots = my_heap_allocated_metadata_size(heap);
+	for (int i = 0; i < 200; i += 2)
+	{
+		ptr[i] = secmalloc_heap_alloc(heap, 16 + (i * 41) % 300);
+	}
+	cr_assert(my_heap_allocated_metadata_size(heap) <= slots + 100 * sizeof(struct chunkmetadata));
+
+	// Walk the list as the allocations did before the counters
+	struct chunkmetadata	*last = NULL;
+	size_t					size = 0;
+	size_t					highest = 0;
+	for (struct chunkmetadata *item = heap->metadata; item != NULL; item = CHUNK_NEXT(heap, item))
+	{
+		size += item->size + sizeof(long);
+		highest = (size_t)(item - heap->metadata) > highest ? (size_t)(item - heap->metadata) : highest;
+		last = item;
+	}
+	cr_assert(my_heap_lastmetadata(heap) == last);
+	cr_assert(my_heap_allocated_data_size(heap) == size - (last->flags == FREE ? last->size : 0));
+	cr_assert(my_heap_allocated_metadata_size(heap) >= (highest + 1) * sizeof(struct chunkmetadata));
+
+	for (int i = 0; i < 200; i++)
+	{
+		secmalloc_heap_free(heap, ptr[i]);
+	}
+	my_heap_trim(heap, 0);
+	cr_assert(CHUNK_NEXT(heap, heap->metadata) == NULL);
+	cr_assert(my_heap_lastmetadata(heap) == heap->metadata);
+	cr_assert(my_heap_allocated_metadata_size(heap) == sizeof(struct chunkmetadata));
+	cr_assert(my_heap_allocated_data_size(heap) == sizeof(long));
+	secmalloc_heap_destroy(heap);
+}
+
+/**
+ * @brief Test the state of a chunk lives in its own bits, a canary of any value is not taken for a state.
+ */
+Test(simple, metadata_05)
+{
+	struct secmalloc_heap	*heap = &secmalloc_default_heap;
+	long	canaries[] = {-1, -2, 0xdeadbeef};
+	for (int i = 0; i < 3; i++)
+	{
+		char	*ptr = my_malloc(100);
+		char	*ptr2 = my_malloc(100);
+		struct chunkmetadata	*item;
+		cr_assert(my_shadow_classify(heap, ptr, &item) == SHADOW_BUSY);
+		cr_assert(item->state == CHUNK_USED);
+		CHUNK_COLD(heap, item)->canary = canaries[i];
+		*(long*)(ptr + 100) = canaries[i];
+		my_free(ptr);
+		cr_assert(item->flags == FREE && item->state == CHUNK_USED);
+		my_free(ptr2);
+	}
+	cr_assert(secmalloc_purge(NULL) > 0);
+	cr_assert(heap->metadata->flags == FREE && heap->metadata->state == CHUNK_PURGED);
+}
+
+/* ***** End of simples tests metadata ***** */
+
+/* ***** Begin of simples tests fit ***** */
+
+/**
+ * @brief Test the free sizes of the slots follow the blocks.
+ */
+Test(simple, fit_01)
+{
+	char	*ptr = my_malloc(100);
+	char	*ptr2 = my_malloc(200);
+	char	*ptr3 = my_malloc(100);
+	struct chunkmetadata	*item = CHUNK_NEXT(&secmalloc_default_heap, heapmetadata);
+	cr_assert(secmalloc_default_heap.fit_sizes[item - heapmetadata] == 0);
+	my_free(ptr2);
+	cr_assert(secmalloc_default_heap.fit_sizes[item - heapmetadata] == 200);
+
+	// The first block large enough is reused
+	char	*ptr4 = my_malloc(150);
+	cr_assert(ptr4 == ptr2);
+	cr_assert(secmalloc_default_heap.fit_sizes[item - heapmetadata] == 0);
+	cr_assert(secmalloc_default_heap.fit_sizes[CHUNK_NEXT(&secmalloc_default_heap, item) - heapmetadata] == 200 - 150 - sizeof(long));
+	my_free(ptr);
+	my_free(ptr3);
+	my_free(ptr4);
+}
+
+#if !TLSF
+/**
+ * @brief Check the scan of the free sizes finds the same block as a first-fit walk of the list.
+ */
+static void check_first_fit()
+{
+	setenv("MSM_BEST_FIT", "0", 1);
+	char	*ptr[64];
+	for (int i = 0; i < 64; i++)
+	{
+		ptr[i] = my_malloc(16 + (i * 37) % 500);
+	}
+	for (int i = 0; i < 64; i += 3)
+	{
+		my_free(ptr[i]);
+	}
+
+	// The slots follow the list first, then a merge leaves a slot that a split earlier in the list takes
+	for (int round = 0; round < 2; round++)
+	{
+		cr_assert((secmalloc_default_heap.fit_unordered == 0) == (round == 0));
+		for (size_t size = 8; size < 600; size += 16)
+		{
+			struct chunkmetadata	*expected = NULL;
+			for (struct chunkmetadata *item = heapmetadata; item != NULL; item = CHUNK_NEXT(&secmalloc_default_heap, item))
+			{
+				if (item->flags == FREE && item->size >= size + sizeof(long))
+				{
+					expected = item;
+					break;
+				}
+			}
+			cr_assert(my_fit_lookup(&secmalloc_default_heap, size + sizeof(long)) == expected);
+		}
+		if (round == 0)
+		{
+			my_free(ptr[1]);
+			my_free(ptr[4]);
+			cr_assert(my_malloc(8) == ptr[0]);
+		}
+	}
+}
+
+/**
+ * @brief Test the vector scan matches a first-fit walk of the list.
+ */
+Test(simple, fit_02)
+{
+	check_first_fit();
+}
+
+/**
+ * @brief Test the scalar scan matches a first-fit walk of the list.
+ */
+Test(simple, fit_03)
+{
+	setenv("MSM_FIT_SCAN", "scalar", 1);
+	check_first_fit();
+}
+
+#endif
+
+/* ***** End of simples tests fit ***** */
+
+/* ***** Begin of simples tests best fit ***** */
+
+#if !TLSF
+
+/**
+ * @brief Test medium allocations take the smallest free block that fits.
+ */
+Test(simple, best_fit_01)
+{
+	char	*ptr = my_malloc(3000);
+	char	*ptr2 = my_malloc(100);
+	char	*ptr3 = my_malloc(1000);
+	char	*ptr4 = my_malloc(100);
+	my_free(ptr);
+	my_free(ptr3);
+
+	// First fit would split the first block
+	char	*ptr5 = my_malloc(900);
+	cr_assert(ptr5 == ptr3);
+	char	*ptr6 = my_malloc(2000);
+	cr_assert(ptr6 == ptr);
+
+	// Small allocations stay first fit
+	my_free(ptr5);
+	char	*ptr7 = my_malloc(16);
+	cr_assert(ptr7 == ptr + 2000 + sizeof(long));
+	my_free(ptr2);
+	my_free(ptr4);
+	my_free(ptr6);
+	my_free(ptr7);
+}
+
+/**
+ * @brief Compute the height of a subtree of the best-fit tree and check it is balanced and ordered by size then by slot.
+ */
+static unsigned int check_fit_nodes(struct secmalloc_heap *heap, unsigned int n, size_t *count, unsigned int *prev)
+{
+	if (n == 0)
+	{
+		return 0;
+	}
+	struct fit_node	*node = &heap->fit_nodes[n - 1];
+	unsigned int	left = check_fit_nodes(heap, node->left, count, prev);
+	cr_assert(*prev == 0 || heap->fit_nodes[*prev - 1].size < node->size || (heap->fit_nodes[*prev - 1].size == node->size && *prev < n));
+	cr_assert(heap->metadata[n - 1].flags == FREE && heap->metadata[n - 1].size == node->size);
+	*prev = n;
+	unsigned int	right = check_fit_nodes(heap, node->right, count, prev);
+	cr_assert(left <= right + 1 && right <= left + 1);
+	cr_assert(node->height == 1 + (left > right ? left : right));
+	(*count)++;
+	return node->height;
+}
+
+/**
+ * @brief Check a lookup takes the smallest free block that fits, the free end of the heap only when no other one fits.
+ */
+static void check_best_fit(struct secmalloc_heap *heap, size_t size)
+{
+	struct chunkmetadata	*expected = NULL;
+	for (struct chunkmetadata *item = heap->metadata; CHUNK_NEXT(heap, item) != NULL; item = CHUNK_NEXT(heap, item))
+	{
+		if (item->flags == FREE && item->size >= size + sizeof(long) && (expected == NULL || item->size < expected->size))
+		{
+			expected = item;
+		}
+	}
+	struct chunkmetadata	*last = my_heap_lastmetadata(heap);
+	if (expected == NULL && last->flags == FREE && last->size >= size + sizeof(long))
+	{
+		expected = last;
+	}
+	struct chunkmetadata	*found = my_fit_lookup(heap, size + sizeof(long));
+	cr_assert((found == NULL && expected == NULL) || found->size == expected->size);
+}
+
+/**
+ * @brief Test the best-fit tree holds the smallest free block that fits and stays balanced.
+ */
+Test(simple, best_fit_02)
+{
+	char	*ptr[256];
+	for (int i = 0; i < 256; i++)
+	{
+		ptr[i] = my_malloc(512 + (i * 7919) % 4000);
+	}
+	for (int i = 0; i < 256; i += 2)
+	{
+		my_free(ptr[i]);
+	}
+
+	size_t			count = 0;
+	unsigned int	prev = 0;
+	cr_assert(check_fit_nodes(&secmalloc_default_heap, secmalloc_default_heap.fit_root, &count, &prev) <= 12);
+	cr_assert(count == 128);
+
+	for (size_t size = 512; size < 5000; size += 64)
+	{
+		check_best_fit(&secmalloc_default_heap, size);
+	}
+}
+
+/**
+ * @brief Test the best-fit tree indexes exactly the free blocks of a heap of many blocks, through merges and reused slots.
+ */
+Test(simple, best_fit_03)
+{
+	struct secmalloc_heap	*heap = secmalloc_heap_create();
+	static char				*ptr[4096];
+	for (int i = 0; i < 4096; i++)
+	{
+		ptr[i] = secmalloc_heap_alloc(heap, 512 + (i * 7919) % 4000);
+		cr_assert(ptr[i] != NULL);
+	}
+
+	// Runs of four frees merge, the allocations then split the merged blocks and take the slots left
+	for (int i = 0; i < 4096; i++)
+	{
+		if (i % 5 != 0)
+		{
+			secmalloc_heap_free(heap, ptr[i]);
+			ptr[i] = NULL;
+		}
+	}
+	for (int i = 1; i < 4096; i += 5)
+	{
+		ptr[i] = secmalloc_heap_alloc(heap, 512 + (i * 104729) % 3000);
+		cr_assert(ptr[i] != NULL);
+	}
+	my_heap_defer_flush(heap);
+
+	size_t	free_blocks = 0;
+	for (struct chunkmetadata *item = heap->metadata; CHUNK_NEXT(heap, item) != NULL; item = CHUNK_NEXT(heap, item))
+	{
+		if (item->flags == FREE && item->size >= my_config()->best_fit)
+		{
+			cr_assert(heap->fit_nodes[item - heap->metadata].size == item->size);
+			free_blocks++;
+		}
+	}
+	size_t			count = 0;
+	unsigned int	prev = 0;
+	cr_assert(check_fit_nodes(heap, heap->fit_root, &count, &prev) <= 18);
+	cr_assert(count == free_blocks);
+	cr_assert(free_blocks > 500);
+
+	for (size_t size = 512; size < 8000; size += 32)
+	{
+		check_best_fit(heap, size);
+	}
+	secmalloc_heap_destroy(heap);
+}
+
+#endif
+
+/* ***** End of simples tests best fit ***** */
+
+/* ***** Begin of simples tests tlsf ***** */
+
+#if TLSF
+
+/**
+ * @brief Test the lookup finds a free block of the first class large enough.
+ */
+Test(simple, tlsf_01)
+{
+	char	*ptr = my_malloc(3000);
+	char	*ptr2 = my_malloc(100);
+	char	*ptr3 = my_malloc(1000);
+	char	*ptr4 = my_malloc(100);
+	my_free(ptr);
+	my_free(ptr3);
+	cr_assert(heapmetadata->flags == FREE);
+
+	// The block of 1000 bytes is in a class too small once the size is rounded up, the first block is in the next class
+	cr_assert(my_fit_lookup(&secmalloc_default_heap, 990 + sizeof(long)) == heapmetadata);
+	cr_assert(my_fit_lookup(&secmalloc_default_heap, 990 + sizeof(long))->size >= my_fit_round(990 + sizeof(long)));
+	cr_assert(my_fit_lookup(&secmalloc_default_heap, 500 + sizeof(long)) == CHUNK_NEXT(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)));
+	my_free(ptr2);
+	my_free(ptr4);
+}
+
+/**
+ * @brief Test free merges a block with both its neighbours.
+ */
+Test(simple, tlsf_02)
+{
+	char	*ptr = my_malloc(100);
+	char	*ptr2 = my_malloc(200);
+	char	*ptr3 = my_malloc(300);
+	char	*ptr4 = my_malloc(400);
+	my_free(ptr);
+	my_free(ptr3);
+	cr_assert(my_fit_prev(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata))) == CHUNK_NEXT(&secmalloc_default_heap, heapmetadata));
+	my_free(ptr2);
+	cr_assert(heapmetadata->flags == FREE);
+	cr_assert(heapmetadata->size == 100 + 200 + 300 + 2 * sizeof(long));
+	cr_assert(CHUNK_ADDR(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)) == ptr4);
+	cr_assert(my_fit_prev(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)) == heapmetadata);
+	my_free(ptr4);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata) == NULL);
+}
+
+/**
+ * @brief Test an allocation missing the free blocks grows the heap rather than failing.
+ */
+Test(simple, tlsf_03)
+{
+	char	*ptr[64];
+	for (int i = 0; i < 64; i++)
+	{
+		ptr[i] = my_malloc(16 + (i * 37) % 500);
+		cr_assert(ptr[i] != NULL);
+	}
+	for (int i = 0; i < 64; i += 2)
+	{
+		my_free(ptr[i]);
+	}
+	for (int i = 0; i < 64; i += 2)
+	{
+		ptr[i] = my_malloc(16 + (i * 41) % 500);
+		cr_assert(ptr[i] != NULL);
+	}
+	for (int i = 0; i < 64; i++)
+	{
+		my_free(ptr[i]);
+	}
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata) == NULL);
+}
+
+/**
+ * @brief Test the cost of an allocation does not grow with the number of blocks of the heap.
+ */
+Test(simple, tlsf_04)
+{
+	struct secmalloc_heap	*heap = secmalloc_heap_create();
+	static char				*ptr[20000];
+	size_t					count = 0;
+	long					cost[2];
+
+	for (int round = 0; round < 2; round++)
+	{
+		// A heap of a few blocks first, then a heap of 20000 blocks
+		size_t	population = round == 0 ? 16 : 20000;
+		while (count < population)
+		{
+			ptr[count] = secmalloc_heap_alloc(heap, 32);
+			cr_assert(ptr[count++] != NULL);
+		}
+
+		// The best of a few runs of the CPU time of the thread, the other processes are left out
+		cost[round] = -1;
+		for (int run = 0; run < 5; run++)
+		{
+			struct timespec	start;
+			struct timespec	end;
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+			for (int i = 0; i < 1000; i++)
+			{
+				secmalloc_heap_free(heap, secmalloc_heap_alloc(heap, 48));
+			}
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+			long	elapsed = (end.tv_sec - start.tv_sec) * 1000000000L + end.tv_nsec - start.tv_nsec;
+			cost[round] = cost[round] == -1 || elapsed < cost[round] ? elapsed : cost[round];
+		}
+	}
+	cr_assert(cost[1] < 4 * cost[0], "%ld ns for 1000 allocations among 20000 blocks, %ld ns among 16 blocks", cost[1], cost[0]);
+	secmalloc_heap_destroy(heap);
+}
+
+#endif
+
+/* ***** End of simples tests tlsf ***** */
+
+/* ***** Begin of simples tests buddy ***** */
+
+/**
+ * @brief Test page-sized blocks come from the buddy zone and merge back when freed.
+ */
+Test(simple, buddy_01)
+{
+	setenv("MSM_BUDDY", "1", 1);
+	char	*small = my_malloc(100);
+	char	*ptr = my_malloc(PAGE_HEAP_SIZE);
+	char	*ptr2 = my_malloc(3 * PAGE_HEAP_SIZE);
+	char	*ptr3 = my_malloc(PAGE_HEAP_SIZE - sizeof(long));
+	struct buddy_zone	*zone = secmalloc_default_heap.buddy;
+	cr_assert(zone != NULL);
+	cr_assert(my_heap_segment(&secmalloc_default_heap, small) != NULL);
+	cr_assert(ptr == zone->base);
+	cr_assert(ptr2 == zone->base + 4 * PAGE_HEAP_SIZE);
+	cr_assert(ptr3 == zone->base + 2 * PAGE_HEAP_SIZE);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)) == NULL);
+	memset(ptr2, 'A', 3 * PAGE_HEAP_SIZE);
+
+	my_free(ptr);
+	my_free(ptr3);
+	my_free(ptr2);
+	cr_assert(zone->orders == 1UL << BUDDY_MAX_ORDER);
+	cr_assert(zone->heads[BUDDY_MAX_ORDER] == 1);
+	cr_assert(ptr2[0] == 0);
+	my_free(small);
+}
+
+/**
+ * @brief Test double and invalid frees of the buddy zone are rejected.
+ */
+Test(simple, buddy_02)
+{
+	setenv("MSM_BUDDY", "1", 1);
+	char	*ptr = my_malloc(2 * PAGE_HEAP_SIZE);
+	char	*ptr2 = my_malloc(2 * PAGE_HEAP_SIZE);
+	struct buddy_zone	*zone = secmalloc_default_heap.buddy;
+	my_free(ptr);
+	size_t	orders = zone->orders;
+	my_free(ptr);
+	my_free(ptr2 + 8);
+	my_free(zone->base + 64 * BUDDY_BLOCK_SIZE);
+	cr_assert(zone->orders == orders);
+	cr_assert(my_buddy_size(&secmalloc_default_heap, ptr2) == 2 * PAGE_HEAP_SIZE);
+	my_free(ptr2);
+	cr_assert(zone->orders == 1UL << BUDDY_MAX_ORDER);
+}
+
+/**
+ * @brief Test realloc moves blocks in and out of the buddy zone.
+ */
+Test(simple, buddy_03)
+{
+	setenv("MSM_BUDDY", "1", 1);
+	char	*ptr = my_malloc(100);
+	memset(ptr, 'A', 100);
+	ptr = my_realloc(ptr, 2 * PAGE_HEAP_SIZE);
+	cr_assert(my_buddy_owns(&secmalloc_default_heap, ptr));
+	cr_assert(ptr[99] == 'A');
+	memset(ptr, 'B', 2 * PAGE_HEAP_SIZE);
+	ptr = my_realloc(ptr, 200);
+	cr_assert(!my_buddy_owns(&secmalloc_default_heap, ptr));
+	cr_assert(ptr[199] == 'B');
+	cr_assert(secmalloc_default_heap.buddy->orders == 1UL << BUDDY_MAX_ORDER);
+	my_free(ptr);
+}
+
+/* ***** End of simples tests buddy ***** */
+
+/* ***** Begin of simples tests defer ***** */
+
+/**
+ * @brief Test deferred frees are reused for the same size and merged in a batch.
+ */
+Test(simple, defer_01)
+{
+	setenv("MSM_DEFER", "4", 1);
+	char	*ptr = my_malloc(100);
+	char	*ptr2 = my_malloc(100);
+	char	*ptr3 = my_malloc(100);
+	my_free(ptr);
+	my_free(ptr2);
+	my_free(ptr2);
+	cr_assert(secmalloc_default_heap.defer_pending == 2);
+	cr_assert(heapmetadata->flags == FREE);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)->flags == FREE);
+	cr_assert(CHUNK_ADDR(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)) == ptr2);
+
+	// The last block freed is taken back without a split
+	char	*ptr4 = my_malloc(100);
+	cr_assert(ptr4 == ptr2);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)->size == 100);
+	cr_assert(my_verify_canary(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)) == 1);
+	my_free(ptr4);
+	cr_assert(secmalloc_default_heap.defer_pending == 3);
+
+	// The fourth free runs the batch merge
+	my_free(ptr3);
+	cr_assert(secmalloc_default_heap.defer_pending == 0);
+	cr_assert(heapmetadata->flags == FREE);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata) == NULL);
+}
+
+/**
+ * @brief Test the trim merges the deferred frees first.
+ */
+Test(simple, defer_02)
+{
+	setenv("MSM_DEFER", "100", 1);
+	char	*ptr[10];
+	for (int i = 0; i < 10; i++)
+	{
+		ptr[i] = my_malloc(100);
+	}
+	for (int i = 0; i < 10; i++)
+	{
+		my_free(ptr[i]);
+	}
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata) != NULL);
+	secmalloc_trim(0);
+	cr_assert(secmalloc_default_heap.defer_pending == 0);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata) == NULL);
+}
+
+/* ***** End of simples tests defer ***** */
+
+/* ***** Begin of simples tests shadow ***** */
+
+/**
+ * @brief Test the shadow classifies busy, free, interior and foreign pointers.
+ */
+Test(simple, shadow_01)
+{
+	char					*ptr = my_malloc(1);
+	char					*ptr2 = my_malloc(1);
+	char					*ptr3 = my_malloc(100);
+	struct chunkmetadata	*item;
+	int						foreign;
+
+	// Blocks of one byte and their canary start in distinct granules
+	cr_assert(my_shadow_classify(&secmalloc_default_heap, ptr2, &item) == SHADOW_BUSY);
+	cr_assert(CHUNK_ADDR(&secmalloc_default_heap, item) == ptr2);
+	cr_assert(my_shadow_classify(&secmalloc_default_heap, ptr3 + 8, &item) == SHADOW_INTERIOR);
+	cr_assert(item == NULL);
+	cr_assert(my_shadow_classify(&secmalloc_default_heap, &foreign, &item) == SHADOW_FOREIGN);
+
+	my_free(ptr2);
+	cr_assert(my_shadow_classify(&secmalloc_default_heap, ptr2, &item) == SHADOW_FREE);
+	cr_assert(item == CHUNK_NEXT(&secmalloc_default_heap, heapmetadata));
+	cr_assert(my_shadow_classify(&secmalloc_default_heap, ptr3, &item) == SHADOW_BUSY);
+
+	// Once merged the block is no longer the start of a chunk
+	my_free(ptr);
+	cr_assert(my_shadow_classify(&secmalloc_default_heap, ptr2, &item) == SHADOW_INTERIOR);
+	cr_assert(my_shadow_classify(&secmalloc_default_heap, ptr, &item) == SHADOW_FREE);
+}
+
+/**
+ * @brief Test double, interior and stale frees and reallocs leave the heap untouched.
+ */
+Test(simple, shadow_02)
+{
+	char	*ptr = my_malloc(100);
+	char	*ptr2 = my_malloc(100);
+	char	*ptr3 = my_malloc(100);
+	my_free(ptr2);
+	my_free(ptr2);
+	my_free(ptr3 + 1);
+	cr_assert(heapmetadata->flags == BUSY);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata)->flags == FREE);
+	cr_assert(CHUNK_ADDR(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata))) == ptr3);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata))->flags == BUSY);
+	cr_assert(my_realloc(ptr2, 200) == NULL);
+	cr_assert(my_realloc(ptr3 + 1, 200) == NULL);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, CHUNK_NEXT(&secmalloc_default_heap, heapmetadata))->flags == BUSY);
+
+	// The chunks of a new segment are found from the shadow of that segment
+	char	*ptr4 = my_malloc(HEAP_SEGMENT_SIZE);
+	cr_assert(ptr4 == secmalloc_default_heap.segments[1].base);
+	char	*ptr5 = my_malloc(100);
+	my_free(ptr4);
+	my_free(ptr4);
+	cr_assert(my_realloc(ptr5, 50) != NULL);
+	my_free(ptr);
+}
+
+/* ***** End of simples tests shadow ***** */
+
+/* ***** Begin of simples tests quarantine ***** */
+
+/**
+ * @brief Test freed blocks are held in quarantine and written ones are detected.
+ */
+Test(simple, quarantine_01)
+{
+	setenv("MSM_QUARANTINE", "50", 1);
+	struct secmalloc_stats	stats;
+	char	*ptr = my_malloc(100);
+	char	*ptr2 = my_malloc(100);
+	my_free(ptr);
+	cr_assert(heapmetadata->flags == BUSY);
+	secmalloc_heap_stats(NULL, &stats);
+	cr_assert(stats.quarantine_bytes == 100 + sizeof(long));
+
+	// The block in quarantine is neither reused nor freed twice
+	my_free(ptr);
+	cr_assert(my_realloc(ptr, 200) == NULL);
+	char	*ptr3 = my_malloc(100);
+	cr_assert(ptr3 != ptr);
+	secmalloc_heap_stats(NULL, &stats);
+	cr_assert(stats.quarantine_bytes == 100 + sizeof(long));
+
+	// A write after free is found when the block leaves the quarantine
+	ptr[10] = 'x';
+	secmalloc_trim(0);
+	secmalloc_heap_stats(NULL, &stats);
+	cr_assert(stats.quarantine_bytes == 0);
+	cr_assert(stats.use_after_free == 1);
+	cr_assert(heapmetadata->flags == FREE);
+	my_free(ptr2);
+	my_free(ptr3);
+}
+
+/**
+ * @brief Test the quarantine stays within its budget.
+ */
+Test(simple, quarantine_02)
+{
+	setenv("MSM_QUARANTINE", "10", 1);
+	struct secmalloc_stats	stats;
+	char	*ptr[100];
+	for (int i = 0; i < 100; i++)
+	{
+		ptr[i] = my_malloc(1000);
+	}
+	for (int i = 0; i < 100; i++)
+	{
+		my_free(ptr[i]);
+	}
+	secmalloc_heap_stats(NULL, &stats);
+	cr_assert(stats.quarantine_bytes > 0);
+	cr_assert(stats.quarantine_bytes <= secmalloc_default_heap.data_committed / 10);
+	cr_assert(stats.use_after_free == 0);
+
+	// The blocks released are reused without growing the heap
+	size_t	committed = secmalloc_default_heap.data_committed;
+	cr_assert(my_malloc(1000) != NULL);
+	cr_assert(secmalloc_default_heap.data_committed == committed);
+}
+
+/* ***** End of simples tests quarantine ***** */
+
+/* ***** Begin of simples tests config ***** */
+
+/**
+ * @brief Test the tunables are read from the environment and checked by mallopt.
+ */
+Test(simple, config_01)
+{
+	setenv("MSM_SCRUB", "0", 1);
+	setenv("MSM_GROWTH_MIN_STEP", "100000", 1);
+	char	*ptr = my_malloc(100);
+	cr_assert(secmalloc_config.initialized == 1);
+	cr_assert(secmalloc_config.scrub == 0);
+	cr_assert(secmalloc_config.canary == 1);
+	cr_assert(growth_policy.min_step == 25 * PAGE_HEAP_SIZE);
+
+	// Without scrubbing a freed block keeps its data
+	memset(ptr, 'A', 100);
+	my_free(ptr);
+	cr_assert(ptr[0] == 'A');
+
+	cr_assert(secmalloc_mallopt(M_TOP_PAD, 5000) == 1);
+	cr_assert(growth_policy.min_step == 2 * PAGE_HEAP_SIZE);
+	cr_assert(secmalloc_mallopt(M_SECMALLOC_SCRUB, 1) == 1);
+	cr_assert(secmalloc_config.scrub == 1);
+	cr_assert(secmalloc_mallopt(M_SECMALLOC_QUARANTINE, 150) == 1);
+	cr_assert(secmalloc_config.quarantine == 100);
+	cr_assert(secmalloc_mallopt(M_MXFAST, DEFER_BINS * DEFER_BIN_SIZE + 1) == 0);
+	cr_assert(secmalloc_mallopt(M_SECMALLOC_DEFER, -1) == 0);
+	cr_assert(secmalloc_mallopt(12345, 1) == 0);
+}
+
+/**
+ * @brief Test a negative value in the environment is rejected, and disabling the quarantine with mallopt releases its blocks.
+ */
+Test(simple, config_03)
+{
+	setenv("MSM_DEFER", "-1", 1);
+	setenv("MSM_GROWTH_CAP", " -4096", 1);
+	setenv("MSM_QUARANTINE", "50", 1);
+	char	*ptr = my_malloc(100);
+	cr_assert(secmalloc_config.defer == 0);
+	cr_assert(my_getenv_size("MSM_GROWTH_CAP", 7) == 7);
+
+	my_free(ptr);
+	cr_assert(secmalloc_default_heap.quarantine_count == 1);
+	cr_assert(heapmetadata->flags == BUSY);
+	cr_assert(secmalloc_mallopt(M_SECMALLOC_QUARANTINE, 0) == 1);
+	cr_assert(secmalloc_default_heap.quarantine_count == 0);
+	cr_assert(heapmetadata->flags == FREE);
+	cr_assert(CHUNK_NEXT(&secmalloc_default_heap, heapmetadata) == NULL);
+}
+
+/**
+ * @brief Test the mmap threshold set with mallopt enables the buddy zone.
+ */
+Test(simple, config_02)
+{
+	cr_assert(secmalloc_mallopt(M_MMAP_THRESHOLD, BUDDY_BLOCK_SIZE) == 0);
+	cr_assert(secmalloc_mallopt(M_MMAP_THRESHOLD, 2 * PAGE_HEAP_SIZE) == 1);
+	char	*ptr = my_malloc(PAGE_HEAP_SIZE);
+	char	*ptr2 = my_malloc(2 * PAGE_HEAP_SIZE);
+	cr_assert(my_heap_segment(&secmalloc_default_heap, ptr) != NULL);
+	cr_assert(secmalloc_default_heap.buddy != NULL);
+	cr_assert(ptr2 == secmalloc_default_heap.buddy->base);
+	my_free(ptr);
+	my_free(ptr2);
+}
+
+/* ***** End of simples tests config ***** */
+
+/* ***** Begin of simples tests trace ***** */
+
+/**
+ * @brief Test the calls are recorded in the ring of the thread in the trace file.
+ */
+Test(simple, trace_01)
+{
+	char	path[64];
+	snprintf(path, sizeof(path), "/tmp/msm_trace_01_%d", getpid());
+	setenv("MSM_TRACE", path, 1);
+	char	*ptr = my_malloc(100);
+	ptr = my_realloc(ptr, 200);
+	my_free(ptr);
+	cr_assert(my_trace_on == 1);
+
+	int	fd = open(path, O_RDONLY);
+	cr_assert(fd != -1);
+	struct trace_header	*header = mmap(NULL, TRACE_FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	unlink(path);
+	cr_assert(header != MAP_FAILED);
+	cr_assert(header->magic == TRACE_MAGIC);
+	cr_assert(header->rings == 1);
+
+	// The allocation made by realloc is recorded between its call and its return
+	struct trace_ring	*ring = (struct trace_ring*)(header + 1);
+	uint32_t	ops[] = {TRACE_CALL_MALLOC, TRACE_RETURN_MALLOC, TRACE_CALL_REALLOC, TRACE_RETURN_REALLOC, TRACE_CALL_FREE, TRACE_RETURN_FREE};
+	uint64_t	head = ring->head;
+	cr_assert(head >= 6);
+	cr_assert(ring->events[0].size == 100);
+	cr_assert(ring->events[1].addr == ring->events[2].addr);
+	cr_assert(ring->events[head - 1].op == TRACE_RETURN_FREE);
+	cr_assert(ring->events[head - 2].addr == (uint64_t)ptr);
+	for (size_t i = 0, n = 0; n < head; n++)
+	{
+		cr_assert(ring->events[n].tid == ring->tid);
+		cr_assert(n == 0 || ring->events[n].tsc >= ring->events[n - 1].tsc);
+		if (i < 6 && ring->events[n].op == ops[i])
+		{
+			i++;
+		}
+		cr_assert(n < head - 1 || i == 6);
+	}
+	munmap(header, TRACE_FILE_SIZE);
+}
+
+/**
+ * @brief Allocate and free a block, for a thread of trace_02.
+ */
+static void* trace_thread(void *arg)
+{
+	my_free(my_malloc((size_t)arg));
+	return NULL;
+}
+
+/**
+ * @brief Test the ring of an exited thread is claimed again, so more threads than rings are traced.
+ */
+Test(simple, trace_02)
+{
+	char	path[64];
+	snprintf(path, sizeof(path), "/tmp/msm_trace_02_%d", getpid());
+	setenv("MSM_TRACE", path, 1);
+	my_free(my_malloc(16));
+	for (int i = 0; i < 2 * TRACE_RINGS; i++)
+	{
+		pthread_t	thread;
+		cr_assert(pthread_create(&thread, NULL, trace_thread, (void*)(size_t)(100 + i)) == 0);
+		cr_assert(pthread_join(thread, NULL) == 0);
+	}
+
+	int	fd = open(path, O_RDONLY);
+	cr_assert(fd != -1);
+	struct trace_header	*header = mmap(NULL, TRACE_FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	unlink(path);
+	cr_assert(header != MAP_FAILED);
+	cr_assert(header->rings == 2);
+	cr_assert(header->dropped == 0);
+
+	// The ring of the threads holds the events of each of them, the last one owning it
+	struct trace_ring	*ring = (struct trace_ring*)(header + 1) + 1;
+	cr_assert(ring->head == 4 * 2 * TRACE_RINGS);
+	cr_assert(ring->events[ring->head - 4].size == 100 + 2 * TRACE_RINGS - 1);
+	cr_assert(ring->events[ring->head - 1].tid == ring->tid);
+	cr_assert(ring->events[0].tid != ring->tid);
+	munmap(header, TRACE_FILE_SIZE);
+}
+
+/* ***** End of simples tests trace ***** */
@@ -0,0 +1,194 @@
+/**
+ * @file trace_decode.c
+ * @brief Decoder of the binary traces of the allocations.
+ *
+ * This file contains a tool turning a trace file written when MSM_TRACE is set
+ * into the messages the log holds for the same calls. The events of every
+ * thread are merged by time. With -t each message is prefixed by its time
+ * since the start of the trace and by its thread.
+ *
+ * Usage: trace_decode [-t] trace_file
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "trace.h"
+
+/**
+ * @brief Struct to define an event taken from a ring.
+ */
+struct decoded_event
+{
+    struct trace_event    event;    ///< The event
+    uint64_t              order;    ///< Position of the event among those read, to keep the order of a thread on equal times
+};
+
+/**
+ * @brief Compare two events by time.
+ *
+ * @param a The first event.
+ * @param b The second event.
+ * @return int A negative value, zero or a positive value as the first event is before, along or after the second one.
+ */
+static int compare_events(const void *a, const void *b)
+{
+    const struct decoded_event    *x = a;
+    const struct decoded_event    *y = b;
+    if (x->event.tsc != y->event.tsc)
+    {
+        return x->event.tsc < y->event.tsc ? -1 : 1;
+    }
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/**
+ * @brief Print the message of an event.
+ *
+ * @param event The event.
+ * @param header The header of the trace.
+ * @param timed Whether the message is prefixed by its time and thread.
+ */
+static void print_event(const struct trace_event *event, const struct trace_header *header, int timed)
+{
+    void      *addr = (void*)(uintptr_t)event->addr;
+    size_t    size = event->size;
+    int       call = event->op % 2 == 1;
+
+    if (call)
+    {
+        printf("\n\n");
+    }
+    if (timed)
+    {
+        uint64_t    ticks = event->tsc - header->start_tsc;
+        if (header->end_tsc > header->start_tsc)
+        {
+            double    ns = (double)ticks * (header->end_ns - header->start_ns) / (header->end_tsc - header->start_tsc);
+            printf("[%12.3f us] [tid %u] ", ns / 1000, event->tid);
+        }
+        else
+        {
+            printf("[%12lu ticks] [tid %u] ", (unsigned long)ticks, event->tid);
+        }
+    }
+
+    switch (event->op)
+    {
+        case TRACE_CALL_MALLOC:
+            printf("CALL MALLOC SIZE %zu\n", size);
+            break;
+        case TRACE_RETURN_MALLOC:
+            printf("RETURN MALLOC: %p\n", addr);
+            break;
+        case TRACE_CALL_FREE:
+            printf("CALL FREE PTR %p\n", addr);
+            break;
+        case TRACE_RETURN_FREE:
+            printf("RETURN FREE\n");
+            break;
+        case TRACE_CALL_CALLOC:
+            printf("CALL CALLOC nmemb %zu, size %zu\n", (size_t)event->addr, size);
+            break;
+        case TRACE_RETURN_CALLOC:
+            printf("RETURN CALLOC : %p\n", addr);
+            break;
+        case TRACE_CALL_REALLOC:
+            printf("CALL REALLOC ptr %p, size %zu\n", addr, size);
+            break;
+        case TRACE_RETURN_REALLOC:
+            printf("RETURN REALLOC : %p\n", addr);
+            break;
+        default:
+            printf("Unknown event %u\n", event->op);
+            break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int    timed = argc == 3 && strcmp(argv[1], "-t") == 0;
+    if (argc != 2 + timed)
+    {
+        fprintf(stderr, "Usage: %s [-t] trace_file\n", argv[0]);
+        return 1;
+    }
+
+    int    fd = open(argv[1 + timed], O_RDONLY);
+    if (fd == -1)
+    {
+        perror("open");
+        return 1;
+    }
+
+    // Reading the pages of a mapping past the end of the file raises SIGBUS
+    struct stat    st;
+    if (fstat(fd, &st) == -1)
+    {
+        perror("fstat");
+        close(fd);
+        return 1;
+    }
+    if ((size_t)st.st_size < TRACE_FILE_SIZE)
+    {
+        fprintf(stderr, "%s: truncated trace file, %lld bytes out of %zu\n", argv[1 + timed], (long long)st.st_size, TRACE_FILE_SIZE);
+        close(fd);
+        return 1;
+    }
+    const struct trace_header    *header = mmap(NULL, TRACE_FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION)
+    {
+        fprintf(stderr, "%s: not a trace file of version %d\n", argv[1 + timed], TRACE_VERSION);
+        return 1;
+    }
+
+    // Take the events still in the rings, the oldest ones of a full ring were overwritten
+    uint32_t                   rings = header->rings < TRACE_RINGS ? header->rings : TRACE_RINGS;
+    const struct trace_ring    *ring = (const struct trace_ring*)(header + 1);
+    struct decoded_event       *events = malloc(sizeof(struct decoded_event) * TRACE_RING_EVENTS * (rings > 0 ? rings : 1));
+    size_t                     count = 0;
+    if (events == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    for (uint32_t r = 0; r < rings; r++)
+    {
+        uint64_t    head = ring[r].head;
+        uint64_t    first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+        if (first > 0)
+        {
+            fprintf(stderr, "tid %u: %lu oldest events overwritten\n", ring[r].tid, (unsigned long)first);
+        }
+        for (uint64_t n = first; n < head; n++)
+        {
+            events[count].event = ring[r].events[n % TRACE_RING_EVENTS];
+            events[count].order = count;
+            count++;
+        }
+    }
+    if (header->dropped > 0)
+    {
+        fprintf(stderr, "%lu threads not traced, every ring was claimed\n", (unsigned long)header->dropped);
+    }
+
+    qsort(events, count, sizeof(struct decoded_event), compare_events);
+    for (size_t i = 0; i < count; i++)
+    {
+        print_event(&events[i].event, header, timed);
+    }
+
+    free(events);
+    munmap((void*)header, TRACE_FILE_SIZE);
+    return 0;
+}